@@ -0,0 +1,129 @@
+#!/bin/sh
+# (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Benchmark discovery: Run pacredir's discovery passes against a stand-in
+# for systemd-resolved on a private bus, with scripted peers.
+#
+# usage: discovery.sh [-p PEERS] [-i INTERFACES] [-n PASSES] [-l LATE]
+#                     [-a AFTER] [-r MSEC] [-s MSEC] [-e ERRORS]
+#
+#  -p PEERS       number of peers (default 300)
+#  -i INTERFACES  comma separated interfaces peers are spread over,
+#                 '*' for any (default)
+#  -n PASSES      number of discovery passes (default 10)
+#  -l LATE        number of peers showing up late (default 1)
+#  -a AFTER       seconds after start late peers show up (default 2)
+#  -r MSEC        delay for ResolveRecord calls (default 0)
+#  -s MSEC        delay for ResolveService calls (default 0)
+#  -e ERRORS      number of peers failing in ResolveService (default 0)
+
+set -e
+
+BENCH="$(dirname "${0}")"
+PACREDIR="${PACREDIR:-${BENCH}/../pacredir}"
+FAKE="${FAKE:-${BENCH}/fake-resolved}"
+
+PEERS=300
+INTERFACES='*'
+PASSES=10
+LATE=1
+AFTER=2
+DELAY_RECORD=0
+DELAY_SERVICE=0
+ERRORS=0
+
+while getopts 'p:i:n:l:a:r:s:e:' OPT; do
+	case "${OPT}" in
+		p) PEERS="${OPTARG}" ;;
+		i) INTERFACES="${OPTARG}" ;;
+		n) PASSES="${OPTARG}" ;;
+		l) LATE="${OPTARG}" ;;
+		a) AFTER="${OPTARG}" ;;
+		r) DELAY_RECORD="${OPTARG}" ;;
+		s) DELAY_SERVICE="${OPTARG}" ;;
+		e) ERRORS="${OPTARG}" ;;
+		*) exit 1 ;;
+	esac
+done
+
+TMP="$(mktemp -d)"
+trap 'kill ${FAKE_PID} ${DBUS_PID} 2>/dev/null; rm -rf "${TMP}"' EXIT
+
+# peers have to match distribution and architecture
+ARCH_ID="$("${PACREDIR}" -V | sed -n 's|^.* v[^ ]* \([^ /]*\)/\([^ ]*\) .*$|id=\1 arch=\2|p')"
+
+# write the script
+{
+	echo "delay record ${DELAY_RECORD}"
+	echo "delay service ${DELAY_SERVICE}"
+	echo "${INTERFACES}" | tr ',' '\n' > "${TMP}/interfaces"
+	COUNT="$(wc -l < "${TMP}/interfaces")"
+	I=1
+	while [ "${I}" -le "$((PEERS + LATE))" ]; do
+		INTERFACE="$(sed -n "$(((I - 1) % COUNT + 1))p" "${TMP}/interfaces")"
+		OPTIONS=''
+		[ "${I}" -gt "${PEERS}" ] && OPTIONS="after=${AFTER}"
+		[ "${I}" -le "${ERRORS}" ] && OPTIONS="error=org.freedesktop.resolve1.NoSuchRR"
+		printf 'peer peer%04d %s peer%04d.local 7078 %s %s\n' \
+			"${I}" "${INTERFACE}" "${I}" "${OPTIONS}" "${ARCH_ID}"
+		I=$((I + 1))
+	done
+} > "${TMP}/script"
+
+# start a private bus and the stand-in for systemd-resolved
+dbus-daemon --config-file="${BENCH}/dbus.conf" --address="unix:path=${TMP}/bus" \
+	--nofork --nopidfile & DBUS_PID=$!
+while [ ! -S "${TMP}/bus" ]; do kill -0 "${DBUS_PID}"; sleep 0.1; done
+chmod 0777 "${TMP}"
+export DBUS_SYSTEM_BUS_ADDRESS="unix:path=${TMP}/bus"
+
+"${FAKE}" "${TMP}/script" > "${TMP}/fake.log" & FAKE_PID=$!
+while ! grep -q '^Ready' "${TMP}/fake.log"; do kill -0 "${FAKE_PID}"; sleep 0.1; done
+
+# run discovery passes
+"${PACREDIR}" --discover "${PASSES}" > "${TMP}/pacredir.log" 2>&1
+
+kill "${FAKE_PID}"
+wait "${FAKE_PID}" || true
+
+# report
+awk -v late="${LATE}" -v after="${AFTER}" -v peers="${PEERS}" '
+	/^Ready at / { ready = $3 }
+	/^Calls: / { calls = $0 }
+	/^New host / {
+		n = split($3, name, "peer")
+		if (name[2] + 0 <= peers)
+			next
+		if (!($3 in seen))
+			late_seen++
+		seen[$3] = 1
+		if ($6 - ready - after > usable)
+			usable = $6 - ready - after
+	}
+	/^Discovery pass / {
+		passes++
+		sum += $5
+		if (min == "" || $5 < min)
+			min = $5
+		if ($5 > max)
+			max = $5
+		heap += $11
+		online = $7
+	}
+	END {
+		printf "%d passes, duration min %.3f sec, mean %.3f sec, max %.3f sec\n",
+			passes, min, sum / passes, max
+		printf "%d hosts online, heap %+d bytes per pass\n", online, heap / passes
+		if (late > 0 && late_seen < late)
+			printf "late peers usable N/A, %d of %d never seen\n", late - late_seen, late
+		else if (late > 0)
+			printf "late peers usable %.3f sec after showing up\n", usable
+		print calls
+		if (late_seen < late)
+			exit 1
+	}' "${TMP}/fake.log" "${TMP}/pacredir.log"
@@ -0,0 +1,403 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* This is a stand-in for systemd-resolved, for benchmarking discovery.
+ * It provides org.freedesktop.resolve1.Manager with methods ResolveRecord
+ * and ResolveService on the system bus - use DBUS_SYSTEM_BUS_ADDRESS to
+ * point it to a private bus. Peers are read from a script:
+ *
+ *   delay record MSEC
+ *   delay service MSEC
+ *   peer NAME INTERFACE HOSTNAME PORT [after=SEC] [error=DBUS-ERROR] [TXT...]
+ *
+ * INTERFACE is the name of a network interface, or '*' for any. Peers
+ * with 'after' show up that number of seconds after start. Peers with
+ * 'error' are answered with that error in ResolveService. */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <net/if.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+
+#define SERVICE		"_pacserve._tcp"
+#define DOMAIN		"local"
+#define TXT_MAX		8
+
+#define DNS_CLASS_IN	1U
+#define DNS_TYPE_PTR	12U
+
+/* scripted peer */
+struct peer {
+	char * name;
+	char * interface;
+	char * hostname;
+	uint16_t port;
+	double after;
+	char * error;
+	char * txt[TXT_MAX];
+	unsigned int txt_count;
+	struct peer * next;
+};
+
+/* script and state */
+struct script {
+	struct peer * peers;
+	unsigned int delay_record;
+	unsigned int delay_service;
+	struct timeval start;
+	unsigned int calls_record;
+	unsigned int calls_service;
+};
+
+/* global variables */
+volatile sig_atomic_t quit = 0;
+
+/*** sig_callback ***/
+static void sig_callback(int signal) {
+	quit = signal;
+}
+
+/*** since_start ***/
+static double since_start(const struct script * script) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (tv.tv_sec - script->start.tv_sec) + (tv.tv_usec - script->start.tv_usec) / 1000000.0;
+}
+
+/*** peer_visible ***
+ * check whether the peer is visible on the interface at this time */
+static int peer_visible(const struct script * script, const struct peer * peer, const int ifindex) {
+	char ifname[IF_NAMESIZE];
+
+	if (since_start(script) < peer->after)
+		return 0;
+
+	if (ifindex == 0 || strcmp(peer->interface, "*") == 0)
+		return 1;
+
+	return if_indextoname(ifindex, ifname) != NULL && strcmp(peer->interface, ifname) == 0;
+}
+
+/*** put_name ***
+ * write name in DNS wire format, return length */
+static size_t put_name(uint8_t * buffer, const char * name) {
+	uint8_t * ptr = buffer;
+	const char * label = name, * dot;
+	size_t len;
+
+	while (*label != 0) {
+		len = (dot = strchr(label, '.')) != NULL ? (size_t) (dot - label) : strlen(label);
+		*ptr++ = len;
+		memcpy(ptr, label, len);
+		ptr += len;
+		label += len + (dot != NULL);
+	}
+	*ptr++ = 0;
+
+	return ptr - buffer;
+}
+
+/*** method_resolve_record ***/
+static int method_resolve_record(sd_bus_message * m, void * userdata, sd_bus_error * ret_error) {
+	struct script * script = userdata;
+	sd_bus_message * reply = NULL;
+	struct peer * peer;
+	const char * name;
+	uint8_t rr[600], * ptr;
+	uint16_t class, type, value16, rdlength;
+	uint32_t ttl = htobe32(120);
+	uint64_t flags;
+	char instance[512];
+	int r, ifindex;
+
+	script->calls_record++;
+
+	if ((r = sd_bus_message_read(m, "isqqt", &ifindex, &name, &class, &type, &flags)) < 0)
+		return r;
+
+	usleep(script->delay_record * 1000);
+
+	if (class != DNS_CLASS_IN || type != DNS_TYPE_PTR || strcmp(name, SERVICE "." DOMAIN) != 0)
+		return sd_bus_reply_method_errorf(m, "org.freedesktop.resolve1.NoSuchRR",
+				"No records for %s", name);
+
+	if ((r = sd_bus_message_new_method_return(m, &reply)) < 0 ||
+			(r = sd_bus_message_open_container(reply, 'a', "(iqqay)")) < 0)
+		goto finish;
+
+	for (peer = script->peers; peer != NULL; peer = peer->next) {
+		if (peer_visible(script, peer, ifindex) == 0)
+			continue;
+
+		/* owner, type, class, ttl, rdlength and the name pointed to */
+		snprintf(instance, sizeof(instance), "%s." SERVICE "." DOMAIN, peer->name);
+		ptr = rr + put_name(rr, name);
+		value16 = htobe16(DNS_TYPE_PTR);
+		memcpy(ptr, &value16, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+		value16 = htobe16(DNS_CLASS_IN);
+		memcpy(ptr, &value16, sizeof(uint16_t));
+		ptr += sizeof(uint16_t);
+		memcpy(ptr, &ttl, sizeof(uint32_t));
+		ptr += sizeof(uint32_t);
+		rdlength = put_name(ptr + sizeof(uint16_t), instance);
+		value16 = htobe16(rdlength);
+		memcpy(ptr, &value16, sizeof(uint16_t));
+		ptr += sizeof(uint16_t) + rdlength;
+
+		if ((r = sd_bus_message_open_container(reply, 'r', "iqqay")) < 0 ||
+				(r = sd_bus_message_append(reply, "iqq", ifindex, DNS_CLASS_IN, DNS_TYPE_PTR)) < 0 ||
+				(r = sd_bus_message_append_array(reply, 'y', rr, ptr - rr)) < 0 ||
+				(r = sd_bus_message_close_container(reply)) < 0)
+			goto finish;
+	}
+
+	if ((r = sd_bus_message_close_container(reply)) < 0 ||
+			(r = sd_bus_message_append(reply, "t", UINT64_C(0))) < 0)
+		goto finish;
+
+	r = sd_bus_send(NULL, reply, NULL);
+
+finish:
+	sd_bus_message_unref(reply);
+
+	return r;
+}
+
+/*** method_resolve_service ***/
+static int method_resolve_service(sd_bus_message * m, void * userdata, sd_bus_error * ret_error) {
+	struct script * script = userdata;
+	sd_bus_message * reply = NULL;
+	struct peer * peer;
+	const char * name, * type, * domain;
+	char instance[512];
+	uint64_t flags;
+	unsigned int i;
+	int r, ifindex, family;
+
+	script->calls_service++;
+
+	if ((r = sd_bus_message_read(m, "isssit", &ifindex, &name, &type, &domain, &family, &flags)) < 0)
+		return r;
+
+	usleep(script->delay_service * 1000);
+
+	for (peer = script->peers; peer != NULL; peer = peer->next) {
+		snprintf(instance, sizeof(instance), "%s." SERVICE "." DOMAIN, peer->name);
+		if (strcmp(domain, instance) == 0 && peer_visible(script, peer, ifindex) > 0)
+			break;
+	}
+
+	if (peer == NULL)
+		return sd_bus_reply_method_errorf(m, "org.freedesktop.resolve1.NoSuchRR",
+				"No service %s", domain);
+	if (peer->error != NULL)
+		return sd_bus_reply_method_errorf(m, peer->error, "Scripted error for %s", peer->name);
+
+	if ((r = sd_bus_message_new_method_return(m, &reply)) < 0 ||
+			(r = sd_bus_message_open_container(reply, 'a', "(qqqsa(iiay)s)")) < 0 ||
+			(r = sd_bus_message_open_container(reply, 'r', "qqqsa(iiay)s")) < 0 ||
+			(r = sd_bus_message_append(reply, "qqqs", 0, 0, peer->port, peer->hostname)) < 0 ||
+			(r = sd_bus_message_open_container(reply, 'a', "(iiay)")) < 0 ||
+			(r = sd_bus_message_close_container(reply)) < 0 ||
+			(r = sd_bus_message_append(reply, "s", peer->hostname)) < 0 ||
+			(r = sd_bus_message_close_container(reply)) < 0 ||
+			(r = sd_bus_message_close_container(reply)) < 0 ||
+			(r = sd_bus_message_open_container(reply, 'a', "ay")) < 0)
+		goto finish;
+
+	for (i = 0; i < peer->txt_count; i++)
+		if ((r = sd_bus_message_append_array(reply, 'y', peer->txt[i], strlen(peer->txt[i]))) < 0)
+			goto finish;
+
+	if ((r = sd_bus_message_close_container(reply)) < 0 ||
+			(r = sd_bus_message_append(reply, "ssst", peer->name, SERVICE, DOMAIN, UINT64_C(0))) < 0)
+		goto finish;
+
+	r = sd_bus_send(NULL, reply, NULL);
+
+finish:
+	sd_bus_message_unref(reply);
+
+	return r;
+}
+
+static const sd_bus_vtable manager_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("ResolveRecord", "isqqt", "a(iqqay)t",
+		method_resolve_record, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("ResolveService", "isssit", "a(qqqsa(iiay)s)aayssst",
+		method_resolve_service, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END
+};
+
+/*** load_script ***/
+static int load_script(struct script * script, const char * path) {
+	struct peer * peer, ** tail = &script->peers;
+	char * line = NULL, * token, * value, * saveptr;
+	size_t size = 0;
+	unsigned int number = 0;
+	FILE * file;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &size, file) > 0) {
+		number++;
+
+		if ((token = strtok_r(line, " \t\n", &saveptr)) == NULL || *token == '#')
+			continue;
+
+		if (strcmp(token, "delay") == 0) {
+			token = strtok_r(NULL, " \t\n", &saveptr);
+			if ((value = strtok_r(NULL, " \t\n", &saveptr)) == NULL)
+				goto invalid;
+			if (token != NULL && strcmp(token, "record") == 0)
+				script->delay_record = atoi(value);
+			else if (token != NULL && strcmp(token, "service") == 0)
+				script->delay_service = atoi(value);
+			else
+				goto invalid;
+		} else if (strcmp(token, "peer") == 0) {
+			if ((peer = calloc(1, sizeof(struct peer))) == NULL)
+				goto invalid;
+			if ((token = strtok_r(NULL, " \t\n", &saveptr)) == NULL)
+				goto invalid;
+			peer->name = strdup(token);
+			if ((token = strtok_r(NULL, " \t\n", &saveptr)) == NULL)
+				goto invalid;
+			peer->interface = strdup(token);
+			if ((token = strtok_r(NULL, " \t\n", &saveptr)) == NULL)
+				goto invalid;
+			peer->hostname = strdup(token);
+			if ((token = strtok_r(NULL, " \t\n", &saveptr)) == NULL)
+				goto invalid;
+			peer->port = atoi(token);
+
+			while ((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+				if (strncmp(token, "after=", 6) == 0)
+					peer->after = atof(token + 6);
+				else if (strncmp(token, "error=", 6) == 0)
+					peer->error = strdup(token + 6);
+				else if (peer->txt_count < TXT_MAX)
+					peer->txt[peer->txt_count++] = strdup(token);
+			}
+
+			*tail = peer;
+			tail = &peer->next;
+		} else
+			goto invalid;
+	}
+
+	free(line);
+	fclose(file);
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid line %u in %s.\n", number, path);
+	free(line);
+	fclose(file);
+
+	return -1;
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	struct script script = { 0 };
+	struct peer * peer;
+	sd_bus * bus = NULL;
+	unsigned int i;
+	int r, ret = EXIT_FAILURE;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s SCRIPT\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (load_script(&script, argv[1]) < 0)
+		return EXIT_FAILURE;
+
+	signal(SIGINT, sig_callback);
+	signal(SIGTERM, sig_callback);
+
+	if ((r = sd_bus_open_system(&bus)) < 0) {
+		fprintf(stderr, "Failed to open system bus: %s\n", strerror(-r));
+		goto finish;
+	}
+
+	if ((r = sd_bus_add_object_vtable(bus, NULL, "/org/freedesktop/resolve1",
+			"org.freedesktop.resolve1.Manager", manager_vtable, &script)) < 0 ||
+			(r = sd_bus_request_name(bus, "org.freedesktop.resolve1", 0)) < 0) {
+		fprintf(stderr, "Failed to provide service: %s\n", strerror(-r));
+		goto finish;
+	}
+
+	gettimeofday(&script.start, NULL);
+	printf("Ready at %ld.%06ld\n", (long) script.start.tv_sec, (long) script.start.tv_usec);
+	fflush(stdout);
+
+	while (quit == 0) {
+		if ((r = sd_bus_process(bus, NULL)) < 0) {
+			fprintf(stderr, "Failed to process bus: %s\n", strerror(-r));
+			goto finish;
+		}
+		if (r > 0)
+			continue;
+
+		/* wake up regularly to check for signals */
+		if ((r = sd_bus_wait(bus, 100000)) < 0 && r != -EINTR) {
+			fprintf(stderr, "Failed to wait on bus: %s\n", strerror(-r));
+			goto finish;
+		}
+	}
+
+	printf("Calls: %u ResolveRecord, %u ResolveService\n",
+			script.calls_record, script.calls_service);
+	ret = EXIT_SUCCESS;
+
+finish:
+	sd_bus_flush_close_unref(bus);
+
+	while (script.peers != NULL) {
+		peer = script.peers->next;
+		free(script.peers->name);
+		free(script.peers->interface);
+		free(script.peers->hostname);
+		free(script.peers->error);
+		for (i = 0; i < script.peers->txt_count; i++)
+			free(script.peers->txt[i]);
+		free(script.peers);
+		script.peers = peer;
+	}
+
+	return ret;
+}
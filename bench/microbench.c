@@ -0,0 +1,149 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Microbenchmark for the decision made per request, without network:
+ * file name and class from uri, owners by rendezvous hashing, selection
+ * over the probe results and the url of the chosen peer. Probe results
+ * are random, but the same for every run. Reported is the time per
+ * request in nanoseconds for each number of peers. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../select.h"
+
+#define OWNERS		2
+#define FILES		64
+#define DURATION	0.2
+
+/* peer, a host name and the result of its probe */
+struct peer {
+	char host[64];
+	struct candidate candidate;
+};
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+/*** random_next ***
+ * xorshift, deterministic */
+static uint64_t random_next(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+
+	return random_state;
+}
+
+/*** now ***/
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*** decide ***
+ * the decision for a request, returns the length of url */
+static int decide(struct peer * peers, const int count, const char * uri, const time_t time) {
+	const char * basename;
+	struct rendezvous rendezvous;
+	struct selection selection;
+	struct candidate candidate;
+	struct peer * peer;
+	uint8_t class;
+	int i;
+	char url[512];
+
+	basename = file_basename(uri);
+	class = file_class(basename);
+
+	/* owners by rendezvous hashing, as with cooperative caching */
+	rendezvous_init(&rendezvous, basename, strlen(basename), OWNERS);
+	for (i = 0; i < count; i++)
+		rendezvous_add(&rendezvous, peers[i].host, &peers[i]);
+
+	selection_init(&selection, class == FILE_CLASS_DB, 0, 128 * 1024 * 1024,
+			64 * 1024 * 1024, time);
+	for (i = 0; i < count; i++) {
+		candidate = peers[i].candidate;
+		selection_add(&selection, i, &candidate);
+	}
+
+	peer = selection.chosen >= 0 ? &peers[selection.chosen] : rendezvous.owner[0];
+
+	return file_url(url, sizeof(url), peer->host, 7078, class == FILE_CLASS_DB, basename);
+}
+
+int main(int argc, char ** argv) {
+	const int counts[] = { 10, 100, 1000 };
+	struct peer * peers;
+	char uris[FILES][128];
+	time_t time_now = time(NULL);
+	double start, elapsed;
+	long requests;
+	int c, i, sum = 0;
+
+	/* every eighth request is for a database */
+	for (i = 0; i < FILES; i++)
+		if (i % 8 == 0)
+			snprintf(uris[i], sizeof(uris[i]), "/db/repo-%d.db", i / 8);
+		else
+			snprintf(uris[i], sizeof(uris[i]), "/pkg/package-%d-1.%d-1-x86_64.pkg.tar.zst",
+					i, (int) (random_next() % 100));
+
+	printf("%8s %16s\n", "peers", "ns per request");
+
+	for (c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); c++) {
+		if ((peers = calloc(counts[c], sizeof(struct peer))) == NULL)
+			return EXIT_FAILURE;
+
+		/* a third of the peers have the file, some of them busy */
+		for (i = 0; i < counts[c]; i++) {
+			snprintf(peers[i].host, sizeof(peers[i].host), "peer-%d.local", i);
+			peers[i].candidate.http_code = random_next() % 3 ? 404 : 200;
+			peers[i].candidate.time_total = (random_next() % 50000) / 1000000.0;
+			peers[i].candidate.last_modified = time_now - random_next() % 3600;
+			peers[i].candidate.content_length = 128 * 1024 * 1024;
+			peers[i].candidate.throughput = 1000000.0 + random_next() % 100000000;
+			peers[i].candidate.load = (random_next() % 4) / 2.0;
+			peers[i].candidate.transfers = random_next() % 3;
+			peers[i].candidate.spare = 0;
+		}
+
+		/* run for a fixed time, check the clock every FILES requests */
+		requests = 0;
+		start = now();
+		do {
+			for (i = 0; i < FILES; i++)
+				sum += decide(peers, counts[c], uris[i], time_now);
+			requests += FILES;
+		} while ((elapsed = now() - start) < DURATION);
+
+		printf("%8d %16.0f\n", counts[c], elapsed * 1000000000.0 / requests);
+
+		free(peers);
+	}
+
+	/* make sure the work is not optimized away */
+	return sum > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -37,6 +37,137 @@
 
 /* path to the config file */
 #define CONFIGFILE	"/etc/pacredir.conf"
+/* pacman's database path, expected package sizes are read from the sync
+ * databases in there */
+#define DBPATH	"/var/lib/pacman/"
+/* number of buckets in the package index */
+#define PACKAGE_BUCKETS	16384
+
+/* Signatures are checked along with package files. This is the number of
+ * peers remembered for answering signature requests directly, and the time
+ * in seconds the information is valid. */
+#define SIBLINGS	64
+#define SIBLING_TIMEOUT	300
+
+/* Files can be looked up in advance, in batches of up to PREFETCH_FILES
+ * files (PREFETCH_SIZE bytes of request body) with PREFETCH_LOOKUPS lookups
+ * running at the same time. PREPARED results are kept and answer requests
+ * for PREPARED_TIMEOUT seconds, files not found for PREPARED_MISS_TIMEOUT
+ * seconds only - a peer may get them any time. */
+#define PREFETCH_FILES	1024
+#define PREFETCH_SIZE	1048576
+#define PREFETCH_LOOKUPS	4
+#define PREPARED	1024
+#define PREPARED_TIMEOUT	600
+#define PREPARED_MISS_TIMEOUT	30
+
+/* For large package files the throughput of peers is measured by fetching
+ * this number of bytes instead of just sending a HEAD request. The first
+ * bytes arrive while TCP is in slow start, these are not measured. */
+#define THROUGHPUT_RANGE	1048576
+#define THROUGHPUT_SKIP		262144
+
+/* Redirects sent to a host are counted to spread load over peers. These
+ * are local redirects only, downloads of other clients are known from
+ * load reported by peers ('peer load' in config file). The count decays
+ * with this half-life in seconds, as we do not know when the download
+ * finished. */
+#define LOAD_HALFLIFE	30
+
+/* With 'redirect address' in config file redirects go to the address a
+ * peer was probed at successfully within this time in seconds, to the
+ * host name otherwise. */
+#define ADDRESS_VALID	60
+
+/* Maximum number of interfaces a host is remembered on. Probes are bound
+ * to the interface with highest weight. */
+#define HOST_INTERFACES	4
+/* Weights for interfaces without speed (wireless, VPN and unknown), this
+ * is compared to speed in Mbit/s. */
+#define WEIGHT_WIRELESS	100
+#define WEIGHT_TUNNEL	10
+#define WEIGHT_UNKNOWN	1000
+
+/* Probes are limited by a process wide budget (see 'probe budget' in
+ * config file). This is the maximum number of concurrent probes sent to a
+ * single peer (pacserve is single-threaded), and the time in milliseconds
+ * a lookup waits for the budget or a busy peer before giving up. */
+#define PEER_PROBES	2
+#define PROBE_WAIT	250
+
+/* Probes, offers and downloads run in detached threads. On exit pacredir
+ * waits this time in seconds for them to finish before cleaning up. */
+#define THREADS_WAIT	10
+
+/* A request for a database starts a session, package requests are
+ * expected to follow. Connections to peers are kept open for reuse until
+ * there was no request for this time in seconds. */
+#define SESSION_TIMEOUT	60
+
+/* Cooperative caching (see 'cooperative' in config file): the port
+ * pacredir listens on for offers from peers, the maximum number of owners
+ * per file and the number of files pulled from peers at the same time.
+ * An offered file is polled every OFFER_INTERVAL seconds until the peer
+ * finished downloading, but no longer than OFFER_TIMEOUT seconds. Pulled
+ * files are stored to pacman's package cache. */
+#define PORT_PEER	7079
+#define OWNERS_MAX	8
+#define PULLS	2
+#define OFFER_INTERVAL	5
+#define OFFER_TIMEOUT	600
+#define CACHEPATH	"/var/cache/pacman/pkg/"
+/* Offers tell the owners which peers are downloading a file from mirror.
+ * This is the number of downloads remembered and the time in seconds the
+ * information is valid. A lookup waiting for such a download (see
+ * 'inflight wait' in config file) checks for the file every
+ * INFLIGHT_INTERVAL milliseconds. */
+#define INFLIGHTS	64
+#define INFLIGHT_TIMEOUT	600
+#define INFLIGHT_INTERVAL	250
+
+/* With 'peer load' in config file peers report their upload load. A
+ * report is fetched after probing a peer if older than LOAD_REPORT_AGE
+ * seconds, and it is used for LOAD_REPORT_VALID seconds. A peer not
+ * reporting is asked again after LOAD_REPORT_RETRY seconds. A connection
+ * to pacserve counts as transfer if data was sent within LOAD_ACTIVE
+ * milliseconds. */
+#define LOAD_REPORT_AGE	5
+#define LOAD_REPORT_VALID	30
+#define LOAD_REPORT_RETRY	60
+#define LOAD_ACTIVE	1000
+
+/* With 'upstream' in config file this node is a pull-through cache: files
+ * are fetched from upstream mirror to UPSTREAM_CACHE, up to FILLS files at
+ * the same time. */
+#define UPSTREAM_CACHE	"/var/cache/pacredir/"
+#define FILLS	16
+
+/* Clients check the pull-through cache (see 'pull through' in config file)
+ * is up before redirecting to it, the result is valid for this time in
+ * seconds. */
+#define PULL_THROUGH_VALID	10
+
+/* With 'query' in config file peers are asked for a file with a datagram
+ * to multicast group QUERY_GROUP on UDP port PORT_QUERY, instead of a
+ * probe per peer. The lookup waits for QUERY_REPLIES replies (all for
+ * databases), but no longer than QUERY_WINDOW milliseconds - or QUERY_RTT
+ * times the round trip of the slowest responder's ping. Peers are pinged
+ * every minute, the ones answering within QUERY_PING_WINDOW milliseconds
+ * are queried for QUERY_VALID seconds. */
+#define PORT_QUERY	7079
+#define QUERY_GROUP	"239.255.70.79"
+#define QUERY_REPLIES	3
+#define QUERY_WINDOW	50
+#define QUERY_RTT	2
+#define QUERY_PING_WINDOW	500
+#define QUERY_VALID	180
+
+/* Statistics are kept per minute for this number of minutes (24 hours).
+ * Decision latencies are counted in buckets of a quarter octave, this is
+ * the number of buckets (up to 2^28 microseconds). */
+#define HISTORY_MINUTES	1440
+#define HISTORY_BUCKETS	112
+
 /* these characters are used as delimiter in config file */
 #define DELIMITER	" ,;"
 
@@ -45,4 +176,12 @@
  * request. */
 #define BADTIME	30
 
+/* Log messages are queued in a ring per thread and written by a background
+ * thread. These define the number of entries per ring, the maximum length
+ * of a message and the maximum number of informational messages per second
+ * (more are suppressed). */
+#define LOG_RING_SIZE	64
+#define LOG_MESSAGE	512
+#define LOG_RATE_LIMIT	200
+
 #endif /* _CONFIG_H */
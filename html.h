@@ -27,6 +27,9 @@
 #define PAGE404 \
 	"<html><head><title>404 Not Found</title>" \
 	"</head><body>404 Not Found: %s</body></html>"
+#define PAGE503 \
+	"<html><head><title>503 Service Unavailable</title>" \
+	"</head><body>503 Service Unavailable</body></html>"
 
 /* status page */
 #define CIRCLE_GREEN	"&#x1F7E2;"
@@ -53,7 +56,8 @@
 	"tr:nth-child(even) { background: #dfdfdf; } " \
 	"tr:nth-child(odd) { background: #efefef; } " \
 	"tr:hover { background: #dfefef; }" \
-	"tr.grey { color: grey; }</style>" \
+	"tr.grey { color: grey; } " \
+	"td.spark { text-align: left; font-family: monospace; letter-spacing: -1px; }</style>" \
 	"<link rel=\"icon\" href=\"favicon.png\" type=\"image/png\">" \
 	"</head><body><h1>pacredir status</h1>" \
 	"<p>This is <code>pacredir</code> version <i>" VERSION "</i> running on <i>%s</i>. " \
@@ -83,6 +87,7 @@
 	"<table><tr>" \
 	"<th>host</th>" \
 	"<th>port</th>" \
+	"<th>interface</th>" \
 	"<th colspan=2>state</th>" \
 	"<th colspan=2>finds</th>" \
 	"<th colspan=2>bad</th></tr>"
@@ -90,14 +95,31 @@
 	"<tr%s>" \
 	"<td>%s</td>" \
 	"<td>%d</td>" \
+	"<td>%s</td>" \
 	"<td>%s</td><td>%s</td>" \
 	"<td>%s</td><td>%d</td>" \
 	"<td>%s</td><td>%d</td></tr>"
 #define STATUS_HOST_NONE \
-	"<tr><td colspan=8>(none)</td></tr>"
+	"<tr><td colspan=9>(none)</td></tr>"
 #define STATUS_HOST_FOOT \
 	"</table>"
 
+#define STATUS_HISTORY_HEAD \
+	"<h2 id=\"history\"><a href=\"#history\">History</a></h2>" \
+	"<p>Statistics per minute, also available as <a href=\"history.json\">JSON</a>.</p>" \
+	"<table><tr>" \
+	"<th></th>" \
+	"<th colspan=2>last hour</th>" \
+	"<th colspan=2>last 24 hours</th></tr>"
+#define STATUS_HISTORY_ROW \
+	"<tr><td>%s</td><td class=\"spark\">"
+#define STATUS_HISTORY_CELL \
+	"</td><td>%s</td><td class=\"spark\">"
+#define STATUS_HISTORY_ROW_END \
+	"</td><td>%s</td></tr>"
+#define STATUS_HISTORY_FOOT \
+	"</table>"
+
 #define STATUS_FOOT \
 	"</body></html>"
 
@@ -0,0 +1,387 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "version.h"
+
+/* lookup core and trace format */
+#include "select.h"
+#include "trace.h"
+
+#define PROGNAME	"pacredir-replay"
+
+/* requests are throttled by this (microseconds) */
+#define THROTTLE	10000
+
+const static char optstring[] = "hlm:t:vV";
+const static struct option options_long[] = {
+	/* name			has_arg			flag	val */
+	{ "help",		no_argument,		NULL,	'h' },
+	{ "no-load",		no_argument,		NULL,	'l' },
+	{ "max-threads",	required_argument,	NULL,	'm' },
+	{ "throughput-size",	required_argument,	NULL,	't' },
+	{ "verbose",		no_argument,		NULL,	'v' },
+	{ "version",		no_argument,		NULL,	'V' },
+	{ 0, 0, 0, 0 }
+};
+
+/* simulated load of a host */
+struct load {
+	char * host;
+	double load;
+	double load_time;
+	struct load * next;
+};
+
+/* latencies, in microseconds */
+struct latencies {
+	int64_t * values;
+	size_t count, size;
+};
+
+/* statistics per class of file */
+struct stats {
+	unsigned int lookups;
+	unsigned int hits_recorded;
+	unsigned int hits_simulated;
+	unsigned int agree;
+};
+
+/* global variables */
+struct load * loads = NULL;
+struct latencies recorded = { NULL, 0, 0 }, simulated = { NULL, 0, 0 };
+struct stats stats[TRACE_CLASS_SIG + 1];
+int max_threads = 0, throughput_size = 64;
+uint8_t verbose = 0, use_load = 1;
+
+const static char * classes[] = { "pkg", "db", "sig" };
+
+/*** load_get ***
+ * find simulated load for host, add if not found */
+static struct load * load_get(const char * host, const size_t len) {
+	struct load * load;
+
+	for (load = loads; load != NULL; load = load->next)
+		if (strlen(load->host) == len && memcmp(load->host, host, len) == 0)
+			return load;
+
+	if ((load = calloc(1, sizeof(struct load))) == NULL ||
+			(load->host = strndup(host, len)) == NULL) {
+		fprintf(stderr, "Failed to allocate memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	load->next = loads;
+	loads = load;
+
+	return load;
+}
+
+/*** latency_add ***/
+static void latency_add(struct latencies * latencies, const int64_t value) {
+	if (latencies->count == latencies->size) {
+		latencies->size = latencies->size ? latencies->size * 2 : 1024;
+		if ((latencies->values = realloc(latencies->values,
+				latencies->size * sizeof(int64_t))) == NULL) {
+			fprintf(stderr, "Failed to allocate memory.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	latencies->values[latencies->count++] = value;
+}
+
+/*** latency_compare ***/
+static int latency_compare(const void * a, const void * b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*** latency_print ***/
+static void latency_print(const char * name, struct latencies * latencies) {
+	double sum = 0;
+	size_t i;
+
+	if (latencies->count == 0)
+		return;
+
+	qsort(latencies->values, latencies->count, sizeof(int64_t), latency_compare);
+	for (i = 0; i < latencies->count; i++)
+		sum += latencies->values[i];
+
+	printf("%-10s mean %8.1f ms, p50 %8.1f ms, p95 %8.1f ms, p99 %8.1f ms\n", name,
+			sum / latencies->count / 1000,
+			latencies->values[latencies->count * 50 / 100] / 1000.0,
+			latencies->values[latencies->count * 95 / 100] / 1000.0,
+			latencies->values[latencies->count * 99 / 100] / 1000.0);
+}
+
+/*** replay ***
+ * run the selection for a trace record, using recorded peer behaviour */
+static void replay(const struct trace_record * record, const char * data) {
+	const char * name = data, * host, * chosen_host = NULL, * recorded_host = NULL;
+	struct selection selection;
+	struct candidate candidate;
+	struct trace_peer peer;
+	struct load * load;
+	int64_t latency = 0, finish;
+	double now = record->time / 1000000.0;
+	size_t chosen_len = 0, recorded_len = 0;
+	int i, peers;
+
+	data += record->name_len;
+
+	/* the signature was known from a previous lookup, or the file was
+	   looked up in advance - nothing was probed */
+	if (record->decision == TRACE_DECISION_SIBLING || record->decision == TRACE_DECISION_PREFETCH) {
+		stats[record->class].hits_recorded++;
+		stats[record->class].hits_simulated++;
+		stats[record->class].agree++;
+		latency_add(&recorded, record->latency);
+		latency_add(&simulated, record->latency);
+		return;
+	}
+
+	peers = record->peers;
+	if (max_threads > 0 && peers > max_threads)
+		peers = max_threads;
+
+	selection_init(&selection, record->class == TRACE_CLASS_DB, record->if_modified_since,
+			record->size_expected, (off_t) throughput_size * 1024 * 1024, now);
+
+	for (i = 0; i < record->peers; i++) {
+		memcpy(&peer, data, sizeof(struct trace_peer));
+		host = data + sizeof(struct trace_peer);
+		data = host + peer.host_len;
+
+		if (i == record->chosen) {
+			recorded_host = host;
+			recorded_len = peer.host_len;
+		}
+
+		/* skip peers beyond the simulated limit */
+		if (i >= peers)
+			continue;
+
+		/* requests are started one after another, the slowest one finishes last */
+		finish = (int64_t) (i + 1) * THROTTLE + peer.time_total;
+		if (finish > latency)
+			latency = finish;
+
+		candidate.http_code = peer.http_code;
+		candidate.time_total = peer.time_total / 1000000.0;
+		candidate.last_modified = peer.last_modified;
+		candidate.content_length = peer.content_length;
+		candidate.throughput = peer.throughput;
+		candidate.load = 0;
+		candidate.transfers = 0;
+		candidate.spare = 0;
+		if (use_load > 0) {
+			load = load_get(host, peer.host_len);
+			candidate.load = load->load * exp2((load->load_time - now) / LOAD_HALFLIFE);
+		}
+
+		if (selection_add(&selection, i, &candidate) == SELECT_CHOSEN) {
+			chosen_host = host;
+			chosen_len = peer.host_len;
+		}
+	}
+
+	/* nothing found, the lookup waited for a peer downloading from mirror */
+	if (record->decision == TRACE_DECISION_INFLIGHT && chosen_host == NULL) {
+		stats[record->class].hits_recorded++;
+		stats[record->class].hits_simulated++;
+		stats[record->class].agree++;
+		latency_add(&recorded, record->latency);
+		latency_add(&simulated, record->latency);
+		return;
+	}
+
+	if (chosen_host != NULL && use_load > 0) {
+		load = load_get(chosen_host, chosen_len);
+		load->load = load->load * exp2((load->load_time - now) / LOAD_HALFLIFE) + 1;
+		load->load_time = now;
+	}
+
+	if (record->decision == TRACE_DECISION_REDIRECT || record->decision == TRACE_DECISION_INFLIGHT)
+		stats[record->class].hits_recorded++;
+	if (chosen_host != NULL)
+		stats[record->class].hits_simulated++;
+	if (chosen_len == recorded_len && (chosen_len == 0 ||
+			memcmp(chosen_host, recorded_host, chosen_len) == 0))
+		stats[record->class].agree++;
+	else if (verbose > 0)
+		printf("%.*s: recorded %.*s, simulated %.*s\n", record->name_len, name,
+				(int) recorded_len, recorded_len ? recorded_host : "",
+				(int) chosen_len, chosen_len ? chosen_host : "");
+
+	latency_add(&recorded, record->latency);
+	latency_add(&simulated, latency);
+}
+
+/*** replay_file ***/
+static int replay_file(const char * path) {
+	struct trace_record record;
+	char magic[TRACE_MAGIC_LEN], * data = NULL;
+	FILE * file;
+	size_t size, min;
+	int ret = -1, i;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fread(magic, TRACE_MAGIC_LEN, 1, file) != 1 ||
+			memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+		fprintf(stderr, "File %s is not a trace file.\n", path);
+		goto out;
+	}
+
+	while (fread(&record, sizeof(struct trace_record), 1, file) == 1) {
+		/* check the record for sanity before going on */
+		min = sizeof(struct trace_record) + record.name_len +
+			(size_t) record.peers * sizeof(struct trace_peer);
+		if (record.size < min || record.class > TRACE_CLASS_SIG ||
+				record.decision > TRACE_DECISION_PREFETCH ||
+				record.chosen >= record.peers) {
+			fprintf(stderr, "Invalid record in %s.\n", path);
+			goto out;
+		}
+
+		size = record.size - sizeof(struct trace_record);
+		if ((data = realloc(data, size)) == NULL) {
+			fprintf(stderr, "Failed to allocate memory.\n");
+			goto out;
+		}
+		if (fread(data, size, 1, file) != 1) {
+			fprintf(stderr, "Truncated record in %s.\n", path);
+			goto out;
+		}
+
+		/* check host names fit */
+		min = record.name_len;
+		for (i = 0; i < record.peers; i++) {
+			struct trace_peer peer;
+
+			memcpy(&peer, data + min, sizeof(struct trace_peer));
+			min += sizeof(struct trace_peer) + peer.host_len;
+			if (min > size) {
+				fprintf(stderr, "Invalid record in %s.\n", path);
+				goto out;
+			}
+		}
+
+		stats[record.class].lookups++;
+		replay(&record, data);
+	}
+
+	ret = 0;
+
+out:
+	free(data);
+	fclose(file);
+
+	return ret;
+}
+
+/*** main ***/
+int main(int argc, char ** argv) {
+	unsigned int version = 0, help = 0, lookups = 0, agree = 0, class;
+	struct load * load;
+	int i, ret = EXIT_SUCCESS;
+
+	while ((i = getopt_long(argc, argv, optstring, options_long, NULL)) != -1) {
+		switch (i) {
+			case 'h':
+				help++;
+				break;
+			case 'l':
+				use_load = 0;
+				break;
+			case 'm':
+				max_threads = atoi(optarg);
+				break;
+			case 't':
+				throughput_size = atoi(optarg);
+				break;
+			case 'v':
+				verbose++;
+				break;
+			case 'V':
+				verbose++;
+				version++;
+				break;
+		}
+	}
+
+	if (verbose > 0)
+		printf("%s: " PROGNAME " v" VERSION " " ID "/" ARCH
+				" (built: " __DATE__ ", " __TIME__ ")\n", argv[0]);
+
+	if (help > 0 || (version == 0 && optind >= argc))
+		printf("usage: %s [-h] [-l] [-m MAX-THREADS] [-t THROUGHPUT-SIZE] [-v] [-V] TRACE...\n", argv[0]);
+
+	if (version > 0 || help > 0)
+		return EXIT_SUCCESS;
+	if (optind >= argc)
+		return EXIT_FAILURE;
+
+	for (i = optind; i < argc; i++)
+		if (replay_file(argv[i]) < 0)
+			ret = EXIT_FAILURE;
+
+	for (class = 0; class <= TRACE_CLASS_SIG; class++) {
+		if (stats[class].lookups == 0)
+			continue;
+		printf("%-10s %6u lookups, hit rate recorded %5.1f%%, simulated %5.1f%%, agreement %5.1f%%\n",
+				classes[class], stats[class].lookups,
+				100.0 * stats[class].hits_recorded / stats[class].lookups,
+				100.0 * stats[class].hits_simulated / stats[class].lookups,
+				100.0 * stats[class].agree / stats[class].lookups);
+		lookups += stats[class].lookups;
+		agree += stats[class].agree;
+	}
+
+	if (lookups > 0) {
+		printf("%-10s %6u lookups, agreement %5.1f%%\n", "total", lookups, 100.0 * agree / lookups);
+		latency_print("recorded", &recorded);
+		latency_print("simulated", &simulated);
+	}
+
+	while (loads != NULL) {
+		load = loads->next;
+		free(loads->host);
+		free(loads);
+		loads = load;
+	}
+	free(recorded.values);
+	free(simulated.values);
+
+	return ret;
+}
@@ -19,59 +19,546 @@
 /* define structs and functions */
 #include "pacredir.h"
 
-const static char optstring[] = "hvV";
+const static char optstring[] = "d:hvV";
 const static struct option options_long[] = {
-	/* name		has_arg		flag	val */
-	{ "help",	no_argument,	NULL,	'h' },
-	{ "verbose",	no_argument,	NULL,	'v' },
-	{ "version",	no_argument,	NULL,	'V' },
+	/* name		has_arg			flag	val */
+	{ "discover",	required_argument,	NULL,	'd' },
+	{ "help",	no_argument,		NULL,	'h' },
+	{ "verbose",	no_argument,		NULL,	'v' },
+	{ "version",	no_argument,		NULL,	'V' },
 	{ 0, 0, 0, 0 }
 };
 
 /* global variables */
 struct hosts * hosts = NULL;
 struct ignore_interfaces * ignore_interfaces = NULL;
-int max_threads = 0;
-uint8_t quit = 0, update = 0, verbose = 0;
+struct package_index * packages = NULL;
+pthread_rwlock_t config_lock = PTHREAD_RWLOCK_INITIALIZER;
+struct sibling siblings[SIBLINGS];
+unsigned int siblings_next = 0;
+pthread_mutex_t siblings_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+unsigned int probes_active = 0, lookups_active = 0;
+pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t threads_cond = PTHREAD_COND_INITIALIZER;
+unsigned int threads_running = 0;
+int probe_budget = 32;
+CURLSH * session_share = NULL;
+pthread_rwlock_t session_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t session_locks[CURL_LOCK_DATA_LAST];
+_Atomic time_t session_until = 0;
+int max_threads = 0, throughput_size = 64, lookup_deadline = 1000, trace_fd = -1;
+char * trace_file = NULL;
+uint8_t cooperative = 0, peer_load = 0;
+int owners = 2;
+char self_name[HOST_NAME_MAX + sizeof(MDNS_DOMAIN) + 1];
+struct MHD_Daemon * mhd_peer = NULL;
+atomic_uint pulls_active = 0;
+struct inflight inflights[INFLIGHTS];
+unsigned int inflights_next = 0;
+pthread_mutex_t inflights_lock = PTHREAD_MUTEX_INITIALIZER;
+int inflight_wait = 0;
+struct prepared prepareds[PREPARED];
+unsigned int prepareds_next = 0;
+pthread_mutex_t prepared_lock = PTHREAD_MUTEX_INITIALIZER;
+int headers_received;
+char * upstream = NULL, * pull_through = NULL;
+int cache_size = 10240;
+pthread_mutex_t pull_through_lock = PTHREAD_MUTEX_INITIALIZER;
+time_t pull_through_checked = 0;
+uint8_t pull_through_up = 0;
+uint8_t query = 0, redirect_address = 0;
+pthread_mutex_t address_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t interface_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t query_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t query_tid;
+uint8_t query_running = 0;
+struct fill * fills = NULL;
+unsigned int fills_active = 0;
+pthread_mutex_t fills_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fills_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+struct history history[HISTORY_MINUTES];
+unsigned int history_latency[HISTORY_BUCKETS];
+time_t history_minute = 0;
+pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+uint8_t log_timing = 0, verbose = 0, verbose_args = 0;
+volatile sig_atomic_t quit = 0, update = 0, dump = 0;
 unsigned int count_redirect = 0, count_not_found = 0;
+/* lookups rejected by probe budget, and probes skipped as peer was busy */
+atomic_uint count_rejected = 0, count_busy = 0;
+
+/* log rings and log writer state */
+struct log_ring * _Atomic log_rings = NULL;
+_Thread_local struct log_ring * log_ring = NULL;
+pthread_key_t log_key;
+pthread_t log_tid;
+atomic_ulong log_seq = 0;
+atomic_uint log_count = 0, log_suppressed = 0;
+atomic_llong log_second = 0;
+atomic_uchar log_running = 0, log_quit = 0, log_sleeping = 0;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+uint8_t log_journal = 0;
+
+/*** log_release_ring ***
+ * called on thread exit, the ring can be claimed by another thread */
+static void log_release_ring(void * data) {
+	struct log_ring * ring = data;
+
+	atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+/*** log_get_ring ***/
+static struct log_ring * log_get_ring(void) {
+	struct log_ring * ring;
+	unsigned char expected;
+
+	if (log_ring != NULL)
+		return log_ring;
+
+	/* try to claim a ring released by a thread that exited */
+	for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+		expected = 0;
+		if (atomic_compare_exchange_strong(&ring->in_use, &expected, 1))
+			goto claimed;
+	}
+
+	/* nothing free, allocate a new one and push it to the list */
+	if ((ring = malloc(sizeof(struct log_ring))) == NULL)
+		return NULL;
+	atomic_init(&ring->in_use, 1);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->head, 0);
+	ring->next = atomic_load(&log_rings);
+	while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring));
+
+claimed:
+	pthread_setspecific(log_key, ring);
+	log_ring = ring;
+
+	return ring;
+}
+
+/*** log_enqueue ***
+ * format the message and put it into the thread's ring, never blocks */
+static int log_enqueue(FILE *stream, const char * peer, const char * file,
+		const char * decision, const long latency, const char *format, va_list args) {
+	struct log_ring * ring;
+	struct log_entry * entry;
+	unsigned int tail;
+	long long now;
+
+	/* the writer is not running (yet), write synchronously */
+	if (atomic_load(&log_running) == 0) {
+		vfprintf(stream, format, args);
+		fflush(stream);
+		return EXIT_SUCCESS;
+	}
+
+	/* rate limit informational messages, errors are always queued */
+	if (stream != stderr) {
+		now = time(NULL);
+		if (atomic_load_explicit(&log_second, memory_order_relaxed) != now) {
+			atomic_store_explicit(&log_second, now, memory_order_relaxed);
+			atomic_store_explicit(&log_count, 0, memory_order_relaxed);
+		}
+		if (atomic_fetch_add_explicit(&log_count, 1, memory_order_relaxed) >= LOG_RATE_LIMIT)
+			goto suppress;
+	}
+
+	if ((ring = log_get_ring()) == NULL)
+		goto suppress;
+
+	/* the ring is full, drop the message */
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) >= LOG_RING_SIZE)
+		goto suppress;
+
+	entry = &ring->entries[tail % LOG_RING_SIZE];
+	entry->seq = atomic_fetch_add_explicit(&log_seq, 1, memory_order_relaxed);
+	entry->stream = stream;
+	snprintf(entry->peer, sizeof(entry->peer), "%s", peer ? peer : "");
+	snprintf(entry->file, sizeof(entry->file), "%s", file ? file : "");
+	entry->decision = decision;
+	entry->latency = latency;
+	vsnprintf(entry->message, LOG_MESSAGE, format, args);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+	/* wake the writer if it sleeps, pairs with the fence in log_writer */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&log_sleeping, memory_order_relaxed) > 0)
+		log_wake();
+
+	return EXIT_SUCCESS;
+
+suppress:
+	atomic_fetch_add_explicit(&log_suppressed, 1, memory_order_relaxed);
+	return EXIT_FAILURE;
+}
+
+/*** log_wake ***
+ * wake the log writer */
+static void log_wake(void) {
+	pthread_mutex_lock(&log_lock);
+	pthread_cond_signal(&log_cond);
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*** log_pending ***
+ * true if any ring has entries */
+static uint8_t log_pending(void) {
+	struct log_ring * ring;
+
+	for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next)
+		if (atomic_load_explicit(&ring->head, memory_order_relaxed) !=
+				atomic_load_explicit(&ring->tail, memory_order_acquire))
+			return 1;
+
+	return 0;
+}
 
 /*** write_log ***/
 static int write_log(FILE *stream, const char *format, ...) {
 	va_list args;
+	int ret;
 
 	va_start(args, format);
-	vfprintf(stream, format, args);
+	ret = log_enqueue(stream, NULL, NULL, NULL, -1, format, args);
 	va_end(args);
-	fflush(stream);
 
-	return EXIT_SUCCESS;
+	return ret;
+}
+
+/*** write_log_decision ***
+ * log a decision, with structured fields for the journal */
+static int write_log_decision(const char * peer, const char * file,
+		const char * decision, const long latency, const char *format, ...) {
+	va_list args;
+	int ret;
+
+	va_start(args, format);
+	ret = log_enqueue(stdout, peer, file, decision, latency, format, args);
+	va_end(args);
+
+	return ret;
+}
+
+/*** log_output ***/
+static void log_output(const struct log_entry * entry) {
+	struct iovec iov[6];
+	char message[LOG_MESSAGE + 8], priority[16], peer[HOST_NAME_MAX + 16],
+		file[NAME_MAX + 16], decision[32], latency[48];
+	int n = 0, len;
+
+	if (log_journal == 0) {
+		fputs(entry->message, entry->stream);
+		return;
+	}
+
+	/* the journal does not want the trailing line break */
+	len = strlen(entry->message);
+	if (len > 0 && entry->message[len - 1] == '\n')
+		len--;
+
+	iov[n].iov_base = message;
+	iov[n++].iov_len = snprintf(message, sizeof(message), "MESSAGE=%.*s", len, entry->message);
+	iov[n].iov_base = priority;
+	iov[n++].iov_len = snprintf(priority, sizeof(priority), "PRIORITY=%d",
+			entry->stream == stderr ? LOG_WARNING : LOG_INFO);
+	if (*entry->peer != 0) {
+		iov[n].iov_base = peer;
+		iov[n++].iov_len = snprintf(peer, sizeof(peer), "PACREDIR_PEER=%s", entry->peer);
+	}
+	if (*entry->file != 0) {
+		iov[n].iov_base = file;
+		iov[n++].iov_len = snprintf(file, sizeof(file), "PACREDIR_FILE=%s", entry->file);
+	}
+	if (entry->decision != NULL) {
+		iov[n].iov_base = decision;
+		iov[n++].iov_len = snprintf(decision, sizeof(decision), "PACREDIR_DECISION=%s", entry->decision);
+	}
+	if (entry->latency >= 0) {
+		iov[n].iov_base = latency;
+		iov[n++].iov_len = snprintf(latency, sizeof(latency), "PACREDIR_LATENCY_USEC=%ld", entry->latency);
+	}
+
+	sd_journal_sendv(iov, n);
+}
+
+/*** log_writer ***
+ * background thread draining the log rings in order */
+static void * log_writer(void * data) {
+	struct log_ring * ring, * oldest;
+	struct log_entry suppressed = { .stream = stderr, .latency = -1 };
+	unsigned int count, dropped, head;
+	uint8_t quit;
+
+	for (;;) {
+		quit = atomic_load(&log_quit);
+		count = 0;
+
+		for (;;) {
+			/* find the ring with the oldest pending entry */
+			oldest = NULL;
+			for (ring = atomic_load(&log_rings); ring != NULL; ring = ring->next) {
+				head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+				if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+					continue;
+				if (oldest == NULL || ring->entries[head % LOG_RING_SIZE].seq <
+						oldest->entries[atomic_load_explicit(&oldest->head,
+							memory_order_relaxed) % LOG_RING_SIZE].seq)
+					oldest = ring;
+			}
+			if (oldest == NULL)
+				break;
+
+			head = atomic_load_explicit(&oldest->head, memory_order_relaxed);
+			log_output(&oldest->entries[head % LOG_RING_SIZE]);
+			atomic_store_explicit(&oldest->head, head + 1, memory_order_release);
+			count++;
+		}
+
+		/* report what was dropped under load */
+		if ((dropped = atomic_exchange(&log_suppressed, 0)) > 0) {
+			snprintf(suppressed.message, LOG_MESSAGE,
+					"Suppressed %u log messages under load.\n", dropped);
+			log_output(&suppressed);
+			count++;
+		}
+
+		if (count > 0 && log_journal == 0) {
+			fflush(stdout);
+			fflush(stderr);
+		}
+
+		if (quit)
+			break;
+
+		/* Nothing to do, sleep until a message is queued. Announce
+		 * sleeping before checking the rings again, so a producer
+		 * either sees the flag or its message is found here. */
+		if (count == 0) {
+			pthread_mutex_lock(&log_lock);
+			atomic_store_explicit(&log_sleeping, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			if (log_pending() == 0 && atomic_load(&log_quit) == 0)
+				pthread_cond_wait(&log_cond, &log_lock);
+			atomic_store_explicit(&log_sleeping, 0, memory_order_relaxed);
+			pthread_mutex_unlock(&log_lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*** log_start ***/
+static void log_start(void) {
+	const char * stream;
+	uintmax_t dev, ino;
+	struct stat st;
+	sigset_t mask, oldmask;
+	int error;
+
+	/* systemd tells us if stdout is connected to the journal - a shell in
+	   a user session inherits the variable, so check device and inode
+	   match our stdout and stderr, see sd-daemon(3) */
+	if ((stream = getenv("JOURNAL_STREAM")) != NULL &&
+			sscanf(stream, "%ju:%ju", &dev, &ino) == 2 &&
+			fstat(STDOUT_FILENO, &st) == 0 && st.st_dev == dev && st.st_ino == ino &&
+			fstat(STDERR_FILENO, &st) == 0 && st.st_dev == dev && st.st_ino == ino)
+		log_journal = 1;
+
+	if ((error = pthread_key_create(&log_key, log_release_ring)) != 0) {
+		write_log(stderr, "Could not create log key, errno %d\n", error);
+		return;
+	}
+
+	/* signals should not be delivered to the log writer */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+	if ((error = pthread_create(&log_tid, NULL, log_writer, NULL)) != 0)
+		write_log(stderr, "Could not run log writer, errno %d\n", error);
+	else
+		atomic_store(&log_running, 1);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+/*** log_stop ***
+ * drain all pending messages and stop the log writer */
+static void log_stop(void) {
+	if (atomic_load(&log_running) == 0)
+		return;
+
+	atomic_store(&log_quit, 1);
+	log_wake();
+	pthread_join(log_tid, NULL);
+	atomic_store(&log_running, 0);
+}
+
+/*** time_since ***
+ * return seconds passed since start */
+static double time_since(const struct timeval * start) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (tv.tv_sec - start->tv_sec) + (tv.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/*** arena_new ***/
+static struct arena * arena_new(const size_t size) {
+	struct arena * arena;
+
+	if ((arena = malloc(sizeof(struct arena) + size)) == NULL)
+		return NULL;
+
+	atomic_init(&arena->refs, 1);
+	arena->size = size;
+	arena->used = 0;
+	arena->next = NULL;
+
+	return arena;
+}
+
+/*** arena_alloc ***
+ * Memory is aligned for any type. If the arena is exhausted another block
+ * is chained, so this fails only if malloc() fails. */
+static void * arena_alloc(struct arena * arena, const size_t size) {
+	const size_t align = _Alignof(max_align_t);
+	struct arena * block;
+	size_t offset;
+
+	for (block = arena; block != NULL; block = block->next) {
+		offset = (block->used + align - 1) & ~(align - 1);
+		if (offset + size <= block->size) {
+			block->used = offset + size;
+			return block->data + offset;
+		}
+		arena = block;
+	}
+
+	/* arena is now the last block, chain a new one */
+	if ((block = arena_new(size > arena->size ? size : arena->size)) == NULL)
+		return NULL;
+	arena->next = block;
+	block->used = size;
+
+	return block->data;
+}
+
+/*** arena_printf ***/
+static char * arena_printf(struct arena * arena, const char *format, ...) {
+	va_list args;
+	size_t len;
+	char * string;
+
+	va_start(args, format);
+	len = vsnprintf(NULL, 0, format, args) + 1;
+	va_end(args);
+
+	if ((string = arena_alloc(arena, len)) == NULL)
+		return NULL;
+
+	va_start(args, format);
+	vsnprintf(string, len, format, args);
+	va_end(args);
+
+	return string;
+}
+
+/*** arena_free ***
+ * Drop a reference, release all blocks with the last one. This is used
+ * as free callback by microhttpd, probes still running hold their own. */
+static void arena_free(void * data) {
+	struct arena * arena = data, * next;
+
+	if (atomic_fetch_sub(&arena->refs, 1) > 1)
+		return;
+
+	while (arena != NULL) {
+		next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+/*** thread_start ***
+ * Run a detached thread. It is counted, as it may use hosts and libcurl
+ * - main waits for it before cleaning these up. Returns 0 on success. */
+static int thread_start(void * (*start_routine)(void *), void * data) {
+	pthread_attr_t attr;
+	pthread_t tid;
+	int error;
+
+	pthread_mutex_lock(&threads_lock);
+	threads_running++;
+	pthread_mutex_unlock(&threads_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if ((error = pthread_create(&tid, &attr, start_routine, data)) != 0)
+		thread_finish();
+	pthread_attr_destroy(&attr);
+
+	return error;
+}
+
+/*** thread_finish ***
+ * called by a thread run with thread_start() when done */
+static void thread_finish(void) {
+	pthread_mutex_lock(&threads_lock);
+	if (--threads_running == 0)
+		pthread_cond_broadcast(&threads_cond);
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/*** thread_wait ***
+ * wait for threads run with thread_start(), at most timeout seconds,
+ * return the number still running */
+static unsigned int thread_wait(const time_t timeout) {
+	struct timespec until;
+	unsigned int running;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout;
+
+	pthread_mutex_lock(&threads_lock);
+	while (threads_running > 0 &&
+			pthread_cond_timedwait(&threads_cond, &threads_lock, &until) != ETIMEDOUT);
+	running = threads_running;
+	pthread_mutex_unlock(&threads_lock);
+
+	return running;
 }
 
 /*** get_url ***/
-static char * get_url(const char * hostname, const uint16_t port, const uint8_t dbfile, const char * uri) {
-	const char * dir;
+static char * get_url(struct arena * arena, const char * hostname, const uint16_t port,
+		const uint8_t dbfile, const char * uri) {
 	char * url;
+	size_t len;
 
-	dir = dbfile ? "db" : "pkg";
-	url = malloc(11 /* static chars of an url & null char */
-			+ strlen(hostname)
-			+ 5 /* max strlen of decimal 16bit value */
-			+ strlen(dir)
-			+ strlen(uri));
-
-	sprintf(url, "http://%s:%d/%s/%s", hostname, port, dir, uri);
+	len = file_url(NULL, 0, hostname, port, dbfile, uri) + 1;
+	if ((url = arena_alloc(arena, len)) != NULL)
+		file_url(url, len, hostname, port, dbfile, uri);
 
 	return url;
 }
 
 /*** update_interfaces ***/
 static void update_interfaces(void) {
-	struct ignore_interfaces *ignore_interfaces_ptr = ignore_interfaces;
+	struct ignore_interfaces *ignore_interfaces_ptr;
 
+	pthread_rwlock_wrlock(&config_lock);
+	ignore_interfaces_ptr = ignore_interfaces;
 	while (ignore_interfaces_ptr->interface != NULL) {
 		ignore_interfaces_ptr->ifindex = if_nametoindex(ignore_interfaces_ptr->interface);
 		ignore_interfaces_ptr = ignore_interfaces_ptr->next;
 	}
+	pthread_rwlock_unlock(&config_lock);
 }
 
 /*** get_name ***/
@@ -126,13 +613,19 @@ static void update_hosts(void) {
 	sd_bus_error error = SD_BUS_ERROR_NULL;
 	sd_bus_message *reply = NULL;
 	sd_bus *bus = NULL;
-	int r, sock;
+	int i, r, sock;
+
+	USDT(discovery_start);
 
 	/* set 'present' to 0, so we later know which hosts were available, and which were not */
+	pthread_mutex_lock(&interface_lock);
 	while (hosts_ptr->host != NULL) {
 		hosts_ptr->present = 0;
+		for (i = 0; i < HOST_INTERFACES; i++)
+			hosts_ptr->interfaces[i].present = 0;
 		hosts_ptr = hosts_ptr->next;
 	}
+	pthread_mutex_unlock(&interface_lock);
 
 	r = sd_bus_open_system(&bus);
 	if (r < 0) {
@@ -211,13 +704,22 @@ static void update_hosts(void) {
 	if_freenameindex(if_nidxs);
 
 finish:
-	/* mark hosts offline that did not show up in query */
+	/* mark hosts offline that did not show up in query,
+	   and forget about interfaces they are no longer found on */
 	hosts_ptr = hosts;
 	while (hosts_ptr->host != NULL) {
 		if (hosts_ptr->mdns == 1 && hosts_ptr->online == 1 && hosts_ptr->present == 0) {
 			if (verbose > 0)
 				write_log(stdout, "Marking host %s offline\n", hosts_ptr->host);
 			hosts_ptr->online = 0;
+			USDT(peer_remove, hosts_ptr->host);
+		}
+		if (hosts_ptr->present == 1) {
+			pthread_mutex_lock(&interface_lock);
+			for (i = 0; i < HOST_INTERFACES; i++)
+				hosts_ptr->interfaces[i].active = hosts_ptr->interfaces[i].present;
+			best_interface(hosts_ptr);
+			pthread_mutex_unlock(&interface_lock);
 		}
 		hosts_ptr = hosts_ptr->next;
 	}
@@ -225,6 +727,8 @@ finish:
 fast_finish:
 	sd_bus_message_unref(reply);
 	sd_bus_flush_close_unref(bus);
+
+	USDT(discovery_end);
 }
 
 /*** update_hosts_on_interface ***/
@@ -391,7 +895,7 @@ static void update_hosts_on_interface(sd_bus *bus, const unsigned int if_index,
 		}
 
 		/* add the peer to our struct */
-		add_host(canonical, port, 1);
+		add_host(canonical, port, 1, if_index, if_name);
 
 		goto finish_service;
 
@@ -419,9 +923,144 @@ finish:
 	sd_bus_message_unref(reply_record);
 }
 
+/*** interface_weight ***
+ * get a weight for interface from link type and speed */
+static unsigned int interface_weight(const char * if_name) {
+	char path[PATH_MAX];
+	FILE * file;
+	int value = -1;
+
+	/* wireless links do not report a useful speed */
+	snprintf(path, PATH_MAX, "/sys/class/net/%s/wireless", if_name);
+	if (access(path, F_OK) == 0)
+		return WEIGHT_WIRELESS;
+
+	/* link speed in Mbit/s */
+	snprintf(path, PATH_MAX, "/sys/class/net/%s/speed", if_name);
+	if ((file = fopen(path, "r")) != NULL) {
+		if (fscanf(file, "%d", &value) != 1)
+			value = -1;
+		fclose(file);
+		if (value > 0)
+			return value;
+	}
+
+	/* tunnel (vpn) and point-to-point links */
+	snprintf(path, PATH_MAX, "/sys/class/net/%s/type", if_name);
+	if ((file = fopen(path, "r")) != NULL) {
+		if (fscanf(file, "%d", &value) != 1)
+			value = -1;
+		fclose(file);
+		if (value == ARPHRD_NONE || value == ARPHRD_PPP)
+			return WEIGHT_TUNNEL;
+	}
+
+	return WEIGHT_UNKNOWN;
+}
+
+/*** best_interface ***
+ * find the present or active interface with highest weight, the caller
+ * holds interface_lock */
+static void best_interface(struct hosts * host) {
+	int i, best = -1;
+
+	for (i = 0; i < HOST_INTERFACES; i++) {
+		if (host->interfaces[i].ifindex == 0 ||
+				(host->interfaces[i].present == 0 && host->interfaces[i].active == 0))
+			continue;
+		if (best < 0 || host->interfaces[i].weight > host->interfaces[best].weight)
+			best = i;
+	}
+
+	host->interface = best;
+}
+
+/*** interface_copy ***
+ * Copy the best interface of host, it may change while discovering.
+ * Returns its index, -1 if none (the copy is zeroed then). */
+static int interface_copy(const struct hosts * host, struct host_interface * copy) {
+	int interface;
+
+	pthread_mutex_lock(&interface_lock);
+	if ((interface = host->interface) >= 0)
+		*copy = host->interfaces[interface];
+	else
+		memset(copy, 0, sizeof(struct host_interface));
+	pthread_mutex_unlock(&interface_lock);
+
+	return interface;
+}
+
+/*** bind_interface ***
+ * write the best interface of host in curl syntax, empty for any */
+static void bind_interface(const struct hosts * host, char * buffer, const size_t size) {
+	struct host_interface interface;
+
+	if (interface_copy(host, &interface) >= 0)
+		snprintf(buffer, size, "if!%s", interface.name);
+	else
+		*buffer = 0;
+}
+
+/*** address_store ***
+ * Remember the address a probe reached the host at, for redirects. IPv6
+ * is put in brackets, link-local with zone index (the interface probed
+ * on). Addresses after a redirect are not used, nor link-local ones
+ * without known interface. */
+static void address_store(struct hosts * host, CURL * curl, const char * interface, const time_t now) {
+	struct in6_addr address6;
+	char * ip = NULL, address[sizeof(host->address)];
+	long redirects = 0;
+
+	if (curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip) != CURLE_OK || ip == NULL || *ip == 0 ||
+			curl_easy_getinfo(curl, CURLINFO_REDIRECT_COUNT, &redirects) != CURLE_OK || redirects > 0)
+		return;
+
+	if (inet_pton(AF_INET6, ip, &address6) != 1)
+		snprintf(address, sizeof(address), "%s", ip);
+	else if (IN6_IS_ADDR_LINKLOCAL(&address6) == 0)
+		snprintf(address, sizeof(address), "[%s]", ip);
+	else if (strncmp(interface, "if!", 3) == 0)
+		/* the percent sign is encoded in urls */
+		snprintf(address, sizeof(address), "[%s%%25%s]", ip, interface + 3);
+	else
+		return;
+
+	pthread_mutex_lock(&address_lock);
+	memcpy(host->address, address, sizeof(address));
+	host->address_time = now;
+	pthread_mutex_unlock(&address_lock);
+}
+
+/*** redirect_url ***
+ * Get the url to redirect to. With 'redirect address' this is the
+ * address verified recently, saving the client from resolving the
+ * host name. */
+static char * redirect_url(struct arena * arena, struct hosts * host,
+		const uint8_t dbfile, const char * uri, const time_t now) {
+	char address[sizeof(host->address)];
+
+	if (redirect_address > 0) {
+		pthread_mutex_lock(&address_lock);
+		memcpy(address, host->address, sizeof(address));
+		if (host->address_time + ADDRESS_VALID < now)
+			*address = 0;
+		pthread_mutex_unlock(&address_lock);
+
+		if (*address != 0)
+			return get_url(arena, address, host->port, dbfile, uri);
+	}
+
+	return get_url(arena, host->host, host->port, dbfile, uri);
+}
+
 /*** add_host ***/
-static int add_host(const char * host, const uint16_t port, const uint8_t mdns) {
+static int add_host(const char * host, const uint16_t port, const uint8_t mdns,
+		const unsigned int if_index, const char * if_name) {
 	struct hosts * hosts_ptr = hosts;
+	struct host_interface * interface = NULL;
+	unsigned int weight;
+	int i;
 
 	while (hosts_ptr->host != NULL) {
 		if (strcmp(hosts_ptr->host, host) == 0) {
@@ -439,196 +1078,3604 @@ static int add_host(const char * host, const uint16_t port, const uint8_t mdns)
 		write_log(stdout, "Adding host %s with port %d\n",
 				host, port);
 
-	hosts_ptr->host = strdup(host);
 	hosts_ptr->mdns = mdns;
+	hosts_ptr->online = 0;
 	hosts_ptr->badtime = 0;
 	hosts_ptr->badcount = 0;
 	hosts_ptr->finds = 0;
+	hosts_ptr->throughput = 0;
+	hosts_ptr->load = 0;
+	hosts_ptr->load_time = 0;
+	hosts_ptr->probes = 0;
+	hosts_ptr->transfers = 0;
+	hosts_ptr->spare = 0;
+	hosts_ptr->load_report = 0;
+	hosts_ptr->load_reported = 0;
+	hosts_ptr->query_seen = 0;
+	hosts_ptr->query_rtt = 0;
+	hosts_ptr->query_address.s_addr = 0;
+	*hosts_ptr->address = 0;
+	hosts_ptr->address_time = 0;
+	hosts_ptr->history = calloc(HISTORY_MINUTES, sizeof(uint8_t));
+	memset(hosts_ptr->interfaces, 0, sizeof(hosts_ptr->interfaces));
+	hosts_ptr->interface = -1;
 
 	hosts_ptr->next = malloc(sizeof(struct hosts));
 	hosts_ptr->next->host = NULL;
 	hosts_ptr->next->next = NULL;
 
+	/* set host name last, requests running concurrently see a
+	   complete element then */
+	hosts_ptr->host = strdup(host);
+
 update:
+	/* static configuration wins over mDNS */
+	if (mdns == 0)
+		hosts_ptr->mdns = 0;
 	hosts_ptr->port = port;
+	if (hosts_ptr->online == 0)
+		USDT(peer_add, hosts_ptr->host, port, if_index);
 	hosts_ptr->online = 1;
 	hosts_ptr->present = 1;
 
+	/* remember the interface, reuse a slot not found in this query nor the
+	   last complete one - probes may still bind to the current best one */
+	if (if_index > 0) {
+		weight = interface_weight(if_name);
+
+		pthread_mutex_lock(&interface_lock);
+		for (i = 0; i < HOST_INTERFACES; i++) {
+			if (hosts_ptr->interfaces[i].ifindex == if_index) {
+				interface = &hosts_ptr->interfaces[i];
+				break;
+			}
+			if (interface == NULL && (hosts_ptr->interfaces[i].ifindex == 0 ||
+					(hosts_ptr->interfaces[i].present == 0 &&
+					 hosts_ptr->interfaces[i].active == 0)))
+				interface = &hosts_ptr->interfaces[i];
+		}
+
+		if (interface != NULL) {
+			if (interface->ifindex != if_index) {
+				interface->ifindex = if_index;
+				snprintf(interface->name, IF_NAMESIZE, "%s", if_name);
+			}
+			interface->weight = weight;
+			interface->present = 1;
+			best_interface(hosts_ptr);
+		}
+		pthread_mutex_unlock(&interface_lock);
+	}
+
 	return EXIT_SUCCESS;
 }
 
-/*** get_http_code ***/
-static void * get_http_code(void * data) {
-	struct request * request = (struct request *)data;
-	CURL *curl;
-	CURLcode res;
-	char errbuf[CURL_ERROR_SIZE];
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
+/*** hash_string ***
+ * FNV-1a hash */
+static uint32_t hash_string(const char * string) {
+	uint32_t hash = 2166136261U;
 
-	if ((curl = curl_easy_init()) != NULL) {
-		curl_easy_setopt(curl, CURLOPT_URL, request->url);
-		/* try to resolve addresses to all IP versions that your system allows */
-		curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_WHATEVER);
-		/* tell libcurl to follow redirection */
-		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-		/* set user agent */
-		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
-		/* do not receive body */
-		curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-		/* ask for filetime */
-		curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
-		/* set connection timeout to 2 seconds
-		 * if the host needs longer we do not want to use it anyway ;) */
-		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2L);
-		/* time out if connection is established but transfer rate is low
-		 * this should make curl finish after a maximum of 8 seconds */
-		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
-		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 3L);
-		/* skip all signal handling */
-		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
-		/* provide a buffer to store errors in */
-		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
-		*errbuf = '\0';
+	while (*string != 0) {
+		hash ^= (uint8_t) *string++;
+		hash *= 16777619U;
+	}
 
-		/* perform the request */
-		if ((res = curl_easy_perform(curl)) != CURLE_OK) {
-			write_log(stderr, "Could not connect to peer %s on port %d: %s\n",
-					request->host->host, request->host->port,
-					*errbuf != 0 ? errbuf : curl_easy_strerror(res));
-			request->http_code = 0;
-			request->last_modified = 0;
-			request->host->badtime = tv.tv_sec;
-			request->host->badcount++;
-			return NULL;
-		} else {
-			request->host->badtime = 0;
-			request->host->badcount = 0;
-		}
+	return hash;
+}
 
-		/* get http status code */
-		if ((res = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &(request->http_code))) != CURLE_OK) {
-			write_log(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
-			return NULL;
+/*** free_packages ***/
+static void free_packages(struct package_index * index) {
+	struct package * package, * next;
+	size_t i;
+
+	if (index == NULL)
+		return;
+
+	for (i = 0; i < PACKAGE_BUCKETS; i++) {
+		for (package = index->buckets[i]; package != NULL; package = next) {
+			next = package->next;
+			free(package->filename);
+			free(package->sha256);
+			free(package->sig);
+			free(package);
 		}
+	}
+	for (i = 0; i < index->repo_count; i++)
+		free(index->repos[i]);
+	free(index->repos);
+	free(index);
+}
 
-		if ((res = curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &(request->time_total))) != CURLE_OK) {
-			write_log(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
-			return NULL;
-		}
+/*** update_packages ***
+ * Index file names, expected sizes and checksums of packages from sync
+ * databases.
+ * The index is rebuilt only if a database changed, it is replaced under
+ * config_lock - readers hold it while looking up. */
+static void update_packages(void) {
+	struct package_index * index;
+	struct package * package;
+	alpm_handle_t * handle;
+	alpm_errno_t err;
+	alpm_list_t * list;
+	alpm_db_t * db;
+	DIR * dir;
+	struct dirent * entry;
+	struct stat st;
+	char path[PATH_MAX], * name, ** repos;
+	time_t mtime = 0;
+	uint32_t bucket;
+
+	/* find the newest sync database */
+	if ((dir = opendir(DBPATH "sync/")) == NULL) {
+		write_log(stderr, "Failed to open directory " DBPATH "sync/: %s\n", strerror(errno));
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strlen(entry->d_name) <= 3 || strcmp(entry->d_name + strlen(entry->d_name) - 3, ".db") != 0)
+			continue;
+		snprintf(path, PATH_MAX, DBPATH "sync/%s", entry->d_name);
+		if (stat(path, &st) == 0 && st.st_mtime > mtime)
+			mtime = st.st_mtime;
+	}
 
-		/* get last modified time */
-		if (request->http_code == MHD_HTTP_OK) {
-			if ((res = curl_easy_getinfo(curl, CURLINFO_FILETIME, &(request->last_modified))) != CURLE_OK) {
-				write_log(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
-				return NULL;
-			}
-		} else
-			request->last_modified = 0;
+	if (packages != NULL && packages->mtime >= mtime)
+		goto finish;
 
-		/* always cleanup */
-		curl_easy_cleanup(curl);
+	if ((handle = alpm_initialize("/", DBPATH, &err)) == NULL) {
+		write_log(stderr, "Failed to initialize alpm: %s\n", alpm_strerror(err));
+		goto finish;
 	}
 
-	return NULL;
-}
+	index = calloc(1, sizeof(struct package_index));
+	index->mtime = mtime;
 
-/* append_string */
-static char * append_string(char * string, const char *format, ...) {
-	va_list args;
-	size_t string_len = 0, append_len;
+	rewinddir(dir);
+	while ((entry = readdir(dir)) != NULL) {
+		if (strlen(entry->d_name) <= 3 || strcmp(entry->d_name + strlen(entry->d_name) - 3, ".db") != 0)
+			continue;
 
-	if (string != NULL)
-		string_len = strlen(string);
+		/* register the database without signature checks, we just want
+		   sizes and the repository - its name is kept in the index */
+		name = strndup(entry->d_name, strlen(entry->d_name) - 3);
+		if ((repos = realloc(index->repos, sizeof(char *) * (index->repo_count + 1))) == NULL) {
+			free(name);
+			continue;
+		}
+		index->repos = repos;
+		if ((db = alpm_register_syncdb(handle, name, 0)) == NULL) {
+			free(name);
+			continue;
+		}
+		index->repos[index->repo_count++] = name;
+
+		for (list = alpm_db_get_pkgcache(db); list != NULL; list = list->next) {
+			if (alpm_pkg_get_filename(list->data) == NULL)
+				continue;
+
+			package = malloc(sizeof(struct package));
+			package->filename = strdup(alpm_pkg_get_filename(list->data));
+			package->size = alpm_pkg_get_size(list->data);
+			package->sha256 = alpm_pkg_get_sha256sum(list->data) != NULL ?
+				strdup(alpm_pkg_get_sha256sum(list->data)) : NULL;
+			package->sig = alpm_pkg_get_base64_sig(list->data) != NULL ?
+				strdup(alpm_pkg_get_base64_sig(list->data)) : NULL;
+			package->repo = name;
+			bucket = hash_string(package->filename) % PACKAGE_BUCKETS;
+			package->next = index->buckets[bucket];
+			index->buckets[bucket] = package;
+			index->count++;
+		}
+	}
 
-	va_start(args, format);
-	append_len = vsnprintf(NULL, 0, format, args) + 1;
-	va_end(args);
+	alpm_release(handle);
 
-	string = realloc(string, string_len + append_len);
+	if (verbose > 0)
+		write_log(stdout, "Indexed %zu packages from sync databases\n", index->count);
+
+	/* replace the index, wait for readers of the old one */
+	pthread_rwlock_wrlock(&config_lock);
+	free_packages(packages);
+	packages = index;
+	pthread_rwlock_unlock(&config_lock);
+
+finish:
+	closedir(dir);
+}
+
+/*** package_size ***
+ * return the expected size of a package file, -1 if unknown */
+static off_t package_size(const char * filename) {
+	struct package * package;
+	off_t size = -1;
+
+	pthread_rwlock_rdlock(&config_lock);
+	if (packages != NULL)
+		for (package = packages->buckets[hash_string(filename) % PACKAGE_BUCKETS];
+				package != NULL; package = package->next)
+			if (strcmp(package->filename, filename) == 0) {
+				size = package->size;
+				break;
+			}
+	pthread_rwlock_unlock(&config_lock);
+
+	return size;
+}
+
+/*** package_checksum ***
+ * Copy the expected size, SHA-256 digest and signature (NULL if unknown,
+ * free it) of a package file. Returns 0 if the package or its digest is
+ * unknown. */
+static uint8_t package_checksum(const char * filename, off_t * size, char * sha256,
+		const size_t sha256_size, char ** sig) {
+	struct package * package;
+	uint8_t found = 0;
+
+	*sig = NULL;
+
+	pthread_rwlock_rdlock(&config_lock);
+	if (packages != NULL)
+		for (package = packages->buckets[hash_string(filename) % PACKAGE_BUCKETS];
+				package != NULL; package = package->next)
+			if (strcmp(package->filename, filename) == 0) {
+				if (package->sha256 == NULL ||
+						snprintf(sha256, sha256_size, "%s", package->sha256) >= (int) sha256_size)
+					break;
+				*size = package->size;
+				*sig = package->sig != NULL ? strdup(package->sig) : NULL;
+				found = 1;
+				break;
+			}
+	pthread_rwlock_unlock(&config_lock);
+
+	return found;
+}
+
+/*** package_repo ***
+ * Write the repository of a package file, or of the package a signature
+ * belongs to, to repo. Returns 0 if unknown. */
+static uint8_t package_repo(const char * filename, char * repo, const size_t size) {
+	struct package * package;
+	char name[NAME_MAX + 1];
+	uint8_t found = 0;
+
+	snprintf(name, sizeof(name), "%s", filename);
+	if (file_class(name) == FILE_CLASS_SIG)
+		name[strlen(name) - 4] = '\0';
+
+	pthread_rwlock_rdlock(&config_lock);
+	if (packages != NULL)
+		for (package = packages->buckets[hash_string(name) % PACKAGE_BUCKETS];
+				package != NULL; package = package->next)
+			if (strcmp(package->filename, name) == 0) {
+				found = snprintf(repo, size, "%s", package->repo) < (int) size;
+				break;
+			}
+	pthread_rwlock_unlock(&config_lock);
+
+	return found;
+}
+
+/*** sibling_store ***
+ * Remember host has the signature, oldest entry is overwritten. The first
+ * host stored for a file is kept, unless prefer is set. */
+static void sibling_store(const char * filename, struct hosts * host, const uint8_t prefer) {
+	struct sibling * sibling = NULL;
+	time_t now = time(NULL);
+	unsigned int i;
+
+	pthread_mutex_lock(&siblings_lock);
+	for (i = 0; i < SIBLINGS; i++)
+		if (siblings[i].host != NULL && siblings[i].time + SIBLING_TIMEOUT >= now &&
+				strcmp(siblings[i].filename, filename) == 0) {
+			sibling = &siblings[i];
+			break;
+		}
+	if (sibling == NULL) {
+		sibling = &siblings[siblings_next++ % SIBLINGS];
+		snprintf(sibling->filename, sizeof(sibling->filename), "%s", filename);
+		sibling->host = host;
+		sibling->time = now;
+	} else if (prefer > 0) {
+		sibling->host = host;
+		sibling->time = now;
+	}
+	pthread_mutex_unlock(&siblings_lock);
+}
+
+/*** sibling_lookup ***
+ * return host known to have the signature, NULL if unknown */
+static struct hosts * sibling_lookup(const char * filename, const time_t now) {
+	struct hosts * host = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&siblings_lock);
+	for (i = 0; i < SIBLINGS; i++) {
+		if (siblings[i].host == NULL || siblings[i].time + SIBLING_TIMEOUT < now ||
+				strcmp(siblings[i].filename, filename) != 0)
+			continue;
+
+		host = siblings[i].host;
+		break;
+	}
+	pthread_mutex_unlock(&siblings_lock);
+
+	/* the host may have gone away in the meantime */
+	if (host != NULL && (host->online == 0 ||
+			host->badtime + host->badcount * BADTIME > now))
+		host = NULL;
+
+	return host;
+}
+
+/*** host_load ***
+ * return the decayed number of redirects recently sent to host */
+static double host_load(struct hosts * host, const double now) {
+	double load;
+
+	pthread_mutex_lock(&load_lock);
+	load = host->load * exp2((host->load_time - now) / LOAD_HALFLIFE);
+	pthread_mutex_unlock(&load_lock);
+
+	return load;
+}
+
+/*** host_assign ***
+ * count a redirect to host */
+static void host_assign(struct hosts * host, const double now) {
+	pthread_mutex_lock(&load_lock);
+	host->load = host->load * exp2((host->load_time - now) / LOAD_HALFLIFE) + 1;
+	host->load_time = now;
+	pthread_mutex_unlock(&load_lock);
+}
+
+/*** host_throughput ***
+ * return the throughput estimated for host, 0 if unknown */
+static double host_throughput(struct hosts * host) {
+	double throughput;
+
+	pthread_mutex_lock(&load_lock);
+	throughput = host->throughput;
+	pthread_mutex_unlock(&load_lock);
+
+	return throughput;
+}
+
+/*** host_measured ***
+ * keep a moving average of throughput measured for host */
+static void host_measured(struct hosts * host, const double throughput) {
+	pthread_mutex_lock(&load_lock);
+	host->throughput = host->throughput > 0 ?
+		host->throughput * 0.7 + throughput * 0.3 : throughput;
+	pthread_mutex_unlock(&load_lock);
+}
+
+/*** load_measure ***
+ * Measure our upload load: the number of connections to pacserve
+ * sending data, and the sum of their delivery rate in bytes per second.
+ * Returns 0 on success, -1 on error. */
+static int load_measure(int * transfers, double * rate) {
+	static const int families[2] = { AF_INET, AF_INET6 };
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 req;
+	} request;
+	struct sockaddr_nl address = { .nl_family = AF_NETLINK };
+	struct inet_diag_msg * msg;
+	struct nlmsghdr * nlh;
+	struct rtattr * attr;
+	struct tcp_info info;
+	char buffer[16384];
+	int fd, i, done, attr_len, ret = -1;
+	ssize_t len;
+
+	*transfers = 0;
+	*rate = 0;
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG)) < 0)
+		return -1;
+
+	for (i = 0; i < 2; i++) {
+		/* dump established tcp sockets with info */
+		memset(&request, 0, sizeof(request));
+		request.nlh.nlmsg_len = sizeof(request);
+		request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+		request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		request.req.sdiag_family = families[i];
+		request.req.sdiag_protocol = IPPROTO_TCP;
+		request.req.idiag_states = 1 << 1 /* TCP_ESTABLISHED */;
+		request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+
+		if (sendto(fd, &request, sizeof(request), 0,
+				(struct sockaddr *) &address, sizeof(address)) < 0)
+			goto out;
+
+		for (done = 0; done == 0; ) {
+			if ((len = recv(fd, buffer, sizeof(buffer), 0)) <= 0)
+				goto out;
+
+			for (nlh = (struct nlmsghdr *) buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+				if (nlh->nlmsg_type == NLMSG_DONE) {
+					done = 1;
+					break;
+				} else if (nlh->nlmsg_type == NLMSG_ERROR)
+					goto out;
+
+				msg = NLMSG_DATA(nlh);
+				if (ntohs(msg->id.idiag_sport) != PORT_PACSERVE)
+					continue;
+
+				attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(struct inet_diag_msg));
+				for (attr = (struct rtattr *) (msg + 1); RTA_OK(attr, attr_len);
+						attr = RTA_NEXT(attr, attr_len)) {
+					if (attr->rta_type != INET_DIAG_INFO)
+						continue;
+
+					/* older kernels give less info, missing fields are zero */
+					memset(&info, 0, sizeof(info));
+					memcpy(&info, RTA_DATA(attr), RTA_PAYLOAD(attr) < sizeof(info) ?
+							RTA_PAYLOAD(attr) : sizeof(info));
+
+					/* idle connections kept open do not count */
+					if (info.tcpi_last_data_sent > LOAD_ACTIVE)
+						continue;
+
+					(*transfers)++;
+					*rate += info.tcpi_delivery_rate;
+				}
+			}
+		}
+	}
+	ret = 0;
+
+out:
+	close(fd);
+
+	return ret;
+}
+
+/*** load_capacity ***
+ * Estimate our upload capacity in bytes per second from the speed of the
+ * interfaces peers are found on, 0 if unknown. */
+static double load_capacity(void) {
+	struct hosts * hosts_ptr;
+	struct host_interface interface;
+	unsigned int weight = 0;
+
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next)
+		if (interface_copy(hosts_ptr, &interface) >= 0 && interface.weight > weight)
+			weight = interface.weight;
+
+	return weight * 125000.0;
+}
+
+/*** load_fetch ***
+ * Fetch the load report from peer, if it is old. A new transfer gets at
+ * least a fair share of the capacity. */
+static void load_fetch(struct hosts * host, const time_t now) {
+	char url[PATH_MAX], interface[IF_NAMESIZE + 3], report[128] = { 0 };
+	double rate = 0, capacity = 0, spare;
+	long http_code = 0;
+	int transfers = 0;
+	uint8_t reported = 0;
+	FILE * file;
+	CURL * curl;
+
+	/* claim the fetch, concurrent probes skip it */
+	pthread_mutex_lock(&load_lock);
+	if (host->load_report + (host->load_reported ? LOAD_REPORT_AGE : LOAD_REPORT_RETRY) > now) {
+		pthread_mutex_unlock(&load_lock);
+		return;
+	}
+	host->load_report = now;
+	pthread_mutex_unlock(&load_lock);
+
+	if ((file = fmemopen(report, sizeof(report), "w")) == NULL)
+		return;
+
+	if ((curl = curl_easy_init()) != NULL) {
+		snprintf(url, sizeof(url), "http://%s:%d/load", host->host, PORT_PEER);
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		bind_interface(host, interface, sizeof(interface));
+		if (*interface != 0)
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, interface);
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 500L);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 1000L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+		if (curl_easy_perform(curl) == CURLE_OK &&
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code) == CURLE_OK &&
+				http_code == MHD_HTTP_OK)
+			reported = 1;
+
+		curl_easy_cleanup(curl);
+	}
+
+	if (fclose(file) != 0 || sscanf(report, "transfers=%d rate=%lf capacity=%lf",
+			&transfers, &rate, &capacity) != 3)
+		reported = 0;
+
+	if (verbose > 0 && reported > 0)
+		write_log(stdout, "Host %s reports %d transfers at %.0f of %.0f bytes/sec\n",
+				host->host, transfers, rate, capacity);
+
+	spare = capacity - rate;
+	if (spare < capacity / (transfers + 1))
+		spare = capacity / (transfers + 1);
+
+	pthread_mutex_lock(&load_lock);
+	host->load_reported = reported;
+	if (reported > 0) {
+		host->transfers = transfers;
+		host->spare = spare;
+	}
+	pthread_mutex_unlock(&load_lock);
+}
+
+/*** load_reported ***
+ * put the load reported by host in candidate, if recent */
+static void load_reported(struct hosts * host, const time_t now, struct candidate * candidate) {
+	candidate->transfers = 0;
+	candidate->spare = 0;
+
+	pthread_mutex_lock(&load_lock);
+	if (host->load_reported > 0 && host->load_report + LOAD_REPORT_VALID > now) {
+		candidate->transfers = host->transfers;
+		candidate->spare = host->spare;
+	}
+	pthread_mutex_unlock(&load_lock);
+}
+
+/*** probe_acquire ***
+ * Take a slot from the probe budget for a probe to host. The budget is
+ * shared fairly between concurrent lookups, own is the number of probes
+ * the lookup started already. Returns 1 on success, 0 if the peer stayed
+ * busy and -1 if the lookup used its share or the budget stayed exhausted
+ * until deadline. */
+static int probe_acquire(struct hosts * host, const int own, const struct timespec * deadline) {
+	int share, ret = 1;
+
+	pthread_mutex_lock(&probe_lock);
+	while (1) {
+		/* no budget, no limit */
+		if (probe_budget <= 0)
+			break;
+
+		/* fair share, but at least one probe per lookup */
+		share = probe_budget / (lookups_active > 0 ? lookups_active : 1);
+		if (own >= (share > 0 ? share : 1)) {
+			ret = -1;
+			break;
+		}
+
+		/* do not hammer a single peer */
+		if (host->probes < PEER_PROBES && probes_active < probe_budget)
+			break;
+
+		/* peer busy or budget exhausted, wait for probes to finish */
+		if (pthread_cond_timedwait(&probe_cond, &probe_lock, deadline) == ETIMEDOUT) {
+			ret = host->probes >= PEER_PROBES ? 0 : -1;
+			break;
+		}
+	}
+	if (ret > 0) {
+		probes_active++;
+		host->probes++;
+	}
+	pthread_mutex_unlock(&probe_lock);
+
+	return ret;
+}
+
+/*** probe_release ***
+ * give back a slot to the probe budget, mark the request done */
+static void probe_release(struct request * request) {
+	pthread_mutex_lock(&probe_lock);
+	probes_active--;
+	request->host->probes--;
+	request->done = 1;
+	pthread_cond_broadcast(&probe_cond);
+	pthread_mutex_unlock(&probe_lock);
+}
+
+/*** session_lock_callback ***/
+static void session_lock_callback(CURL * handle, curl_lock_data data,
+		curl_lock_access access, void * userptr) {
+	pthread_mutex_lock(&session_locks[data]);
+}
+
+/*** session_unlock_callback ***/
+static void session_unlock_callback(CURL * handle, curl_lock_data data, void * userptr) {
+	pthread_mutex_unlock(&session_locks[data]);
+}
+
+/*** session_new ***
+ * create share for connections and dns cache */
+static CURLSH * session_new(void) {
+	CURLSH * share;
+
+	if ((share = curl_share_init()) == NULL) {
+		write_log(stderr, "curl_share_init() failed\n");
+		return NULL;
+	}
+
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, session_lock_callback);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, session_unlock_callback);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+	return share;
+}
+
+/*** session_touch ***
+ * A request for a database starts a session, any lookup in a session
+ * extends it. Probes in a session share connections, so these are kept
+ * open and later lookups skip connection setup. */
+static void session_touch(const uint8_t dbfile, const time_t now) {
+	time_t until = atomic_load(&session_until);
+
+	if (dbfile > 0 && until <= now && verbose > 0)
+		write_log(stdout, "Starting session, keeping connections open\n");
+
+	if (dbfile > 0 || until > now)
+		atomic_store(&session_until, now + SESSION_TIMEOUT);
+}
+
+/*** session_release ***
+ * Close connections after inactivity. Called from main loop, the share
+ * is replaced if no probe is using it. */
+static void session_release(const time_t now) {
+	time_t until = atomic_load(&session_until);
+
+	if (until == 0 || until > now || pthread_rwlock_trywrlock(&session_lock) != 0)
+		return;
+
+	if (verbose > 0)
+		write_log(stdout, "Session ended, closing connections\n");
+
+	if (session_share != NULL)
+		curl_share_cleanup(session_share);
+	session_share = session_new();
+	atomic_store(&session_until, 0);
+
+	pthread_rwlock_unlock(&session_lock);
+}
+
+/*** probe_header ***
+ * get the full size from Content-Range header of ranged request */
+static size_t probe_header(char * buffer, size_t size, size_t nitems, void * data) {
+	struct request * request = (struct request *)data;
+	const char * total;
+
+	if (nitems > 14 && strncasecmp(buffer, "Content-Range:", 14) == 0 &&
+			(total = memchr(buffer, '/', nitems)) != NULL && total[1] != '*')
+		request->content_length = strtoll(total + 1, NULL, 10);
+
+	return nitems * size;
+}
+
+/*** probe_write ***
+ * discard the body of ranged request, abort if the peer sends more */
+static size_t probe_write(char * buffer, size_t size, size_t nmemb, void * data) {
+	struct request * request = (struct request *)data;
+
+	/* start measuring after slow start */
+	if (request->skipped == 0 && request->bytes + (curl_off_t) (size * nmemb) >= THROUGHPUT_SKIP) {
+		request->skipped = request->bytes + size * nmemb;
+		gettimeofday(&request->tv_measure, NULL);
+	}
+
+	request->bytes += size * nmemb;
+
+	return request->bytes > request->range ? 0 : size * nmemb;
+}
+
+/*** get_http_code ***/
+static void * get_http_code(void * data) {
+	struct request * request = (struct request *)data;
+	struct arena * arena;
+	struct hosts * host;
+	uint8_t shared = 0, partial = 0;
+	CURL *curl;
+	CURLcode res;
+	char errbuf[CURL_ERROR_SIZE], range[48];
+	const char * sig_url = NULL;
+	long http_code, sig_http_code;
+	double time_measure;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	USDT(probe_start, request->host->host, request->url);
+
+	if ((curl = curl_easy_init()) != NULL) {
+		/* in a session use the shared connections, the share is not
+		   replaced while we hold the lock */
+		if (atomic_load(&session_until) > tv.tv_sec &&
+				pthread_rwlock_tryrdlock(&session_lock) == 0) {
+			shared = 1;
+			if (session_share != NULL) {
+				curl_easy_setopt(curl, CURLOPT_SHARE, session_share);
+				curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+			}
+		}
+		curl_easy_setopt(curl, CURLOPT_URL, request->url);
+		/* bind to the best interface the host was found on */
+		if (*request->interface != 0)
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, request->interface);
+		/* try to resolve addresses to all IP versions that your system allows */
+		curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_WHATEVER);
+		/* tell libcurl to follow redirection */
+		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+		/* set user agent */
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+		if (request->range > 0) {
+			/* receive part of the body to measure throughput */
+			snprintf(range, sizeof(range), "0-%jd", (intmax_t) request->range - 1);
+			curl_easy_setopt(curl, CURLOPT_RANGE, range);
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, probe_header);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, request);
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, probe_write);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, request);
+		} else
+			/* do not receive body */
+			curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+		/* ask for filetime */
+		curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+		/* set connection timeout to 2 seconds
+		 * if the host needs longer we do not want to use it anyway ;) */
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2L);
+		/* time out if connection is established but transfer rate is low
+		 * this should make curl finish after a maximum of 8 seconds */
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 3L);
+		/* skip all signal handling */
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		/* provide a buffer to store errors in */
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+		*errbuf = '\0';
+
+		/* perform the request, a ranged request is aborted if the peer
+		   ignores the range - that is fine with enough data */
+		if ((res = curl_easy_perform(curl)) == CURLE_INTERFACE_FAILED) {
+			/* binding may not be permitted, try again without */
+			if (verbose > 0)
+				write_log(stderr, "Could not bind to %s: %s\n", request->interface, errbuf);
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, NULL);
+			*errbuf = '\0';
+			res = curl_easy_perform(curl);
+		}
+		if (res != CURLE_OK &&
+				(res != CURLE_WRITE_ERROR || request->bytes <= request->range)) {
+			write_log(stderr, "Could not connect to peer %s on port %d: %s\n",
+					request->host->host, request->host->port,
+					*errbuf != 0 ? errbuf : curl_easy_strerror(res));
+			request->http_code = 0;
+			request->last_modified = 0;
+			request->time_total = time_since(&tv);
+			request->host->badtime = tv.tv_sec;
+			request->host->badcount++;
+			goto cleanup;
+		} else {
+			request->host->badtime = 0;
+			request->host->badcount = 0;
+			if (redirect_address > 0)
+				address_store(request->host, curl, request->interface, tv.tv_sec);
+		}
+
+		/* get http status code */
+		if ((res = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &(request->http_code))) != CURLE_OK) {
+			write_log(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
+			goto cleanup;
+		}
+
+		if ((res = curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &(request->time_namelookup))) != CURLE_OK ||
+				(res = curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &(request->time_connect))) != CURLE_OK ||
+				(res = curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &(request->time_total))) != CURLE_OK) {
+			write_log(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
+			goto cleanup;
+		}
+
+		/* measure throughput for ranged request, the size is taken from
+		   Content-Range for partial content */
+		if (request->range > 0 && (request->http_code == MHD_HTTP_PARTIAL_CONTENT ||
+				request->http_code == MHD_HTTP_OK)) {
+			if (request->http_code == MHD_HTTP_PARTIAL_CONTENT) {
+				request->http_code = MHD_HTTP_OK;
+				partial = 1;
+			}
+
+			if (request->skipped > 0 && request->bytes > request->skipped &&
+					(time_measure = time_since(&request->tv_measure)) > 0) {
+				request->throughput = (request->bytes - request->skipped) / time_measure;
+				host_measured(request->host, request->throughput);
+			}
+		}
+
+		/* get last modified time and size */
+		if (request->http_code == MHD_HTTP_OK) {
+			if ((res = curl_easy_getinfo(curl, CURLINFO_FILETIME, &(request->last_modified))) != CURLE_OK ||
+					(partial == 0 && (res = curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+						&(request->content_length))) != CURLE_OK)) {
+				write_log(stderr, "curl_easy_getinfo() failed: %s\n", curl_easy_strerror(res));
+				goto cleanup;
+			}
+		} else
+			request->last_modified = 0;
+
+		/* the signature is checked once the result is published */
+		if (request->http_code == MHD_HTTP_OK)
+			sig_url = request->sig_url;
+	}
+
+cleanup:
+	USDT(probe_finish, request->host->host, request->url, request->http_code,
+			(long) (request->time_total * 1000000));
+
+	/* give back the slot from probe budget, then drop the reference
+	   on the arena - the lookup may be answered already */
+	arena = request->arena;
+	host = request->host;
+	http_code = request->http_code;
+	probe_release(request);
+
+	/* check for the signature, reusing the connection - the request
+	   belongs to the lookup now, a peer with signature is remembered */
+	if (curl != NULL) {
+		if (sig_url != NULL) {
+			curl_easy_setopt(curl, CURLOPT_URL, sig_url);
+			curl_easy_setopt(curl, CURLOPT_RANGE, NULL);
+			curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+			if (curl_easy_perform(curl) == CURLE_OK &&
+					curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &sig_http_code) == CURLE_OK &&
+					sig_http_code == MHD_HTTP_OK)
+				sibling_store(file_basename(sig_url), host, 0);
+		}
+
+		/* always cleanup */
+		curl_easy_cleanup(curl);
+		if (shared > 0)
+			pthread_rwlock_unlock(&session_lock);
+	}
+
+	/* refresh the load reported by peer, the lookup does not wait */
+	if (peer_load > 0 && http_code > 0)
+		load_fetch(host, tv.tv_sec);
+
+	arena_free(arena);
+	thread_finish();
+
+	return NULL;
+}
+
+/*** find_owners ***
+ * Find the owners of a file by rendezvous hashing over the hosts online
+ * and ourself, so all peers agree on the owners. Owners are stored with
+ * highest score first, NULL is ourself. Returns the number of owners. */
+static int find_owners(const char * filename, const size_t length, struct hosts ** owner) {
+	struct hosts * hosts_ptr = NULL;
+	struct rendezvous rendezvous;
+	int i;
+
+	rendezvous_init(&rendezvous, filename, length, owners);
+	do {
+		if (hosts_ptr == NULL || hosts_ptr->online > 0)
+			rendezvous_add(&rendezvous, hosts_ptr != NULL ? hosts_ptr->host : self_name, hosts_ptr);
+
+		hosts_ptr = hosts_ptr == NULL ? hosts : hosts_ptr->next;
+	} while (hosts_ptr->host != NULL);
+
+	for (i = 0; i < rendezvous.count; i++)
+		owner[i] = rendezvous.owner[i];
+
+	return rendezvous.count;
+}
+
+/*** offer_send ***
+ * offer a file to its owners, runs in a thread */
+static void * offer_send(void * data) {
+	struct offer * offer = (struct offer *)data;
+	char url[PATH_MAX], interface[IF_NAMESIZE + 3];
+	long http_code;
+	CURL * curl;
+	CURLcode res;
+	int i;
+
+	for (i = 0; i < offer->count; i++) {
+		if ((curl = curl_easy_init()) == NULL)
+			break;
+
+		snprintf(url, sizeof(url), "http://%s:%d/offer/%s?from=%s",
+				offer->owners[i]->host, PORT_PEER, offer->filename, self_name);
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		bind_interface(offer->owners[i], interface, sizeof(interface));
+		if (*interface != 0)
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, interface);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2L);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 5L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+		if ((res = curl_easy_perform(curl)) == CURLE_INTERFACE_FAILED) {
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, NULL);
+			res = curl_easy_perform(curl);
+		}
+		if (res != CURLE_OK)
+			write_log(stderr, "Could not offer %s to %s: %s\n",
+					offer->filename, offer->owners[i]->host, curl_easy_strerror(res));
+		else if (verbose > 0 && curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code) == CURLE_OK)
+			write_log(stdout, "Offered %s to %s, received HTTP status code %ld\n",
+					offer->filename, offer->owners[i]->host, http_code);
+
+		curl_easy_cleanup(curl);
+	}
+
+	free(offer);
+	thread_finish();
+
+	return NULL;
+}
+
+/*** offer_start ***
+ * offer a file to its owners in background, skipping ourself */
+static void offer_start(const char * filename, struct hosts ** owner, const int count) {
+	struct offer * offer;
+	int i, error;
+
+	if ((offer = malloc(sizeof(struct offer))) == NULL)
+		return;
+
+	/* we may be an owner ourself, just remember our download */
+	snprintf(offer->filename, sizeof(offer->filename), "%s", filename);
+	offer->count = 0;
+	for (i = 0; i < count; i++)
+		if (owner[i] != NULL)
+			offer->owners[offer->count++] = owner[i];
+		else
+			inflight_store(filename, self_name);
+
+	if (offer->count == 0) {
+		free(offer);
+		return;
+	}
+
+	if ((error = thread_start(offer_send, (void *)offer)) != 0) {
+		write_log(stderr, "Could not run thread for offer, errno %d\n", error);
+		free(offer);
+	}
+}
+
+/*** inflight_store ***
+ * Remember host is downloading the file from mirror, oldest entry is
+ * overwritten. The first download is kept, later lookups wait for it. */
+static void inflight_store(const char * filename, const char * host) {
+	struct inflight * inflight;
+	time_t now = time(NULL);
+	unsigned int i;
+
+	pthread_mutex_lock(&inflights_lock);
+	for (i = 0; i < INFLIGHTS; i++)
+		if (inflights[i].time + INFLIGHT_TIMEOUT >= now &&
+				strcmp(inflights[i].filename, filename) == 0)
+			break;
+	if (i == INFLIGHTS) {
+		inflight = &inflights[inflights_next++ % INFLIGHTS];
+		snprintf(inflight->filename, sizeof(inflight->filename), "%s", filename);
+		snprintf(inflight->host, sizeof(inflight->host), "%s", host);
+		inflight->time = now;
+	}
+	pthread_mutex_unlock(&inflights_lock);
+}
+
+/*** inflight_lookup ***
+ * copy name of host downloading the file to buffer, return 1 if known */
+static uint8_t inflight_lookup(const char * filename, const time_t now, char * host, const size_t size) {
+	uint8_t found = 0;
+	unsigned int i;
+
+	pthread_mutex_lock(&inflights_lock);
+	for (i = 0; i < INFLIGHTS; i++) {
+		if (inflights[i].time + INFLIGHT_TIMEOUT < now ||
+				strcmp(inflights[i].filename, filename) != 0)
+			continue;
+
+		snprintf(host, size, "%s", inflights[i].host);
+		found = 1;
+		break;
+	}
+	pthread_mutex_unlock(&inflights_lock);
+
+	return found;
+}
+
+/*** inflight_query ***
+ * ask owner for the host downloading the file, return 1 if known */
+static uint8_t inflight_query(struct hosts * owner, const char * filename, char * host, const size_t size) {
+	char url[PATH_MAX], interface[IF_NAMESIZE + 3];
+	long http_code = 0;
+	uint8_t found = 0;
+	FILE * file;
+	CURL * curl;
+	CURLcode res;
+
+	if ((file = fmemopen(host, size, "w")) == NULL)
+		return 0;
+
+	if ((curl = curl_easy_init()) != NULL) {
+		snprintf(url, sizeof(url), "http://%s:%d/inflight/%s", owner->host, PORT_PEER, filename);
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		bind_interface(owner, interface, sizeof(interface));
+		if (*interface != 0)
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, interface);
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
+		/* the owner answers from memory, do not wait long */
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 500L);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 1000L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+		if ((res = curl_easy_perform(curl)) == CURLE_INTERFACE_FAILED) {
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, NULL);
+			res = curl_easy_perform(curl);
+		}
+		if (res == CURLE_OK && curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code) == CURLE_OK &&
+				http_code == MHD_HTTP_OK)
+			found = 1;
+		else if (verbose > 0 && res != CURLE_OK)
+			write_log(stderr, "Could not ask %s for downloads: %s\n",
+					owner->host, curl_easy_strerror(res));
+
+		curl_easy_cleanup(curl);
+	}
+
+	/* the stream terminates the string, strip the line break */
+	if (fclose(file) != 0)
+		found = 0;
+	host[strcspn(host, "\n")] = 0;
+
+	return found;
+}
+
+/*** inflight_find ***
+ * Ask the owners for a peer downloading the file from mirror. Return the
+ * host, NULL if there is none or it is ourself. */
+static struct hosts * inflight_find(const char * filename, struct hosts ** owner, const int count) {
+	struct hosts * hosts_ptr;
+	char host[HOST_NAME_MAX + 2];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		*host = 0;
+		if (owner[i] == NULL ? inflight_lookup(filename, time(NULL), host, sizeof(host)) == 0 :
+				inflight_query(owner[i], filename, host, sizeof(host)) == 0)
+			continue;
+
+		if (strcmp(host, self_name) == 0)
+			return NULL;
+
+		for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next)
+			if (hosts_ptr->online > 0 && strcmp(hosts_ptr->host, host) == 0)
+				return hosts_ptr;
+	}
+
+	return NULL;
+}
+
+/*** inflight_wait_for ***
+ * Wait for host to finish downloading the file, but no longer than
+ * timeout milliseconds or until quitting. Return 1 if the host has
+ * the file. */
+static uint8_t inflight_wait_for(struct hosts * host, const char * filename, const off_t size,
+		const long timeout) {
+	char url[PATH_MAX], interface[IF_NAMESIZE + 3];
+	curl_off_t content_length;
+	long http_code;
+	struct timeval tv;
+	uint8_t found = 0;
+	CURL * curl;
+
+	if ((curl = curl_easy_init()) == NULL)
+		return 0;
+
+	snprintf(url, sizeof(url), "http://%s:%d/pkg/%s", host->host, host->port, filename);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	bind_interface(host, interface, sizeof(interface));
+	if (*interface != 0)
+		curl_easy_setopt(curl, CURLOPT_INTERFACE, interface);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, timeout < 500 ? timeout : 500L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout < 1000 ? timeout : 1000L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+
+	if (verbose > 0)
+		write_log(stdout, "Host %s is downloading %s, waiting\n", host->host, filename);
+
+	/* pacman renames the file when the download finished, the size is
+	   checked anyway */
+	gettimeofday(&tv, NULL);
+	while (1) {
+		if (curl_easy_perform(curl) == CURLE_OK &&
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code) == CURLE_OK &&
+				http_code == MHD_HTTP_OK &&
+				curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) == CURLE_OK &&
+				(size < 0 || content_length == size)) {
+			found = 1;
+			break;
+		}
+
+		if (quit != 0 || time_since(&tv) * 1000 + INFLIGHT_INTERVAL >= timeout)
+			break;
+		usleep(INFLIGHT_INTERVAL * 1000);
+	}
+
+	curl_easy_cleanup(curl);
+
+	return found;
+}
+
+/*** file_verify ***
+ * Check a pulled file against the sync database: a package by its size
+ * and SHA-256 digest, a signature by its content (base64 encoded in the
+ * database). Returns 1 if it matches. */
+static uint8_t file_verify(const char * path, const off_t size, const char * sha256, const char * sig) {
+	unsigned char buffer[16384], digest[EVP_MAX_MD_SIZE];
+	char hex[2 * EVP_MAX_MD_SIZE + 1], encoded[4 * sizeof(buffer) / 3 + 4];
+	unsigned int digest_len, i;
+	EVP_MD_CTX * ctx = NULL;
+	struct stat st;
+	uint8_t match = 0;
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || (size >= 0 && st.st_size != size))
+		goto out;
+
+	/* a signature is small, compare it in one go */
+	if (sig != NULL) {
+		if (st.st_size <= (off_t) sizeof(buffer) &&
+				(len = read(fd, buffer, sizeof(buffer))) == st.st_size) {
+			EVP_EncodeBlock((unsigned char *) encoded, buffer, len);
+			match = strcmp(encoded, sig) == 0;
+		}
+		goto out;
+	}
+
+	if (sha256 == NULL || (ctx = EVP_MD_CTX_new()) == NULL ||
+			EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+		goto out;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+		EVP_DigestUpdate(ctx, buffer, len);
+	if (len < 0 || EVP_DigestFinal_ex(ctx, digest, &digest_len) != 1)
+		goto out;
+	for (i = 0; i < digest_len; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+	match = strcmp(hex, sha256) == 0;
+
+out:
+	EVP_MD_CTX_free(ctx);
+	close(fd);
+
+	return match;
+}
+
+/*** pull_file ***
+ * Pull a file from peer to package cache, it is checked against size and
+ * digest (for packages) or signature (for signatures) from sync database.
+ * Returns 1 if the file is in cache, 0 if the peer does not have it (yet)
+ * and -1 on error or if the file is pulled by another thread already. */
+static int pull_file(struct hosts * host, const char * filename, const off_t size,
+		const char * sha256, const char * sig) {
+	char path[PATH_MAX], part[PATH_MAX], url[PATH_MAX], interface[IF_NAMESIZE + 3];
+	char errbuf[CURL_ERROR_SIZE];
+	struct stat st;
+	long http_code = 0;
+	int fd, ret = -1;
+	FILE * file;
+	CURL * curl;
+	CURLcode res;
+
+	snprintf(path, sizeof(path), CACHEPATH "%s", filename);
+	snprintf(part, sizeof(part), CACHEPATH ".%s.part", filename);
+
+	if (stat(path, &st) == 0)
+		return 1;
+
+	/* the partial file is created exclusively, so a file is pulled once -
+	   but do not let a stale one block forever */
+	if ((fd = open(part, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0 && errno == EEXIST &&
+			stat(part, &st) == 0 && st.st_mtime + OFFER_TIMEOUT < time(NULL) && unlink(part) == 0)
+		fd = open(part, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		if (errno != EEXIST)
+			write_log(stderr, "Could not create %s: %s\n", part, strerror(errno));
+		return -1;
+	}
+
+	if ((file = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(part);
+		return -1;
+	}
+
+	if ((curl = curl_easy_init()) != NULL) {
+		snprintf(url, sizeof(url), "http://%s:%d/pkg/%s", host->host, host->port, filename);
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		bind_interface(host, interface, sizeof(interface));
+		if (*interface != 0)
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, interface);
+		curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, file);
+		/* do not store error pages */
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 2L);
+		/* give up if transfer stalls for 30 seconds */
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+		*errbuf = '\0';
+
+		if ((res = curl_easy_perform(curl)) == CURLE_INTERFACE_FAILED) {
+			curl_easy_setopt(curl, CURLOPT_INTERFACE, NULL);
+			*errbuf = '\0';
+			res = curl_easy_perform(curl);
+		}
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+		if (res == CURLE_OK)
+			ret = 1;
+		else if (http_code == MHD_HTTP_NOT_FOUND)
+			ret = 0;
+		else
+			write_log(stderr, "Could not pull %s from %s: %s\n", filename, host->host,
+					*errbuf != 0 ? errbuf : curl_easy_strerror(res));
+
+		curl_easy_cleanup(curl);
+	}
+
+	if (fclose(file) != 0 && ret > 0) {
+		write_log(stderr, "Could not write %s: %s\n", part, strerror(errno));
+		ret = -1;
+	}
+
+	/* the peer may have a different version of the sync database, or
+	   send anything */
+	if (ret > 0 && file_verify(part, size, sha256, sig) == 0) {
+		write_log(stderr, "File %s from %s does not match sync database, discarding\n",
+				filename, host->host);
+		ret = -1;
+	}
+
+	if (ret > 0 && rename(part, path) != 0) {
+		write_log(stderr, "Could not rename %s: %s\n", part, strerror(errno));
+		ret = -1;
+	}
+	if (ret <= 0)
+		unlink(part);
+
+	return ret;
+}
+
+/*** offer_pull ***
+ * Pull a file offered by a peer, along with its signature if the sync
+ * database has it to check against. Runs in a thread. The offer is sent
+ * when pacman on the peer starts downloading from the mirror, so poll
+ * until it finished. */
+static void * offer_pull(void * data) {
+	struct pull * pull = (struct pull *)data;
+	char sigfile[NAME_MAX + 1], sha256[65], * sig;
+	off_t size;
+	int waited, ret = 0;
+
+	/* nothing is written to cache that can not be checked */
+	if (package_checksum(pull->filename, &size, sha256, sizeof(sha256), &sig) == 0) {
+		write_log(stderr, "No checksum for %s in sync databases, not pulling\n", pull->filename);
+		goto out;
+	}
+
+	for (waited = 0; ret == 0 && waited < OFFER_TIMEOUT; waited += OFFER_INTERVAL) {
+		sleep(OFFER_INTERVAL);
+		ret = pull_file(pull->host, pull->filename, size, sha256, NULL);
+	}
+
+	if (ret > 0) {
+		write_log(stdout, "Pulled %s from %s\n", pull->filename, pull->host->host);
+		if (sig != NULL &&
+				snprintf(sigfile, sizeof(sigfile), "%s.sig", pull->filename) < (int) sizeof(sigfile))
+			pull_file(pull->host, sigfile, -1, NULL, sig);
+	} else if (ret == 0)
+		write_log(stderr, "Peer %s did not provide %s within %d seconds, giving up\n",
+				pull->host->host, pull->filename, OFFER_TIMEOUT);
+
+	free(sig);
+
+out:
+	atomic_fetch_sub(&pulls_active, 1);
+	free(pull);
+	thread_finish();
+
+	return NULL;
+}
+
+/* append_string */
+static char * append_string(char * string, const char *format, ...) {
+	va_list args;
+	size_t string_len = 0, append_len;
+
+	if (string != NULL)
+		string_len = strlen(string);
+
+	va_start(args, format);
+	append_len = vsnprintf(NULL, 0, format, args) + 1;
+	va_end(args);
+
+	string = realloc(string, string_len + append_len);
 
 	va_start(args, format);
 	vsnprintf(string + string_len, append_len, format, args);
 	va_end(args);
 
-	return string;
+	return string;
+}
+/*** history_state ***
+ * return the availability of host */
+static uint8_t history_state(const struct hosts * host, const time_t now) {
+	if (host->online == 0)
+		return HISTORY_OFFLINE;
+	if (host->badcount > 0 && host->badtime + host->badcount * BADTIME > now)
+		return HISTORY_BAD;
+	return HISTORY_AVAILABLE;
+}
+
+/*** history_percentiles ***
+ * Get latency percentiles from histogram, this is the upper bound of
+ * the bucket. */
+static void history_percentiles(const unsigned int * histogram, long * latency) {
+	static const unsigned int percentiles[3] = { 50, 95, 99 };
+	unsigned long total = 0, count;
+	int i, bucket;
+
+	for (bucket = 0; bucket < HISTORY_BUCKETS; bucket++)
+		total += histogram[bucket];
+
+	for (i = 0; i < 3; i++) {
+		latency[i] = 0;
+		if (total == 0)
+			continue;
+
+		for (bucket = 0, count = 0; bucket < HISTORY_BUCKETS - 1; bucket++) {
+			count += histogram[bucket];
+			if (count * 100 >= total * percentiles[i])
+				break;
+		}
+		latency[i] = lround(exp2((bucket + 1) / 4.0));
+	}
+}
+
+/*** history_advance ***
+ * Close the current minute and start new ones up to now. Host
+ * availability for a new minute is initialized with the current state.
+ * Call with history_lock held. */
+static void history_advance(const time_t now) {
+	struct hosts * hosts_ptr;
+	struct history * slot;
+	time_t minute = now / 60;
+
+	if (minute <= history_minute)
+		return;
+
+	/* nothing is known before start */
+	if (history_minute == 0)
+		history_minute = minute - 1;
+	else {
+		history_percentiles(history_latency, history[history_minute % HISTORY_MINUTES].latency);
+		memset(history_latency, 0, sizeof(history_latency));
+	}
+
+	/* skip what does not fit */
+	if (minute - history_minute > HISTORY_MINUTES)
+		history_minute = minute - HISTORY_MINUTES;
+
+	while (history_minute < minute) {
+		history_minute++;
+		slot = &history[history_minute % HISTORY_MINUTES];
+		memset(slot, 0, sizeof(struct history));
+		slot->minute = history_minute;
+
+		for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next)
+			if (hosts_ptr->history != NULL)
+				hosts_ptr->history[history_minute % HISTORY_MINUTES] =
+					history_state(hosts_ptr, now);
+	}
+}
+
+/*** history_record ***
+ * count a lookup with decision latency in microseconds */
+static void history_record(const time_t now, const uint8_t redirect, const long latency) {
+	struct history * slot;
+	int bucket;
+
+	bucket = latency > 1 ? (int) (log2(latency) * 4) : 0;
+	if (bucket >= HISTORY_BUCKETS)
+		bucket = HISTORY_BUCKETS - 1;
+
+	pthread_mutex_lock(&history_lock);
+	history_advance(now);
+	slot = &history[history_minute % HISTORY_MINUTES];
+	slot->lookups++;
+	if (redirect > 0)
+		slot->redirects++;
+	history_latency[bucket]++;
+	pthread_mutex_unlock(&history_lock);
+}
+
+/*** history_sample ***
+ * sample host availability, the worst state in a minute is kept */
+static void history_sample(const time_t now) {
+	struct hosts * hosts_ptr;
+	uint8_t * state;
+
+	pthread_mutex_lock(&history_lock);
+	history_advance(now);
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next) {
+		if (hosts_ptr->history == NULL)
+			continue;
+
+		state = &hosts_ptr->history[history_minute % HISTORY_MINUTES];
+		if (*state < history_state(hosts_ptr, now))
+			*state = history_state(hosts_ptr, now);
+	}
+	pthread_mutex_unlock(&history_lock);
+}
+
+/*** history_aggregate ***
+ * Aggregate size minutes starting with minute first, minutes not known
+ * are skipped. Call with history_lock held. */
+static void history_aggregate(struct history * group, const time_t first, const int size) {
+	struct history * slot;
+	time_t minute;
+	int i;
+
+	memset(group, 0, sizeof(struct history));
+	for (minute = first; minute < first + size; minute++) {
+		slot = &history[minute % HISTORY_MINUTES];
+		if (minute <= 0 || slot->minute != minute)
+			continue;
+
+		group->minute++;
+		group->lookups += slot->lookups;
+		group->redirects += slot->redirects;
+		for (i = 0; i < 3; i++)
+			if (slot->latency[i] > group->latency[i])
+				group->latency[i] = slot->latency[i];
+	}
+}
+
+/*** history_available ***
+ * Count the minutes host was available in size minutes starting with
+ * minute first, minutes with known state are counted in known. Call with
+ * history_lock held. */
+static int history_available(const struct hosts * host, const time_t first, const int size, int * known) {
+	time_t minute;
+	int available = 0;
+
+	*known = 0;
+	if (host->history == NULL)
+		return 0;
+
+	for (minute = first; minute < first + size; minute++) {
+		if (minute <= 0 || history[minute % HISTORY_MINUTES].minute != minute ||
+				host->history[minute % HISTORY_MINUTES] == HISTORY_UNKNOWN)
+			continue;
+
+		(*known)++;
+		if (host->history[minute % HISTORY_MINUTES] == HISTORY_AVAILABLE)
+			available++;
+	}
+
+	return available;
+}
+
+/*** sparkline ***
+ * append a sparkline to page, negative values are unknown */
+static char * sparkline(char * page, const double * values, const int count, const double max) {
+	int i, level;
+
+	for (i = 0; i < count; i++) {
+		if (values[i] < 0) {
+			page = append_string(page, "&#xb7;");
+			continue;
+		}
+
+		level = max > 0 ? lround(values[i] / max * 7) : 0;
+		page = append_string(page, "&#x%x;", 0x2581 + (level > 7 ? 7 : level));
+	}
+
+	return page;
+}
+
+/*** status_history ***
+ * Append history to status page: per minute for the last hour, per half
+ * an hour for the last 24 hours. */
+static char * status_history(char * page) {
+	static const char * names[3] = { "latency p50", "latency p95", "latency p99" };
+	struct history hour[60], day[48], total;
+	double values[60], max;
+	struct hosts * hosts_ptr;
+	char summary[2][32];
+	int i, j, known, available;
+	time_t first;
+
+	pthread_mutex_lock(&history_lock);
+	history_advance(time(NULL));
+	first = history_minute - 59;
+	for (i = 0; i < 60; i++)
+		history_aggregate(&hour[i], first + i, 1);
+	first = history_minute + 1 - 48 * 30;
+	for (i = 0; i < 48; i++)
+		history_aggregate(&day[i], first + i * 30, 30);
+	/* the current minute is not closed yet */
+	history_percentiles(history_latency, hour[59].latency);
+	for (i = 0; i < 3; i++)
+		if (hour[59].latency[i] > day[47].latency[i])
+			day[47].latency[i] = hour[59].latency[i];
+
+	page = append_string(page, STATUS_HISTORY_HEAD);
+
+	/* lookups per minute */
+	page = append_string(page, STATUS_HISTORY_ROW, "lookups per minute");
+	for (i = 0, max = 0; i < 60; i++)
+		if ((values[i] = hour[i].minute > 0 ? hour[i].lookups : -1) > max)
+			max = values[i];
+	page = sparkline(page, values, 60, max);
+	snprintf(summary[0], sizeof(summary[0]), "max %.0f", max);
+	page = append_string(page, STATUS_HISTORY_CELL, summary[0]);
+	for (i = 0, max = 0; i < 48; i++)
+		if ((values[i] = day[i].minute > 0 ? (double) day[i].lookups / day[i].minute : -1) > max)
+			max = values[i];
+	page = sparkline(page, values, 48, max);
+	snprintf(summary[1], sizeof(summary[1]), "max %.1f", max);
+	page = append_string(page, STATUS_HISTORY_ROW_END, summary[1]);
+
+	/* hit ratio */
+	page = append_string(page, STATUS_HISTORY_ROW, "redirected");
+	for (i = 0; i < 60; i++)
+		values[i] = hour[i].lookups > 0 ? (double) hour[i].redirects / hour[i].lookups : -1;
+	page = sparkline(page, values, 60, 1);
+	history_aggregate(&total, history_minute - 59, 60);
+	snprintf(summary[0], sizeof(summary[0]), "%.0f %%", total.lookups > 0 ?
+			100.0 * total.redirects / total.lookups : 0);
+	page = append_string(page, STATUS_HISTORY_CELL, summary[0]);
+	for (i = 0; i < 48; i++)
+		values[i] = day[i].lookups > 0 ? (double) day[i].redirects / day[i].lookups : -1;
+	page = sparkline(page, values, 48, 1);
+	history_aggregate(&total, history_minute + 1 - HISTORY_MINUTES, HISTORY_MINUTES);
+	snprintf(summary[1], sizeof(summary[1]), "%.0f %%", total.lookups > 0 ?
+			100.0 * total.redirects / total.lookups : 0);
+	page = append_string(page, STATUS_HISTORY_ROW_END, summary[1]);
+
+	/* decision latency, in milliseconds */
+	for (j = 0; j < 3; j++) {
+		page = append_string(page, STATUS_HISTORY_ROW, names[j]);
+		for (i = 0, max = 0; i < 60; i++)
+			if ((values[i] = hour[i].lookups > 0 ? hour[i].latency[j] / 1000.0 : -1) > max)
+				max = values[i];
+		page = sparkline(page, values, 60, max);
+		snprintf(summary[0], sizeof(summary[0]), "max %.1f ms", max);
+		page = append_string(page, STATUS_HISTORY_CELL, summary[0]);
+		for (i = 0, max = 0; i < 48; i++)
+			if ((values[i] = day[i].lookups > 0 ? day[i].latency[j] / 1000.0 : -1) > max)
+				max = values[i];
+		page = sparkline(page, values, 48, max);
+		snprintf(summary[1], sizeof(summary[1]), "max %.1f ms", max);
+		page = append_string(page, STATUS_HISTORY_ROW_END, summary[1]);
+	}
+
+	/* availability of hosts */
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next) {
+		page = append_string(page, STATUS_HISTORY_ROW, hosts_ptr->host);
+		for (i = 0; i < 60; i++) {
+			available = history_available(hosts_ptr, history_minute - 59 + i, 1, &known);
+			values[i] = known > 0 ? available : -1;
+		}
+		page = sparkline(page, values, 60, 1);
+		available = history_available(hosts_ptr, history_minute - 59, 60, &known);
+		snprintf(summary[0], sizeof(summary[0]), "%.0f %% available",
+				known > 0 ? 100.0 * available / known : 0);
+		page = append_string(page, STATUS_HISTORY_CELL, summary[0]);
+		for (i = 0; i < 48; i++) {
+			available = history_available(hosts_ptr, first + i * 30, 30, &known);
+			values[i] = known > 0 ? (double) available / known : -1;
+		}
+		page = sparkline(page, values, 48, 1);
+		available = history_available(hosts_ptr, first, HISTORY_MINUTES, &known);
+		snprintf(summary[1], sizeof(summary[1]), "%.0f %% available",
+				known > 0 ? 100.0 * available / known : 0);
+		page = append_string(page, STATUS_HISTORY_ROW_END, summary[1]);
+	}
+	pthread_mutex_unlock(&history_lock);
+
+	page = append_string(page, STATUS_HISTORY_FOOT);
+
+	return page;
+}
+
+/*** json_string ***
+ * write string to stream, escaped for JSON (without quotes) */
+static void json_string(FILE * stream, const char * string) {
+	for (; *string != 0; string++) {
+		if (*string == '"' || *string == '\\')
+			fprintf(stream, "\\%c", *string);
+		else if ((unsigned char) *string < 0x20)
+			fprintf(stream, "\\u%04x", (unsigned char) *string);
+		else
+			fputc(*string, stream);
+	}
+}
+
+/*** history_json ***
+ * Give history as JSON, oldest minute first. Availability of hosts is a
+ * string with a character per minute, see HISTORY_* defines. */
+static char * history_json(void) {
+	struct hosts * hosts_ptr;
+	struct history * slot;
+	char * json = NULL;
+	size_t size;
+	long latency[3];
+	time_t minute, first;
+	FILE * stream;
+	uint8_t comma = 0;
+
+	if ((stream = open_memstream(&json, &size)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&history_lock);
+	history_advance(time(NULL));
+	first = history_minute + 1 - HISTORY_MINUTES;
+
+	fprintf(stream, "{\"minutes\":[");
+	for (minute = first; minute <= history_minute; minute++) {
+		slot = &history[minute % HISTORY_MINUTES];
+		if (minute <= 0 || slot->minute != minute)
+			continue;
+
+		/* the current minute is not closed yet */
+		if (minute == history_minute)
+			history_percentiles(history_latency, latency);
+		else
+			memcpy(latency, slot->latency, sizeof(latency));
+
+		fprintf(stream, "%s{\"time\":%jd,\"lookups\":%u,\"redirects\":%u,"
+				"\"latency\":{\"p50\":%ld,\"p95\":%ld,\"p99\":%ld}}",
+				comma++ ? "," : "", (intmax_t) minute * 60,
+				slot->lookups, slot->redirects, latency[0], latency[1], latency[2]);
+	}
+
+	fprintf(stream, "],\"hosts\":[");
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next) {
+		fprintf(stream, "%s{\"host\":\"", hosts_ptr != hosts ? "," : "");
+		json_string(stream, hosts_ptr->host);
+		fprintf(stream, "\",\"availability\":\"");
+		for (minute = first; minute <= history_minute; minute++)
+			if (minute > 0 && history[minute % HISTORY_MINUTES].minute == minute)
+				fputc('0' + (hosts_ptr->history != NULL ?
+					hosts_ptr->history[minute % HISTORY_MINUTES] : HISTORY_UNKNOWN), stream);
+		fprintf(stream, "\"}");
+	}
+	fprintf(stream, "]}\n");
+	pthread_mutex_unlock(&history_lock);
+
+	if (fclose(stream) != 0) {
+		free(json);
+		return NULL;
+	}
+
+	return json;
+}
+
+/*** trace_open ***
+ * open trace file for appending, write magic to new file */
+static int trace_open(const char * path) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+		write_log(stderr, "Failed to open trace file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) == 0 && st.st_size == 0 &&
+			write(fd, TRACE_MAGIC, TRACE_MAGIC_LEN) != TRACE_MAGIC_LEN) {
+		write_log(stderr, "Failed to write trace file %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*** trace_lookup ***
+ * Write a trace record for a lookup. The record is written with a single
+ * call to write(), so records from concurrent requests do not mix. */
+static void trace_lookup(struct arena * arena, const char * basename, const uint8_t class,
+		const uint8_t decision, const struct request * requests, const int count,
+		const int chosen, const struct timeval * tv, const long latency,
+		const time_t if_modified_since, const off_t size) {
+	struct trace_record record = { 0 };
+	struct trace_peer peer = { 0 };
+	size_t host_len;
+	char * buffer, * ptr;
+	int i;
+
+	record.size = sizeof(struct trace_record) + strlen(basename);
+	for (i = 0; i < count; i++)
+		record.size += sizeof(struct trace_peer) + strlen(requests[i].host->host);
+
+	if ((buffer = arena_alloc(arena, record.size)) == NULL)
+		return;
+
+	record.class = class;
+	record.decision = decision;
+	record.peers = count;
+	record.chosen = chosen;
+	record.name_len = strlen(basename);
+	record.time = (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+	record.latency = latency;
+	record.if_modified_since = if_modified_since;
+	record.size_expected = size;
+
+	ptr = mempcpy(buffer, &record, sizeof(struct trace_record));
+	ptr = mempcpy(ptr, basename, record.name_len);
+
+	for (i = 0; i < count; i++) {
+		host_len = strlen(requests[i].host->host);
+		peer.http_code = requests[i].http_code;
+		peer.host_len = host_len;
+		peer.time_total = requests[i].time_total * 1000000;
+		peer.last_modified = requests[i].last_modified;
+		peer.content_length = requests[i].content_length;
+		peer.throughput = requests[i].candidate.throughput;
+
+		ptr = mempcpy(ptr, &peer, sizeof(struct trace_peer));
+		ptr = mempcpy(ptr, requests[i].host->host, host_len);
+	}
+
+	if (write(trace_fd, buffer, record.size) != record.size)
+		write_log(stderr, "Failed to write trace record: %s\n", strerror(errno));
+}
+
+/*** server_timing ***
+ * format the timing as value for Server-Timing header, durations in ms */
+static int server_timing(char * buffer, const size_t size, const struct timing * timing) {
+	return snprintf(buffer, size, "throttle;dur=%.3f, spawn;dur=%.3f, "
+			"dns;dur=%.3f, connect;dur=%.3f, head;dur=%.3f, join;dur=%.3f, "
+			"chosen;dur=%.3f, inflight;dur=%.3f, query;dur=%.3f, peers;desc=\"%d\"",
+			timing->throttle * 1000, timing->spawn * 1000,
+			timing->namelookup * 1000, timing->connect * 1000, timing->head * 1000,
+			timing->join * 1000, timing->chosen * 1000, timing->inflight * 1000,
+			timing->query * 1000, timing->peers);
+}
+
+/*** status_page ***/
+static char * status_page(void) {
+	struct ignore_interfaces * ignore_interfaces_ptr;
+	struct hosts * hosts_ptr = hosts;
+	struct host_interface interface;
+	char *page = NULL, *overall = CIRCLE_BLUE;
+	char hostname[HOST_NAME_MAX];
+	struct timeval tv;
+
+	/* initialize struct timeval */
+	gettimeofday(&tv, NULL);
+
+	if (count_redirect + count_not_found)
+		switch (count_redirect * 4 / (count_redirect + count_not_found)) {
+			case 0:
+				overall = CIRCLE_RED;
+				break;
+			case 1:
+				overall = CIRCLE_ORANGE;
+				break;
+			case 2:
+				overall = CIRCLE_YELLOW;
+				break;
+			default:
+				overall = CIRCLE_GREEN;
+				break;
+		}
+
+	gethostname(hostname, HOST_NAME_MAX);
+	page = append_string(page, STATUS_HEAD, hostname, count_redirect, count_not_found, overall);
+
+	page = append_string(page, STATUS_INT_HEAD);
+	pthread_rwlock_rdlock(&config_lock);
+	ignore_interfaces_ptr = ignore_interfaces;
+	if (ignore_interfaces_ptr->interface == NULL)
+		page = append_string(page, STATUS_INT_NONE);
+	while (ignore_interfaces_ptr->interface != NULL) {
+		if (ignore_interfaces_ptr->ifindex > 0)
+			/* write_log(stdout, STATUS_INT_ONE,
+				ignore_interfaces_ptr->interface, ignore_interfaces_ptr->ifindex); */
+			page = append_string(page, STATUS_INT_ONE,
+				ignore_interfaces_ptr->interface, ignore_interfaces_ptr->ifindex);
+		else
+			page = append_string(page, STATUS_INT_ONE_NA,
+				ignore_interfaces_ptr->interface);
+
+		ignore_interfaces_ptr = ignore_interfaces_ptr->next;
+	}
+	pthread_rwlock_unlock(&config_lock);
+	page = append_string(page, STATUS_INT_FOOT);
+	
+	page = append_string(page, STATUS_HOST_HEAD);
+	if (hosts_ptr->host == NULL)
+		page = append_string(page, STATUS_HOST_NONE);
+	while (hosts_ptr->host != NULL) {
+		time_t badtime = hosts_ptr->badtime + hosts_ptr->badcount * BADTIME;
+		uint8_t bad = hosts_ptr->badcount && badtime > tv.tv_sec ? 1 : 0;
+
+		page = append_string(page, STATUS_HOST_ONE,
+			(hosts_ptr->mdns && !hosts_ptr->online) || bad ? " class=\"grey\"" : "",
+			hosts_ptr->host, hosts_ptr->port,
+			interface_copy(hosts_ptr, &interface) >= 0 ? interface.name : "-",
+			hosts_ptr->mdns ? (hosts_ptr->online ? CIRCLE_GREEN : CIRCLE_RED) : CIRCLE_BLUE,
+			hosts_ptr->mdns ? (hosts_ptr->online ? "online" : "offline") : "static",
+			hosts_ptr->finds ? CIRCLE_GREEN : CIRCLE_BLUE, hosts_ptr->finds,
+			bad ? CIRCLE_RED : CIRCLE_BLUE,
+			hosts_ptr->badcount);
+
+		hosts_ptr = hosts_ptr->next;
+	}
+	page = append_string(page, STATUS_HOST_FOOT);
+
+	page = status_history(page);
+
+	page = append_string(page, STATUS_FOOT);
+
+	return page;
+}
+
+/*** query_socket ***
+ * Open a socket for sending to the query group. Datagrams do not leave
+ * the link, and are not looped back. */
+static int query_socket(void) {
+	unsigned char ttl = 1, loop = 0;
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+	return fd;
+}
+
+/*** query_nonce ***
+ * Id for a ping or query, unpredictable so replies can not be made up in
+ * advance */
+static unsigned int query_nonce(void) {
+	static atomic_uint fallback = 0;
+	unsigned int id;
+
+	if (getrandom(&id, sizeof(id), GRND_NONBLOCK) != sizeof(id))
+		id = atomic_fetch_add(&fallback, 1) ^ (unsigned int) time(NULL) * 2654435761U;
+
+	return id;
+}
+
+/*** query_responding ***
+ * True if host answered a ping recently, its round trip time and address
+ * are copied if requested. */
+static uint8_t query_responding(struct hosts * host, const time_t now, long * rtt,
+		struct in_addr * address) {
+	struct host_interface interface;
+	uint8_t responding;
+
+	responding = host->online > 0 && interface_copy(host, &interface) >= 0;
+
+	pthread_mutex_lock(&query_lock);
+	responding = responding > 0 && host->query_seen + QUERY_VALID >= now;
+	if (rtt != NULL)
+		*rtt = host->query_rtt;
+	if (address != NULL)
+		*address = host->query_address;
+	pthread_mutex_unlock(&query_lock);
+
+	return responding;
+}
+
+/*** query_send ***
+ * Send a datagram to the query group, once on every interface a host
+ * (responding only, if requested) was found on. Returns the number of
+ * datagrams sent. */
+static int query_send(const int fd, const char * message, const uint8_t responding, const time_t now) {
+	struct sockaddr_in group = {
+		.sin_family = AF_INET,
+		.sin_port = htons(PORT_QUERY),
+	};
+	struct ip_mreqn mreqn = { 0 };
+	struct hosts * hosts_ptr, * other;
+	struct host_interface interface, other_interface;
+	int sent = 0;
+
+	inet_pton(AF_INET, QUERY_GROUP, &group.sin_addr);
+
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next) {
+		if (hosts_ptr->online == 0 || interface_copy(hosts_ptr, &interface) < 0 ||
+				(responding > 0 && query_responding(hosts_ptr, now, NULL, NULL) == 0))
+			continue;
+
+		/* skip the interface if sent there already */
+		for (other = hosts; other != hosts_ptr; other = other->next)
+			if (other->online > 0 && interface_copy(other, &other_interface) >= 0 &&
+					(responding == 0 || query_responding(other, now, NULL, NULL) > 0) &&
+					other_interface.ifindex == interface.ifindex)
+				break;
+		if (other != hosts_ptr)
+			continue;
+
+		mreqn.imr_ifindex = interface.ifindex;
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof(mreqn)) == 0 &&
+				sendto(fd, message, strlen(message), 0,
+					(struct sockaddr *) &group, sizeof(group)) > 0)
+			sent++;
+	}
+
+	return sent;
+}
+
+/*** query_host ***
+ * find the host a reply came from, by its name */
+static struct hosts * query_host(const char * name) {
+	struct hosts * hosts_ptr;
+
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next)
+		if (hosts_ptr->online > 0 && strcmp(hosts_ptr->host, name) == 0)
+			return hosts_ptr;
+
+	return NULL;
+}
+
+/*** query_ping ***
+ * Find the peers running a responder. These are queried in lookups,
+ * the others are probed. A pong counts only if it comes from an address
+ * the host name resolves to, that is checked after the window closed as
+ * resolving takes time. */
+static void query_ping(const time_t now) {
+	struct hosts * host;
+	struct query_pong * pongs;
+	struct pollfd pfd = { .events = POLLIN };
+	struct sockaddr_in from;
+	socklen_t from_len;
+	struct timeval tv;
+	char buffer[QUERY_SIZE], name[256];
+	unsigned int id = query_nonce(), reply_id;
+	int i, host_count = 0, pong_count = 0, count = 0, timeout;
+	ssize_t len;
+
+	for (host = hosts; host->host != NULL; host = host->next)
+		host_count++;
+	if (host_count == 0 || (pongs = calloc(host_count, sizeof(struct query_pong))) == NULL)
+		return;
+
+	if ((pfd.fd = query_socket()) < 0) {
+		free(pongs);
+		return;
+	}
+
+	snprintf(buffer, sizeof(buffer), QUERY_MAGIC " ping %u", id);
+	gettimeofday(&tv, NULL);
+	if (query_send(pfd.fd, buffer, 0, now) == 0)
+		goto out;
+
+	while ((timeout = QUERY_PING_WINDOW - time_since(&tv) * 1000) > 0 &&
+			poll(&pfd, 1, timeout) > 0) {
+		from_len = sizeof(from);
+		if ((len = recvfrom(pfd.fd, buffer, sizeof(buffer) - 1, 0,
+				(struct sockaddr *) &from, &from_len)) <= 0 || from.sin_family != AF_INET)
+			continue;
+		buffer[len] = '\0';
+
+		if (sscanf(buffer, QUERY_MAGIC " pong %u %255s", &reply_id, name) != 2 ||
+				reply_id != id || (host = query_host(name)) == NULL)
+			continue;
+
+		/* one pong per host, the first one */
+		for (i = 0; i < pong_count && pongs[i].host != host; i++);
+		if (i < pong_count || pong_count >= host_count)
+			continue;
+
+		pongs[pong_count].host = host;
+		pongs[pong_count].address = from.sin_addr;
+		pongs[pong_count].rtt = time_since(&tv) * 1000;
+		pong_count++;
+	}
+
+	for (i = 0; i < pong_count; i++) {
+		from.sin_addr = pongs[i].address;
+		if (host_address(pongs[i].host, (struct sockaddr *) &from) == 0) {
+			write_log(stderr, "Pong from %s does not come from its address, ignoring\n",
+					pongs[i].host->host);
+			continue;
+		}
+
+		pthread_mutex_lock(&query_lock);
+		pongs[i].host->query_seen = now;
+		pongs[i].host->query_rtt = pongs[i].rtt;
+		pongs[i].host->query_address = pongs[i].address;
+		pthread_mutex_unlock(&query_lock);
+		count++;
+	}
+
+	if (verbose > 0)
+		write_log(stdout, "Found %d peers running a responder\n", count);
+
+out:
+	close(pfd.fd);
+	free(pongs);
+}
+
+/*** query_peers ***
+ * Ask the peers running a responder for the file, in one datagram per
+ * interface instead of a probe per peer. Replies come from peers having
+ * the file, these are added as finished requests. Wait for replies from
+ * all responders, QUERY_REPLIES for packages are enough - but no longer
+ * than QUERY_WINDOW milliseconds, or QUERY_RTT times the slowest ping
+ * round trip. A reply counts only if it comes from the address the host
+ * answered the ping from. The responders are removed from order, returns
+ * the number of hosts left to probe. */
+static int query_peers(struct lookup * lookup, const int order_count) {
+	struct hosts * host;
+	struct request * request;
+	struct pollfd pfd = { .events = POLLIN };
+	struct sockaddr_in from;
+	struct in_addr address;
+	socklen_t from_len;
+	struct timeval tv_query;
+	char buffer[QUERY_SIZE], name[256];
+	unsigned int id, reply_id;
+	int i, n, responders = 0, replies = 0, timeout, sig;
+	long window = QUERY_WINDOW, rtt;
+	intmax_t mtime, size;
+	ssize_t len;
+
+	/* a responder on a slow link does not miss the window */
+	for (i = 0; i < order_count; i++)
+		if (query_responding(lookup->order[i], lookup->tv.tv_sec, &rtt, NULL) > 0) {
+			responders++;
+			if (rtt * QUERY_RTT > window)
+				window = rtt * QUERY_RTT;
+		}
+	if (window > QUERY_PING_WINDOW)
+		window = QUERY_PING_WINDOW;
+	if (responders == 0 || (pfd.fd = query_socket()) < 0)
+		return order_count;
+
+	id = query_nonce();
+	snprintf(buffer, sizeof(buffer), QUERY_MAGIC " query %u %jd %s", id,
+			(intmax_t) lookup->last_modified, lookup->basename);
+	gettimeofday(&tv_query, NULL);
+	if (query_send(pfd.fd, buffer, 1, lookup->tv.tv_sec) == 0) {
+		close(pfd.fd);
+		return order_count;
+	}
+
+	while (replies < responders && (lookup->dbfile > 0 || replies < QUERY_REPLIES) &&
+			(timeout = window - time_since(&tv_query) * 1000) > 0 &&
+			poll(&pfd, 1, timeout) > 0) {
+		from_len = sizeof(from);
+		if ((len = recvfrom(pfd.fd, buffer, sizeof(buffer) - 1, 0,
+				(struct sockaddr *) &from, &from_len)) <= 0 || from.sin_family != AF_INET)
+			continue;
+		buffer[len] = '\0';
+
+		if (sscanf(buffer, QUERY_MAGIC " have %u %255s %jd %jd %d",
+				&reply_id, name, &mtime, &size, &sig) != 5 || reply_id != id ||
+				(host = query_host(name)) == NULL ||
+				query_responding(host, lookup->tv.tv_sec, NULL, &address) == 0 ||
+				address.s_addr != from.sin_addr.s_addr)
+			continue;
+
+		/* one reply per host, all hosts are counted in the arena */
+		for (i = 0; i <= lookup->req_count && lookup->requests[i].host != host; i++);
+		if (i <= lookup->req_count || lookup->req_count + 1 >= lookup->host_count)
+			continue;
+
+		request = &lookup->requests[++lookup->req_count];
+		memset(request, 0, sizeof(struct request));
+		request->host = host;
+		request->url = get_url(lookup->arena, host->host, host->port,
+				lookup->dbfile, lookup->basename);
+		request->http_code = MHD_HTTP_OK;
+		request->time_total = time_since(&tv_query);
+		request->last_modified = mtime;
+		request->content_length = size;
+		if (lookup->dbfile == 0 && lookup->sigfile == 0)
+			request->sig_http_code = sig > 0 ? MHD_HTTP_OK : MHD_HTTP_NOT_FOUND;
+		request->arena = lookup->arena;
+		request->done = 1;
+		replies++;
+
+		if (verbose > 0)
+			write_log(stdout, "Peer %s replied to query for %s\n", host->host, lookup->basename);
+	}
+
+	close(pfd.fd);
+	lookup->timing.query = time_since(&tv_query);
+
+	/* the responders are done, probe the others */
+	for (i = 0, n = 0; i < order_count; i++)
+		if (query_responding(lookup->order[i], lookup->tv.tv_sec, NULL, NULL) == 0)
+			lookup->order[n++] = lookup->order[i];
+
+	return n;
+}
+
+/*** query_join ***
+ * join the query group on all interfaces, except loopback and ignored ones */
+static void query_join(const int fd) {
+	struct ignore_interfaces * ignore_interfaces_ptr;
+	struct if_nameindex * interfaces, * interface;
+	struct ip_mreqn mreqn = { 0 };
+
+	if ((interfaces = if_nameindex()) == NULL)
+		return;
+
+	inet_pton(AF_INET, QUERY_GROUP, &mreqn.imr_multiaddr);
+	pthread_rwlock_rdlock(&config_lock);
+	for (interface = interfaces; interface->if_index > 0; interface++) {
+		if (strcmp(interface->if_name, "lo") == 0)
+			continue;
+		for (ignore_interfaces_ptr = ignore_interfaces; ignore_interfaces_ptr->interface != NULL;
+				ignore_interfaces_ptr = ignore_interfaces_ptr->next)
+			if (ignore_interfaces_ptr->ifindex == interface->if_index)
+				break;
+		if (ignore_interfaces_ptr->interface != NULL)
+			continue;
+
+		/* fails if joined already, or without IPv4 */
+		mreqn.imr_ifindex = interface->if_index;
+		setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreqn, sizeof(mreqn));
+	}
+	pthread_rwlock_unlock(&config_lock);
+
+	if_freenameindex(interfaces);
+}
+
+/*** query_answer ***
+ * Answer a datagram from the query group, returns the length of reply or
+ * 0 if there is nothing to reply. Files are looked for where pacserve
+ * serves them from. */
+static int query_answer(const char * message, char * reply, const size_t size) {
+	char filename[NAME_MAX + 1], path[PATH_MAX];
+	unsigned int id;
+	intmax_t since;
+	struct stat st;
+	uint8_t dbfile;
+	int sig = 0;
+
+	if (sscanf(message, QUERY_MAGIC " ping %u", &id) == 1)
+		return snprintf(reply, size, QUERY_MAGIC " pong %u %s", id, self_name);
+
+	if (sscanf(message, QUERY_MAGIC " query %u %jd %255s", &id, &since, filename) != 3 ||
+			*filename == '.' || strchr(filename, '/') != NULL)
+		return 0;
+
+	dbfile = file_class(filename) == FILE_CLASS_DB;
+	snprintf(path, sizeof(path), "%s%s", dbfile ? DBPATH "sync/" : CACHEPATH, filename);
+	if (stat(path, &st) != 0 || S_ISREG(st.st_mode) == 0 ||
+			(dbfile > 0 && since > 0 && st.st_mtime <= since))
+		return 0;
+
+	/* tell whether the signature is there, saves a query */
+	if (dbfile == 0 && file_class(filename) == FILE_CLASS_PKG) {
+		snprintf(path, sizeof(path), CACHEPATH "%s.sig", filename);
+		sig = access(path, R_OK) == 0;
+	}
+
+	return snprintf(reply, size, QUERY_MAGIC " have %u %s %jd %jd %d", id, self_name,
+			(intmax_t) st.st_mtime, (intmax_t) st.st_size, sig);
+}
+
+/*** query_responder ***
+ * Answer queries from peers, until quitting. The group is joined again
+ * every minute, for interfaces coming up. */
+static void * query_responder(void * data) {
+	struct sockaddr_in address = {
+		.sin_family = AF_INET,
+		.sin_port = htons(PORT_QUERY),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	struct pollfd pfd = { .events = POLLIN };
+	char message[QUERY_SIZE], reply[QUERY_SIZE];
+	time_t joined = 0;
+	int one = 1, len;
+	ssize_t received;
+
+	if ((pfd.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0 ||
+			setsockopt(pfd.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+			bind(pfd.fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+		write_log(stderr, "Could not listen for queries on port %d: %s\n",
+				PORT_QUERY, strerror(errno));
+		if (pfd.fd >= 0)
+			close(pfd.fd);
+		return NULL;
+	}
+
+	if (verbose > 0)
+		write_log(stdout, "Answering queries on port %d\n", PORT_QUERY);
+
+	while (quit == 0) {
+		if (joined + 60 <= time(NULL)) {
+			query_join(pfd.fd);
+			joined = time(NULL);
+		}
+
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+
+		from_len = sizeof(from);
+		if ((received = recvfrom(pfd.fd, message, sizeof(message) - 1, 0,
+				(struct sockaddr *) &from, &from_len)) <= 0)
+			continue;
+		message[received] = '\0';
+
+		if ((len = query_answer(message, reply, sizeof(reply))) > 0)
+			sendto(pfd.fd, reply, len, 0, (struct sockaddr *) &from, from_len);
+	}
+
+	close(pfd.fd);
+
+	return NULL;
+}
+
+/*** lookup_init ***
+ * Prepare a lookup for a file. Everything for the lookup comes from an
+ * arena sized for the number of hosts, plus extra bytes for the caller.
+ * It is released in one step when the caller is done and all probes
+ * finished. */
+static int lookup_init(struct lookup * lookup, const char * basename,
+		const struct timeval * tv, const size_t extra) {
+	struct hosts * hosts_ptr;
+	size_t arena_size;
+
+	memset(lookup, 0, sizeof(struct lookup));
+	lookup->basename = basename;
+	lookup->tv = *tv;
+	lookup->size = -1;
+	lookup->req_count = -1;
+	lookup->http_code = MHD_HTTP_NOT_FOUND;
+
+	arena_size = extra + 4 * strlen(basename) + HOST_NAME_MAX + 64;
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next) {
+		arena_size += 2 * sizeof(struct request) + sizeof(struct hosts *) + 128 /* urls & alignment */
+			+ 2 * (strlen(hosts_ptr->host) + strlen(basename));
+		lookup->host_count++;
+	}
+
+	if ((lookup->arena = arena_new(arena_size)) == NULL)
+		return -1;
+	lookup->requests = arena_alloc(lookup->arena, sizeof(struct request) * lookup->host_count);
+	lookup->results = arena_alloc(lookup->arena, sizeof(struct request) * lookup->host_count);
+	lookup->order = arena_alloc(lookup->arena, sizeof(struct hosts *) * lookup->host_count);
+
+	/* db file (*.db and *.files) or signature? */
+	switch (file_class(basename)) {
+		case FILE_CLASS_DB:
+			lookup->dbfile = 1;
+			break;
+		case FILE_CLASS_SIG:
+			lookup->sigfile = 1;
+			break;
+	}
+
+	/* get the expected size of package files */
+	if (lookup->dbfile == 0)
+		lookup->size = package_size(basename);
+
+	return 0;
+}
+
+/*** lookup_file ***
+ * Probe peers for a file and select the best one. Nothing found, but a
+ * peer may be downloading the file from mirror - wait for that. */
+static void lookup_file(struct lookup * lookup) {
+	struct hosts * hosts_ptr, * sibling = NULL;
+	struct timeval tv_phase;
+	struct timespec deadline, wait_until;
+	struct request * request;
+	struct candidate * candidate;
+	double sig_time_total = INFINITY, now;
+	long timeout, remaining;
+	struct host_interface interface;
+	int i, n, error, admit, order_count = 0;
+	char ctime[26];
+
+	USDT(lookup, lookup->basename, lookup->dbfile, lookup->sigfile, lookup->size);
+
+	/* keep connections open while pacman is busy */
+	session_touch(lookup->dbfile, lookup->tv.tv_sec);
+
+	/* register with the probe budget, wait for it no longer than PROBE_WAIT */
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += PROBE_WAIT * 1000000L;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+	deadline.tv_nsec %= 1000000000L;
+	pthread_mutex_lock(&probe_lock);
+	lookups_active++;
+	pthread_mutex_unlock(&probe_lock);
+
+	/* With cooperative caching the owners of the file are probed first, a
+	 * signature has the same owners as its package. Hosts added since
+	 * counting are not probed. */
+	if (cooperative > 0 && lookup->dbfile == 0) {
+		lookup->owner_count = find_owners(lookup->basename,
+				strlen(lookup->basename) - (lookup->sigfile ? 4 : 0), lookup->owner);
+		for (i = 0; i < lookup->owner_count && order_count < lookup->host_count; i++)
+			if (lookup->owner[i] != NULL)
+				lookup->order[order_count++] = lookup->owner[i];
+	}
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL && order_count < lookup->host_count;
+			hosts_ptr = hosts_ptr->next) {
+		for (i = 0; i < lookup->owner_count && lookup->owner[i] != hosts_ptr; i++);
+		if (i == lookup->owner_count)
+			lookup->order[order_count++] = hosts_ptr;
+	}
+
+	/* peers running a responder are queried at once, the others probed */
+	if (query > 0)
+		order_count = query_peers(lookup, order_count);
+
+	/* try to find a peer with most recent file */
+	for (n = 0; n < order_count; n++) {
+		hosts_ptr = lookup->order[n];
+		time_t badtime = hosts_ptr->badtime + hosts_ptr->badcount * BADTIME;
+
+		/* skip host if offline or had a bad request within last BADTIME seconds */
+		if (hosts_ptr->online == 0) {
+			if (verbose > 0)
+				write_log(stdout, "Host %s is offline, skipping\n",
+						hosts_ptr->host);
+			continue;
+		} else if (badtime > lookup->tv.tv_sec) {
+			if (verbose > 0) {
+				/* write the time to buffer ctime, then strip the line break */
+				ctime_r(&badtime, ctime);
+				ctime[strlen(ctime) - 1] = '\0';
+
+				write_log(stdout, "Host %s is marked bad until %s, skipping\n",
+						hosts_ptr->host, ctime);
+			}
+			continue;
+		}
+
+		/* Check for limit on threads */
+		if (max_threads > 0 && lookup->req_count + 1 >= max_threads) {
+			if (verbose > 0)
+				write_log(stdout, "Hit hard limit for max threads (%d), not doing more requests\n",
+						max_threads);
+			break;
+		}
+
+		/* take a slot from the probe budget, degrade to 404 if exhausted */
+		gettimeofday(&tv_phase, NULL);
+		admit = probe_acquire(hosts_ptr, lookup->req_count + 1, &deadline);
+		lookup->timing.throttle += time_since(&tv_phase);
+		if (admit == 0) {
+			if (verbose > 0)
+				write_log(stdout, "Host %s is busy with %d probes, skipping\n",
+						hosts_ptr->host, PEER_PROBES);
+			atomic_fetch_add(&count_busy, 1);
+			continue;
+		} else if (admit < 0) {
+			if (lookup->req_count < 0) {
+				write_log(stdout, "Probe budget exhausted, not doing any requests\n");
+				atomic_fetch_add(&count_rejected, 1);
+			} else if (verbose > 0)
+				write_log(stdout, "Used fair share of probe budget, not doing more requests\n");
+			break;
+		}
+
+		/* throttle requests - do not send all request at the same time
+		 * but wait for a short moment (10.000 us = 0.01 s) */
+		gettimeofday(&tv_phase, NULL);
+		usleep(10000);
+		lookup->timing.throttle += time_since(&tv_phase);
+
+		/* This is multi-threading code!
+		 * The array is allocated for all hosts in advance, so the struct
+		 * given to get_http_code() does not change! */
+		lookup->req_count++;
+		request = &lookup->requests[lookup->req_count];
+
+		/* prepare request struct */
+		request->host = hosts_ptr;
+		bind_interface(hosts_ptr, request->interface, sizeof(request->interface));
+		request->url = get_url(lookup->arena, request->host->host, request->host->port,
+				lookup->dbfile, lookup->basename);
+		request->http_code = 0;
+		request->time_namelookup = 0;
+		request->time_connect = 0;
+		request->time_total = 0;
+		request->last_modified = 0;
+		request->content_length = -1;
+		request->sig_url = lookup->dbfile == 0 && lookup->sigfile == 0 ?
+			arena_printf(lookup->arena, "%s.sig", request->url) : NULL;
+		request->sig_http_code = 0;
+		/* measure throughput for large files */
+		request->range = throughput_size > 0 &&
+			lookup->size >= (off_t) throughput_size * 1024 * 1024 ? THROUGHPUT_RANGE : 0;
+		request->bytes = 0;
+		request->throughput = 0;
+		request->skipped = 0;
+		request->arena = lookup->arena;
+		request->done = 0;
+
+		if (verbose > 0)
+			write_log(stdout, "Trying %s: %s\n", request->host->host, request->url);
+
+		/* the probe may outlive the lookup, it holds a reference on the arena */
+		gettimeofday(&tv_phase, NULL);
+		atomic_fetch_add(&lookup->arena->refs, 1);
+		if ((error = thread_start(get_http_code, (void *)request)) != 0) {
+			write_log(stderr, "Could not run thread number %d, errno %d\n", lookup->req_count, error);
+			probe_release(request);
+			arena_free(lookup->arena);
+		}
+		lookup->timing.spawn += time_since(&tv_phase);
+	}
+
+	/* Wait for the probes, but not beyond the deadline - counted from
+	 * the last probe started, throttling is not charged. Probes still
+	 * running are left behind, they finish in background and feed the
+	 * host statistics. Results are copied, as the probes keep writing
+	 * to their requests. */
+	gettimeofday(&tv_phase, NULL);
+	wait_until.tv_nsec = tv_phase.tv_usec * 1000L + lookup_deadline * 1000000L;
+	wait_until.tv_sec = tv_phase.tv_sec + wait_until.tv_nsec / 1000000000L;
+	wait_until.tv_nsec %= 1000000000L;
+
+	pthread_mutex_lock(&probe_lock);
+	for (i = 0; i <= lookup->req_count; i++) {
+		while (lookup->requests[i].done == 0) {
+			if (lookup_deadline <= 0)
+				pthread_cond_wait(&probe_cond, &probe_lock);
+			else if (pthread_cond_timedwait(&probe_cond, &probe_lock, &wait_until) == ETIMEDOUT)
+				break;
+		}
+
+		if (lookup->requests[i].done > 0)
+			lookup->results[i] = lookup->requests[i];
+		else
+			lookup->results[i] = (struct request) {
+				.host = lookup->requests[i].host,
+				.url = lookup->requests[i].url,
+				.time_total = time_since(&lookup->tv),
+				.content_length = -1,
+			};
+	}
+	lookups_active--;
+	pthread_mutex_unlock(&probe_lock);
+	lookup->timing.join = time_since(&tv_phase);
+
+	/* try to find a suitable response */
+	now = tv_phase.tv_sec + tv_phase.tv_usec / 1000000.0;
+	lookup->timing.peers = lookup->req_count + 1;
+	selection_init(&lookup->selection, lookup->dbfile, lookup->last_modified, lookup->size,
+			(off_t) throughput_size * 1024 * 1024, lookup->tv.tv_sec);
+	for (i = 0; i <= lookup->req_count; i++) {
+		request = &lookup->results[i];
+
+		if (request->done == 0) {
+			write_log(stderr, "Peer %s did not answer within deadline, leaving in background\n",
+					request->host->host);
+			continue;
+		}
+
+		/* remember the slowest peer */
+		if (request->time_total > lookup->timing.head) {
+			lookup->timing.namelookup = request->time_namelookup;
+			lookup->timing.connect = request->time_connect;
+			lookup->timing.head = request->time_total;
+		}
+
+		if (request->http_code == MHD_HTTP_OK) {
+			if (verbose > 0) {
+				/* write the time to buffer ctime, then strip the line break */
+				ctime_r(&request->last_modified, ctime);
+				ctime[strlen(ctime) - 1] = '\0';
+
+				write_log(stdout, "Found: %s (%f sec, modified: %s)\n",
+						request->url, request->time_total, ctime);
+			}
+		} else if (verbose > 0 && request->http_code > 0) {
+			if (verbose > 0)
+				write_log(stderr, "Received HTTP status code %d for %s\n",
+						request->http_code, request->url);
+		}
+
+		/* prepare candidate for selection */
+		candidate = &request->candidate;
+		candidate->http_code = request->http_code;
+		candidate->time_total = request->time_total;
+		candidate->last_modified = request->last_modified;
+		candidate->content_length = request->content_length;
+		candidate->throughput = request->throughput > 0 ? request->throughput : host_throughput(request->host);
+		/* nothing measured, estimate from link speed (Mbit/s) */
+		if (candidate->throughput <= 0 && interface_copy(request->host, &interface) >= 0)
+			candidate->throughput = interface.weight * 125000.0;
+		candidate->load = host_load(request->host, now);
+		if (peer_load > 0)
+			load_reported(request->host, lookup->tv.tv_sec, candidate);
+		else
+			candidate->transfers = candidate->spare = 0;
+
+		switch (selection_add(&lookup->selection, i, candidate)) {
+			case SELECT_SIZE_MISMATCH:
+				write_log(stderr, "File %s has %jd bytes, expected %jd bytes, skipping\n",
+						request->url, (intmax_t) request->content_length, (intmax_t) lookup->size);
+				continue;
+			case SELECT_CHOSEN:
+				request->host->finds++;
+				break;
+		}
+
+		if (verbose > 0 && request->http_code == MHD_HTTP_OK && candidate->cost != candidate->time_total)
+			write_log(stdout, "Expecting cost %f for %s (%.0f bytes/sec, load %f, %d transfers)\n",
+					candidate->cost, request->url, candidate->throughput, candidate->load,
+					candidate->transfers);
+
+		/* remember the fastest peer replying to query with signature */
+		if (request->sig_http_code == MHD_HTTP_OK && request->time_total < sig_time_total) {
+			sibling = request->host;
+			sig_time_total = request->time_total;
+		}
+	}
+
+	if (lookup->selection.chosen >= 0) {
+		request = &lookup->results[lookup->selection.chosen];
+		lookup->url = redirect_address > 0 ? redirect_url(lookup->arena, request->host,
+				lookup->dbfile, lookup->basename, lookup->tv.tv_sec) : request->url;
+		lookup->host = request->host;
+		lookup->http_code = MHD_HTTP_TEMPORARY_REDIRECT;
+		lookup->timing.chosen = request->time_total;
+	}
+
+	/* Nothing found, but a peer may be downloading the file from mirror
+	 * right now. Ask the owners, and wait for the download to finish. */
+	if (cooperative > 0 && inflight_wait > 0 && lookup->http_code == MHD_HTTP_NOT_FOUND &&
+			lookup->dbfile == 0 && lookup->sigfile == 0 &&
+			(lookup->inflight = inflight_find(lookup->basename, lookup->owner, lookup->owner_count)) != NULL) {
+		/* the wait counts against the deadline */
+		gettimeofday(&tv_phase, NULL);
+		timeout = inflight_wait;
+		if (lookup_deadline > 0 && (remaining = (wait_until.tv_sec - tv_phase.tv_sec) * 1000L +
+				(wait_until.tv_nsec / 1000L - tv_phase.tv_usec) / 1000L) < timeout)
+			timeout = remaining;
+		if (timeout > 0 && inflight_wait_for(lookup->inflight, lookup->basename,
+				lookup->size, timeout) > 0) {
+			lookup->url = redirect_url(lookup->arena, lookup->inflight,
+					lookup->dbfile, lookup->basename, lookup->tv.tv_sec);
+			lookup->host = lookup->inflight;
+			lookup->http_code = MHD_HTTP_TEMPORARY_REDIRECT;
+		} else
+			lookup->inflight = NULL;
+		lookup->timing.inflight = time_since(&tv_phase);
+	}
+
+	/* the signature is requested next, prefer the peer we redirect to */
+	if (sibling != NULL) {
+		for (i = 0; i <= lookup->req_count; i++)
+			if (lookup->results[i].host == lookup->host && lookup->results[i].sig_http_code == MHD_HTTP_OK)
+				sibling = lookup->results[i].host;
+		sibling_store(arena_printf(lookup->arena, "%s.sig", lookup->basename), sibling, 1);
+	}
+}
+
+/*** prepared_store ***
+ * remember the result of a lookup done in advance, host is NULL if not found */
+static void prepared_store(const char * filename, struct hosts * host) {
+	struct prepared * prepared;
+
+	pthread_mutex_lock(&prepared_lock);
+	prepared = &prepareds[prepareds_next++ % PREPARED];
+	snprintf(prepared->filename, sizeof(prepared->filename), "%s", filename);
+	prepared->host = host;
+	prepared->time = time(NULL);
+	pthread_mutex_unlock(&prepared_lock);
+}
+
+/*** prepared_lookup ***
+ * Find the result of a lookup done in advance, the most recent one wins.
+ * Returns 1 if found, with host NULL if the file is not available. A
+ * host gone offline since does not count, not found expires early. */
+static uint8_t prepared_lookup(const char * filename, const time_t now, struct hosts ** host) {
+	unsigned int i, n;
+	uint8_t found = 0;
+
+	pthread_mutex_lock(&prepared_lock);
+	for (n = 1; n <= PREPARED && n <= prepareds_next; n++) {
+		i = (prepareds_next - n) % PREPARED;
+		if (prepareds[i].time + (prepareds[i].host != NULL ?
+					PREPARED_TIMEOUT : PREPARED_MISS_TIMEOUT) < now ||
+				strcmp(prepareds[i].filename, filename) != 0)
+			continue;
+
+		if (prepareds[i].host == NULL || prepareds[i].host->online > 0) {
+			*host = prepareds[i].host;
+			found = 1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&prepared_lock);
+
+	return found;
+}
+
+/*** prefetch_release ***
+ * Drop a reference, free the batch with the last one. This is used as
+ * free callback by microhttpd. */
+static void prefetch_release(void * data) {
+	struct prefetch * prefetch = data;
+
+	if (atomic_fetch_sub(&prefetch->refs, 1) > 1)
+		return;
+
+	pthread_mutex_destroy(&prefetch->lock);
+	pthread_cond_destroy(&prefetch->cond);
+	free(prefetch->body);
+	free(prefetch->files);
+	free(prefetch->hosts);
+	free(prefetch->done);
+	free(prefetch);
+}
+
+/*** prefetch_lookup ***
+ * Look up files from batch until all are done, results are prepared for
+ * the requests to follow. */
+static void * prefetch_lookup(void * data) {
+	struct prefetch * prefetch = data;
+	struct lookup lookup;
+	struct timeval tv;
+	struct hosts * host;
+	char sig[NAME_MAX + 1];
+	int i;
+
+	while (quit == 0) {
+		pthread_mutex_lock(&prefetch->lock);
+		i = prefetch->next < prefetch->count ? prefetch->next++ : -1;
+		pthread_mutex_unlock(&prefetch->lock);
+
+		if (i < 0)
+			break;
+
+		host = NULL;
+		gettimeofday(&tv, NULL);
+		if (lookup_init(&lookup, prefetch->files[i], &tv, 0) == 0) {
+			lookup_file(&lookup);
+			if (lookup.http_code == MHD_HTTP_TEMPORARY_REDIRECT)
+				host = lookup.host;
+			arena_free(lookup.arena);
+		}
+
+		/* pacman downloads the signature along with a package not found,
+		   a signature found is remembered as sibling already */
+		prepared_store(prefetch->files[i], host);
+		if (host == NULL && snprintf(sig, sizeof(sig), "%s.sig", prefetch->files[i]) < (int) sizeof(sig))
+			prepared_store(sig, NULL);
+
+		if (verbose > 0)
+			write_log(stdout, "Prefetched %s: %s\n", prefetch->files[i],
+					host != NULL ? host->host : "not found");
+
+		pthread_mutex_lock(&prefetch->lock);
+		prefetch->hosts[i] = host;
+		prefetch->done[prefetch->done_count++] = i;
+		if (host != NULL)
+			prefetch->found++;
+		pthread_cond_broadcast(&prefetch->cond);
+		pthread_mutex_unlock(&prefetch->lock);
+	}
+
+	prefetch_release(prefetch);
+	thread_finish();
+
+	return NULL;
+}
+
+/*** prefetch_reader ***
+ * Stream progress to the client: a line for every file looked up, then a
+ * summary. This blocks until lookups finished, microhttpd runs a thread
+ * per connection. */
+static ssize_t prefetch_reader(void * cls, uint64_t pos, char * buf, size_t max) {
+	struct prefetch * prefetch = cls;
+	struct timespec wait_until;
+	size_t len = 0;
+	int i, line;
+
+	pthread_mutex_lock(&prefetch->lock);
+	while (prefetch->reported == prefetch->done_count && prefetch->reported < prefetch->count) {
+		if (quit > 0) {
+			pthread_mutex_unlock(&prefetch->lock);
+			return MHD_CONTENT_READER_END_WITH_ERROR;
+		}
+		clock_gettime(CLOCK_REALTIME, &wait_until);
+		wait_until.tv_sec++;
+		pthread_cond_timedwait(&prefetch->cond, &prefetch->lock, &wait_until);
+	}
+
+	for (; prefetch->reported < prefetch->done_count; prefetch->reported++) {
+		i = prefetch->done[prefetch->reported];
+		if (prefetch->hosts[i] != NULL)
+			line = snprintf(buf + len, max - len, "found %s on %s\n",
+					prefetch->files[i], prefetch->hosts[i]->host);
+		else
+			line = snprintf(buf + len, max - len, "missing %s\n", prefetch->files[i]);
+		if (line < 0 || (size_t) line >= max - len)
+			break;
+		len += line;
+	}
+
+	/* all files reported, give the summary */
+	if (len == 0 && prefetch->reported == prefetch->count) {
+		if (prefetch->summary > 0) {
+			pthread_mutex_unlock(&prefetch->lock);
+			return MHD_CONTENT_READER_END_OF_STREAM;
+		}
+		line = snprintf(buf, max, "%d of %d files available on peers\n",
+				prefetch->found, prefetch->count);
+		len = line > 0 && (size_t) line < max ? line : 0;
+		prefetch->summary = 1;
+	}
+	pthread_mutex_unlock(&prefetch->lock);
+
+	return len > 0 ? (ssize_t) len : MHD_CONTENT_READER_END_WITH_ERROR;
 }
-/*** status_page ***/
-static char * status_page(void) {
-	struct ignore_interfaces * ignore_interfaces_ptr = ignore_interfaces;
-	struct hosts * hosts_ptr = hosts;
-	char *page = NULL, *overall = CIRCLE_BLUE;
-	char hostname[HOST_NAME_MAX];
-	struct timeval tv;
+
+/*** prefetch_start ***
+ * Take the file names (or urls) from request body, separated by white
+ * space, and start the lookups. Database and signature files are skipped.
+ * Returns the response, streaming progress. */
+static struct MHD_Response * prefetch_start(struct prefetch * prefetch, unsigned int * http_code) {
+	struct MHD_Response * response;
+	const char * message;
+	char * token, * saveptr, * basename;
+	size_t len;
+	int i, error;
+
+	if (prefetch->body_size > PREFETCH_SIZE) {
+		*http_code = MHD_HTTP_CONTENT_TOO_LARGE;
+		message = "Request body too large.\n";
+		goto error;
+	}
+
+	if (prefetch->body == NULL || (prefetch->files = malloc(sizeof(char *) * PREFETCH_FILES)) == NULL) {
+		*http_code = MHD_HTTP_BAD_REQUEST;
+		message = "No files given.\n";
+		goto error;
+	}
+
+	for (token = strtok_r(prefetch->body, " \t\r\n", &saveptr); token != NULL;
+			token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		basename = (char *) file_basename(token);
+		if ((len = strlen(basename)) == 0 || len > NAME_MAX ||
+				file_class(basename) != FILE_CLASS_PKG)
+			continue;
+
+		if (prefetch->count == PREFETCH_FILES) {
+			*http_code = MHD_HTTP_CONTENT_TOO_LARGE;
+			message = "Too many files given.\n";
+			goto error;
+		}
+		prefetch->files[prefetch->count++] = basename;
+	}
+
+	if (prefetch->count == 0) {
+		*http_code = MHD_HTTP_BAD_REQUEST;
+		message = "No files given.\n";
+		goto error;
+	}
+
+	if ((prefetch->hosts = calloc(prefetch->count, sizeof(struct hosts *))) == NULL ||
+			(prefetch->done = malloc(sizeof(int) * prefetch->count)) == NULL) {
+		*http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+		message = "Out of memory.\n";
+		goto error;
+	}
+
+	if (verbose > 0)
+		write_log(stdout, "Prefetching %d files\n", prefetch->count);
+
+	/* every thread holds a reference */
+	for (i = 0; i < PREFETCH_LOOKUPS && i < prefetch->count; i++) {
+		atomic_fetch_add(&prefetch->refs, 1);
+		if ((error = thread_start(prefetch_lookup, prefetch)) != 0) {
+			write_log(stderr, "Could not run prefetch thread, errno %d\n", error);
+			atomic_fetch_sub(&prefetch->refs, 1);
+			break;
+		}
+	}
+
+	if (i == 0) {
+		*http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+		message = "Could not start lookups.\n";
+		goto error;
+	}
+
+	/* the response holds a reference */
+	atomic_fetch_add(&prefetch->refs, 1);
+	if ((response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4096,
+			prefetch_reader, prefetch, prefetch_release)) == NULL) {
+		prefetch_release(prefetch);
+		return NULL;
+	}
+	MHD_add_response_header(response, "Content-Type", "text/plain");
+	*http_code = MHD_HTTP_OK;
+
+	return response;
+
+error:
+	write_log(stderr, "Prefetch failed: %s", message);
+	response = MHD_create_response_from_buffer(strlen(message), (void *) message, MHD_RESPMEM_PERSISTENT);
+	MHD_add_response_header(response, "Content-Type", "text/plain");
+
+	return response;
+}
+
+/*** request_completed ***
+ * called by microhttpd when a request is done, releases the batch of an
+ * aborted prefetch request */
+static void request_completed(void * cls, struct MHD_Connection * connection,
+		void ** ptr, enum MHD_RequestTerminationCode toe) {
+	if (*ptr != NULL && *ptr != &headers_received) {
+		prefetch_release(*ptr);
+		*ptr = NULL;
+	}
+}
+
+/*** ahc_echo ***
+ * called whenever a http request is received */
+static enum MHD_Result ahc_echo(void * cls,
+		struct MHD_Connection * connection,
+		const char * uri,
+		const char * method,
+		const char * version,
+		const char * upload_data,
+		size_t * upload_data_size,
+		void ** ptr) {
+	struct MHD_Response * response;
+	int ret;
+
+	char * url = NULL, * page = NULL, * body;
+	const char * basename, * host = NULL, * through, * content_type = "text/html";
+	struct arena * arena = NULL;
+	struct timeval tv, tv_done;
+	struct lookup lookup;
+	struct prefetch * prefetch;
+	char timing_header[256], repo[NAME_MAX + 1];
+
+	struct tm tm;
+	const char * if_modified_since = NULL;
+	struct hosts * sibling = NULL, * prepared = NULL;
+	uint8_t from_prefetch = 0, to_upstream = 0, decision;
+	unsigned int status;
+	long http_code = MHD_HTTP_NOT_FOUND, latency = -1;
 
 	/* initialize struct timeval */
 	gettimeofday(&tv, NULL);
 
-	if (count_redirect + count_not_found)
-		switch (count_redirect * 4 / (count_redirect + count_not_found)) {
-			case 0:
-				overall = CIRCLE_RED;
-				break;
-			case 1:
-				overall = CIRCLE_ORANGE;
-				break;
-			case 2:
-				overall = CIRCLE_YELLOW;
-				break;
-			default:
-				overall = CIRCLE_GREEN;
-				break;
+	/* give status page */
+	if (strcmp(uri, "/") == 0) {
+		http_code = (page = status_page()) != NULL ? MHD_HTTP_OK : MHD_HTTP_SERVICE_UNAVAILABLE;
+		goto response;
+	}
+
+	/* give favicon */
+	if (strcmp(uri, "/favicon.png") == 0) {
+		http_code = MHD_HTTP_OK;
+		goto response;
+	}
+
+	/* give history as JSON */
+	if (strcmp(uri, "/history.json") == 0) {
+		http_code = (page = history_json()) != NULL ? MHD_HTTP_OK : MHD_HTTP_SERVICE_UNAVAILABLE;
+		content_type = "application/json";
+		goto response;
+	}
+
+	/* give a simple ok response for monitoring */
+	if (strcmp(uri, "/check") == 0) {
+		http_code = MHD_HTTP_OK;
+		page = strdup("OK");
+		goto response;
+	}
+
+	/* take a batch of files to look up in advance, collect the body
+	 * first - what exceeds the limit is dropped */
+	if (strcmp(uri, "/prefetch") == 0 && strcmp(method, "POST") == 0) {
+		if ((prefetch = *ptr) == NULL) {
+			if ((prefetch = calloc(1, sizeof(struct prefetch))) == NULL)
+				return MHD_NO;
+			atomic_init(&prefetch->refs, 1);
+			pthread_mutex_init(&prefetch->lock, NULL);
+			pthread_cond_init(&prefetch->cond, NULL);
+			*ptr = prefetch;
+			return MHD_YES;
 		}
 
-	gethostname(hostname, HOST_NAME_MAX);
-	page = append_string(page, STATUS_HEAD, hostname, count_redirect, count_not_found, overall);
+		if (*upload_data_size != 0) {
+			if (prefetch->body_size + *upload_data_size > PREFETCH_SIZE)
+				prefetch->body_size = PREFETCH_SIZE + 1;
+			else if ((body = realloc(prefetch->body, prefetch->body_size + *upload_data_size + 1)) != NULL) {
+				memcpy(body + prefetch->body_size, upload_data, *upload_data_size);
+				prefetch->body_size += *upload_data_size;
+				body[prefetch->body_size] = '\0';
+				prefetch->body = body;
+			}
+			*upload_data_size = 0;
+			return MHD_YES;
+		}
 
-	page = append_string(page, STATUS_INT_HEAD);
-	if (ignore_interfaces_ptr->interface == NULL)
-		page = append_string(page, STATUS_INT_NONE);
-	while (ignore_interfaces_ptr->interface != NULL) {
-		if (ignore_interfaces_ptr->ifindex > 0)
-			/* write_log(stdout, STATUS_INT_ONE,
-				ignore_interfaces_ptr->interface, ignore_interfaces_ptr->ifindex); */
-			page = append_string(page, STATUS_INT_ONE,
-				ignore_interfaces_ptr->interface, ignore_interfaces_ptr->ifindex);
+		/* the connection drops its reference */
+		*ptr = NULL;
+		response = prefetch_start(prefetch, &status);
+		prefetch_release(prefetch);
+		if (response == NULL)
+			return MHD_NO;
+
+		ret = MHD_add_response_header(response, "Server", PROGNAME " v" VERSION " " ID "/" ARCH);
+		ret = MHD_queue_response(connection, status, response);
+		MHD_destroy_response(response);
+
+		return ret;
+	}
+
+	/* we want the filename, not the path */
+	basename = file_basename(uri);
+
+	/* unexpected method */
+	if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+		return MHD_NO;
+
+	/* The first time only the headers are valid,
+	 * do not respond in the first round... */
+	if (&headers_received != *ptr) {
+		*ptr = &headers_received;
+		return MHD_YES;
+	}
+
+	/* upload data in a GET!? */
+	if (*upload_data_size != 0)
+		return MHD_NO;
+
+	/* clear context pointer */
+	*ptr = NULL;
+
+	/* Everything for the lookup comes from an arena, with space for the
+	 * response page. */
+	if (lookup_init(&lookup, basename, &tv, strlen(PAGE307) + strlen(PAGE404)) < 0)
+		return MHD_NO;
+	arena = lookup.arena;
+
+	/* get timestamp from db file request */
+	if (lookup.dbfile > 0 && (if_modified_since = MHD_lookup_connection_value(connection,
+			MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MODIFIED_SINCE))) {
+		if (strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S %Z", &tm) != NULL) {
+			lookup.last_modified = timegm(&tm);
+		}
+	}
+
+	/* signature files may be known from package request */
+	if (lookup.sigfile > 0 && (sibling = sibling_lookup(basename, tv.tv_sec)) != NULL) {
+		if (verbose > 0)
+			write_log(stdout, "Host %s is known to have %s, skipping lookup\n",
+					sibling->host, basename);
+		url = redirect_url(arena, sibling, lookup.dbfile, basename, tv.tv_sec);
+		host = sibling->host;
+		http_code = MHD_HTTP_TEMPORARY_REDIRECT;
+		goto decision;
+	}
+
+	/* package and signature files may be looked up in advance, or
+	   probe peers and select the best one - with cooperative caching a
+	   file not found is looked up again, a peer may be downloading it */
+	if (lookup.dbfile == 0 && prepared_lookup(basename, tv.tv_sec, &prepared) > 0 &&
+			(prepared != NULL || cooperative == 0)) {
+		from_prefetch = 1;
+		if (prepared != NULL) {
+			if (verbose > 0)
+				write_log(stdout, "Host %s has %s from prefetch, skipping lookup\n",
+						prepared->host, basename);
+			url = redirect_url(arena, prepared, lookup.dbfile, basename, tv.tv_sec);
+			host = prepared->host;
+			http_code = MHD_HTTP_TEMPORARY_REDIRECT;
+			host_assign(prepared, tv.tv_sec + tv.tv_usec / 1000000.0);
+		}
+	} else {
+		lookup_file(&lookup);
+		http_code = lookup.http_code;
+		if (http_code == MHD_HTTP_TEMPORARY_REDIRECT) {
+			url = lookup.url;
+			host = lookup.host->host;
+			host_assign(lookup.host, tv.tv_sec + tv.tv_usec / 1000000.0);
+		}
+	}
+
+	/* Not found on peers, the pull-through cache fetches from upstream
+	 * mirror. The repository is needed for the url, it is known from
+	 * sync databases. Do not redirect to a node that is down. */
+	if (http_code == MHD_HTTP_NOT_FOUND && lookup.dbfile == 0 &&
+			package_repo(basename, repo, sizeof(repo)) > 0) {
+		pthread_rwlock_rdlock(&config_lock);
+		through = pull_through != NULL ? arena_printf(arena, "%s", pull_through) : NULL;
+		pthread_rwlock_unlock(&config_lock);
+		if (through != NULL && pull_through_check(through, tv.tv_sec) > 0) {
+			host = through;
+			url = arena_printf(arena, "http://%s:%d/upstream/%s/%s", host, PORT_PEER, repo, basename);
+			http_code = MHD_HTTP_TEMPORARY_REDIRECT;
+			to_upstream = 1;
+		}
+	}
+
+	/* pacman downloads the package from mirror now, with cooperative
+	   caching offer it to the owners */
+	if (cooperative > 0 && http_code == MHD_HTTP_NOT_FOUND && lookup.dbfile == 0 && lookup.sigfile == 0)
+		offer_start(basename, lookup.owner, lookup.owner_count);
+
+decision:
+	/* time from receiving the request until decision */
+	gettimeofday(&tv_done, NULL);
+	latency = (tv_done.tv_sec - tv.tv_sec) * 1000000 + tv_done.tv_usec - tv.tv_usec;
+	decision = http_code != MHD_HTTP_TEMPORARY_REDIRECT ? TRACE_DECISION_NOT_FOUND :
+		to_upstream > 0 ? TRACE_DECISION_UPSTREAM :
+		lookup.inflight != NULL ? TRACE_DECISION_INFLIGHT :
+		from_prefetch > 0 ? TRACE_DECISION_PREFETCH :
+		lookup.req_count < 0 ? TRACE_DECISION_SIBLING : TRACE_DECISION_REDIRECT;
+	USDT(decision, basename, host, decision, latency);
+
+	/* record the lookup for offline replay */
+	if (trace_fd >= 0)
+		trace_lookup(arena, basename, lookup.sigfile ? TRACE_CLASS_SIG :
+					lookup.dbfile ? TRACE_CLASS_DB : TRACE_CLASS_PKG,
+				decision, lookup.results, lookup.req_count + 1,
+				lookup.req_count < 0 ? -1 : lookup.selection.chosen,
+				&tv, latency, lookup.last_modified, lookup.size);
+
+	history_record(tv.tv_sec, http_code == MHD_HTTP_TEMPORARY_REDIRECT, latency);
+
+	server_timing(timing_header, sizeof(timing_header), &lookup.timing);
+	if (log_timing > 0)
+		write_log(stdout, "Timing for %s: %s\n", basename, timing_header);
+
+	/* increase counters before reponse label,
+	   do not count redirects to project page */
+	if (http_code == MHD_HTTP_TEMPORARY_REDIRECT)
+		count_redirect++;
+	else
+		count_not_found++;
+
+response:
+	/* give response */
+	if (http_code == MHD_HTTP_TEMPORARY_REDIRECT) {
+		write_log_decision(host, basename, "redirect", latency,
+				"Redirecting to %s: %s\n", host, url);
+		page = arena_printf(arena, PAGE307, url, basename);
+		response = MHD_create_response_from_buffer_with_free_callback_cls(strlen(page),
+				page, arena_free, arena);
+		ret = MHD_add_response_header(response, "Location", url);
+		ret = MHD_add_response_header(response, "Server-Timing", timing_header);
+	} else if (http_code == MHD_HTTP_OK) {
+		if (page != NULL) {
+			write_log(stdout, "Sending status page.\n");
+			response = MHD_create_response_from_buffer(strlen(page), (void*) page, MHD_RESPMEM_MUST_FREE);
+			ret = MHD_add_response_header(response, "Content-Type", content_type);
+		} else {
+			write_log(stdout, "Sending favicon.\n");
+			response = MHD_create_response_from_buffer(sizeof(favicon), favicon, MHD_RESPMEM_PERSISTENT);
+			ret = MHD_add_response_header(response, "ETag", FAVICON_SHA1);
+			ret = MHD_add_response_header(response, "Last-Modified", FAVICON_DATE);
+			ret = MHD_add_response_header(response, "Cache-Control", "max-age=86400");
+			ret = MHD_add_response_header(response, "Content-Type", "image/png");
+		}
+	} else if (http_code == MHD_HTTP_SERVICE_UNAVAILABLE) {
+		write_log(stderr, "Could not create page for %s.\n", uri);
+		response = MHD_create_response_from_buffer(strlen(PAGE503), PAGE503, MHD_RESPMEM_PERSISTENT);
+	} else { /* MHD_HTTP_NOT_FOUND */
+		if (from_prefetch > 0)
+			write_log_decision(NULL, basename, "not-found", latency,
+					"File %s not found on peers by prefetch.\n",
+					basename);
+		else if (lookup.req_count < 0)
+			write_log_decision(NULL, basename, "not-found", latency,
+					"Currently no peers are available to check for %s.\n",
+					basename);
+		else if (lookup.dbfile > 0)
+			write_log_decision(NULL, basename, "not-found", latency,
+					"No more recent version of %s found on %d peers.\n",
+					basename, lookup.req_count + 1);
 		else
-			page = append_string(page, STATUS_INT_ONE_NA,
-				ignore_interfaces_ptr->interface);
+			write_log_decision(NULL, basename, "not-found", latency,
+					"File %s not found on %d peers, giving up.\n",
+					basename, lookup.req_count + 1);
+
+		page = arena_printf(arena, PAGE404, basename);
+		response = MHD_create_response_from_buffer_with_free_callback_cls(strlen(page),
+				page, arena_free, arena);
+		ret = MHD_add_response_header(response, "Server-Timing", timing_header);
+	}
 
-		ignore_interfaces_ptr = ignore_interfaces_ptr->next;
+	ret = MHD_add_response_header(response, "Server", PROGNAME " v" VERSION " " ID "/" ARCH);
+	ret = MHD_queue_response(connection, http_code, response);
+	MHD_destroy_response(response);
+	USDT(response, uri, http_code);
+
+	/* report counts to systemd */
+	sd_notifyf(0, "STATUS=%d redirects, %d not found, waiting...",
+			count_redirect, count_not_found);
+
+	return ret;
+}
+
+/*** upstream_url ***
+ * Write the url of file on upstream mirror to buffer, '$repo' and '$arch'
+ * are replaced like in pacman's mirrorlist. Returns the length, or -1 if
+ * the buffer is too small. */
+static int upstream_url(char * buffer, const size_t size, const char * repo, const char * filename) {
+	const char * template, * insert;
+	size_t len = 0;
+
+	pthread_rwlock_rdlock(&config_lock);
+	if ((template = upstream) == NULL) {
+		pthread_rwlock_unlock(&config_lock);
+		return -1;
+	}
+
+	while (*template != 0 && len < size) {
+		if (strncmp(template, "$repo", 5) == 0)
+			insert = repo;
+		else if (strncmp(template, "$arch", 5) == 0)
+			insert = ARCH;
+		else {
+			buffer[len++] = *template++;
+			continue;
+		}
+		template += 5;
+		len += snprintf(buffer + len, size - len, "%s", insert);
+	}
+	pthread_rwlock_unlock(&config_lock);
+
+	if (len < size)
+		len += snprintf(buffer + len, size - len, "%s%s",
+				len > 0 && buffer[len - 1] == '/' ? "" : "/", filename);
+
+	return len < size ? (int) len : -1;
+}
+
+/*** pull_through_check ***
+ * Check the pull-through cache on host is up, the result is cached for
+ * PULL_THROUGH_VALID seconds. While one lookup checks, others use the
+ * previous result. Returns 1 if it is up. */
+static uint8_t pull_through_check(const char * host, const time_t now) {
+	char url[HOST_NAME_MAX + 32];
+	long http_code = 0;
+	uint8_t up;
+	CURL * curl;
+
+	pthread_mutex_lock(&pull_through_lock);
+	up = pull_through_up;
+	if (pull_through_checked + PULL_THROUGH_VALID > now) {
+		pthread_mutex_unlock(&pull_through_lock);
+		return up;
+	}
+	pull_through_checked = now;
+	pthread_mutex_unlock(&pull_through_lock);
+
+	if ((curl = curl_easy_init()) == NULL)
+		return up;
+
+	snprintf(url, sizeof(url), "http://%s:%d/check", host, PORT_PEER);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 500L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 1000L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	if (curl_easy_perform(curl) != CURLE_OK ||
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code) != CURLE_OK)
+		http_code = 0;
+	curl_easy_cleanup(curl);
+
+	up = http_code == MHD_HTTP_OK;
+	if (up == 0)
+		write_log(stderr, "Pull-through cache on %s is not available\n", host);
+
+	pthread_mutex_lock(&pull_through_lock);
+	pull_through_up = up;
+	pthread_mutex_unlock(&pull_through_lock);
+
+	return up;
+}
+
+/*** cache_compare ***
+ * compare cached files by modification time, for qsort() */
+static int cache_compare(const void * a, const void * b) {
+	const struct cached * cached_a = a, * cached_b = b;
+
+	return (cached_a->mtime > cached_b->mtime) - (cached_a->mtime < cached_b->mtime);
+}
+
+/*** cache_evict ***
+ * Remove the least recently used files while the pull-through cache is
+ * larger than configured. Files served are touched, partial files (with
+ * leading dot) are skipped. */
+static void cache_evict(void) {
+	struct cached * cached = NULL, * resized;
+	size_t count = 0, i;
+	off_t total = 0, limit = (off_t) cache_size * 1024 * 1024;
+	struct dirent * entry;
+	struct stat st;
+	char path[PATH_MAX];
+	DIR * dir;
+
+	/* another thread is evicting */
+	if (pthread_mutex_trylock(&cache_lock) != 0)
+		return;
+
+	if ((dir = opendir(UPSTREAM_CACHE)) == NULL) {
+		write_log(stderr, "Failed to open directory " UPSTREAM_CACHE ": %s\n", strerror(errno));
+		goto out;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), UPSTREAM_CACHE "%s", entry->d_name);
+		if (*entry->d_name == '.' || stat(path, &st) != 0 || S_ISREG(st.st_mode) == 0)
+			continue;
+		if ((resized = realloc(cached, sizeof(struct cached) * (count + 1))) == NULL)
+			break;
+		cached = resized;
+		snprintf(cached[count].name, sizeof(cached[count].name), "%s", entry->d_name);
+		cached[count].mtime = st.st_mtime;
+		cached[count].size = st.st_size;
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if (total > limit) {
+		qsort(cached, count, sizeof(struct cached), cache_compare);
+		for (i = 0; i < count && total > limit; i++) {
+			snprintf(path, sizeof(path), UPSTREAM_CACHE "%s", cached[i].name);
+			if (unlink(path) != 0)
+				continue;
+			if (verbose > 0)
+				write_log(stdout, "Evicted %s from pull-through cache\n", cached[i].name);
+			total -= cached[i].size;
+		}
+	}
+
+out:
+	free(cached);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*** fill_release ***
+ * drop a reference, free the fill with the last one */
+static void fill_release(struct fill * fill) {
+	pthread_mutex_lock(&fills_lock);
+	if (--fill->refs > 0)
+		fill = NULL;
+	pthread_mutex_unlock(&fills_lock);
+
+	free(fill);
+}
+
+/*** fill_write ***
+ * write data from upstream to the partial file, and wake the readers */
+static size_t fill_write(char * buffer, size_t size, size_t nmemb, void * data) {
+	struct fill * fill = data;
+	curl_off_t length = -1;
+	size_t written = 0;
+	ssize_t ret;
+
+	while (written < size * nmemb) {
+		if ((ret = write(fill->fd, buffer + written, size * nmemb - written)) < 0)
+			return 0;
+		written += ret;
+	}
+
+	pthread_mutex_lock(&fills_lock);
+	if (fill->http_code == 0) {
+		curl_easy_getinfo(fill->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+		fill->size = length;
+		fill->http_code = MHD_HTTP_OK;
+	}
+	fill->bytes += written;
+	pthread_cond_broadcast(&fills_cond);
+	pthread_mutex_unlock(&fills_lock);
+
+	return written;
+}
+
+/*** fill_download ***
+ * Download a file from upstream mirror to the pull-through cache. The
+ * partial file is renamed when complete. */
+static void * fill_download(void * data) {
+	struct fill * fill = data, ** fill_ptr;
+	char path[PATH_MAX], part[PATH_MAX], errbuf[CURL_ERROR_SIZE];
+	CURLcode res = CURLE_FAILED_INIT;
+	uint8_t complete = 0;
+
+	snprintf(path, sizeof(path), UPSTREAM_CACHE "%s", fill->filename);
+	snprintf(part, sizeof(part), UPSTREAM_CACHE ".%s.part", fill->filename);
+
+	if ((fill->fd = open(part, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		write_log(stderr, "Could not create %s: %s\n", part, strerror(errno));
+	else if ((fill->curl = curl_easy_init()) != NULL) {
+		if (verbose > 0)
+			write_log(stdout, "Fetching %s from upstream\n", fill->url);
+
+		curl_easy_setopt(fill->curl, CURLOPT_URL, fill->url);
+		curl_easy_setopt(fill->curl, CURLOPT_USERAGENT, "pacredir/" VERSION " (" ID "/" ARCH ")");
+		curl_easy_setopt(fill->curl, CURLOPT_WRITEFUNCTION, fill_write);
+		curl_easy_setopt(fill->curl, CURLOPT_WRITEDATA, fill);
+		curl_easy_setopt(fill->curl, CURLOPT_FOLLOWLOCATION, 1L);
+		/* do not store error pages */
+		curl_easy_setopt(fill->curl, CURLOPT_FAILONERROR, 1L);
+		curl_easy_setopt(fill->curl, CURLOPT_CONNECTTIMEOUT, 10L);
+		/* give up if transfer stalls for 30 seconds */
+		curl_easy_setopt(fill->curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+		curl_easy_setopt(fill->curl, CURLOPT_LOW_SPEED_TIME, 30L);
+		curl_easy_setopt(fill->curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(fill->curl, CURLOPT_ERRORBUFFER, errbuf);
+		*errbuf = '\0';
+
+		res = curl_easy_perform(fill->curl);
+		curl_easy_cleanup(fill->curl);
+	}
+
+	/* the file is complete if all bytes announced arrived */
+	if (fill->fd >= 0) {
+		if (res == CURLE_OK && (fill->size < 0 || fill->bytes == fill->size))
+			complete = 1;
+		else if (res != CURLE_FAILED_INIT)
+			write_log(stderr, "Could not fetch %s from upstream: %s\n", fill->url,
+					*errbuf != 0 ? errbuf : curl_easy_strerror(res));
+		if (close(fill->fd) != 0)
+			complete = 0;
+		if (complete > 0 && rename(part, path) != 0) {
+			write_log(stderr, "Could not rename %s: %s\n", part, strerror(errno));
+			complete = 0;
+		}
+		if (complete == 0)
+			unlink(part);
+	}
+
+	/* wake the readers, and forget the download */
+	pthread_mutex_lock(&fills_lock);
+	if (fill->http_code == 0)
+		fill->http_code = complete > 0 ? MHD_HTTP_OK : MHD_HTTP_NOT_FOUND;
+	fill->done = complete > 0 ? 1 : -1;
+	for (fill_ptr = &fills; *fill_ptr != fill; fill_ptr = &(*fill_ptr)->next);
+	*fill_ptr = fill->next;
+	fills_active--;
+	pthread_cond_broadcast(&fills_cond);
+	pthread_mutex_unlock(&fills_lock);
+
+	if (complete > 0) {
+		if (verbose > 0)
+			write_log(stdout, "Stored %s in pull-through cache\n", fill->filename);
+		cache_evict();
+	}
+
+	fill_release(fill);
+	thread_finish();
+
+	return NULL;
+}
+
+/*** fill_read ***
+ * Read from the file while it downloads, this blocks until data arrived.
+ * microhttpd runs a thread per connection. */
+static ssize_t fill_read(void * cls, uint64_t pos, char * buf, size_t max) {
+	struct fill_reader * reader = cls;
+	struct fill * fill = reader->fill;
+	struct timespec wait_until;
+	ssize_t ret;
+
+	pthread_mutex_lock(&fills_lock);
+	while ((off_t) pos >= fill->bytes && fill->done == 0 && quit == 0) {
+		clock_gettime(CLOCK_REALTIME, &wait_until);
+		wait_until.tv_sec++;
+		pthread_cond_timedwait(&fills_cond, &fills_lock, &wait_until);
+	}
+	if ((off_t) pos >= fill->bytes) {
+		ret = fill->done > 0 ? MHD_CONTENT_READER_END_OF_STREAM : MHD_CONTENT_READER_END_WITH_ERROR;
+		pthread_mutex_unlock(&fills_lock);
+		return ret;
+	}
+	if ((off_t) max > fill->bytes - (off_t) pos)
+		max = fill->bytes - pos;
+	pthread_mutex_unlock(&fills_lock);
+
+	if ((ret = pread(reader->fd, buf, max, pos)) <= 0)
+		return MHD_CONTENT_READER_END_WITH_ERROR;
+
+	return ret;
+}
+
+/*** fill_close ***
+ * free callback for the response */
+static void fill_close(void * cls) {
+	struct fill_reader * reader = cls;
+
+	close(reader->fd);
+	fill_release(reader->fill);
+	free(reader);
+}
+
+/*** upstream_response ***
+ * Give a file from the pull-through cache. If not cached it is fetched
+ * from upstream mirror and served while it downloads, a download in
+ * flight is joined. Returns NULL with http_code set if not available. */
+static struct MHD_Response * upstream_response(const char * repo, const char * filename,
+		const uint8_t head, unsigned int * http_code) {
+	struct MHD_Response * response;
+	struct fill * fill;
+	struct fill_reader * reader;
+	char path[PATH_MAX], part[PATH_MAX];
+	struct stat st;
+	off_t size;
+	int fd, error;
+
+	snprintf(path, sizeof(path), UPSTREAM_CACHE "%s", filename);
+	snprintf(part, sizeof(part), UPSTREAM_CACHE ".%s.part", filename);
+
+	/* in cache - touch it, least recently used files are evicted first */
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+		if (fstat(fd, &st) == 0 && (response = MHD_create_response_from_fd(st.st_size, fd)) != NULL) {
+			futimens(fd, NULL);
+			*http_code = MHD_HTTP_OK;
+			return response;
+		}
+		close(fd);
+	}
+
+	/* do not fetch for a HEAD request */
+	*http_code = MHD_HTTP_NOT_FOUND;
+	if (head > 0)
+		return NULL;
+
+	/* join the download in flight, or start it */
+	pthread_mutex_lock(&fills_lock);
+	for (fill = fills; fill != NULL && strcmp(fill->filename, filename) != 0; fill = fill->next);
+	if (fill == NULL) {
+		if (fills_active >= FILLS || (fill = calloc(1, sizeof(struct fill))) == NULL) {
+			pthread_mutex_unlock(&fills_lock);
+			*http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			return NULL;
+		}
+		snprintf(fill->filename, sizeof(fill->filename), "%s", filename);
+		fill->size = -1;
+		fill->fd = -1;
+		if (upstream_url(fill->url, sizeof(fill->url), repo, filename) < 0) {
+			pthread_mutex_unlock(&fills_lock);
+			free(fill);
+			return NULL;
+		}
+
+		/* the download holds a reference */
+		fill->refs = 1;
+		if ((error = thread_start(fill_download, (void *)fill)) != 0) {
+			pthread_mutex_unlock(&fills_lock);
+			write_log(stderr, "Could not run thread for download, errno %d\n", error);
+			free(fill);
+			*http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			return NULL;
+		}
+		fill->next = fills;
+		fills = fill;
+		fills_active++;
+	}
+	fill->refs++;
+
+	/* wait for upstream to answer */
+	while (fill->http_code == 0)
+		pthread_cond_wait(&fills_cond, &fills_lock);
+	*http_code = fill->http_code;
+	size = fill->done > 0 ? fill->bytes : fill->size;
+	pthread_mutex_unlock(&fills_lock);
+
+	/* the partial file is renamed when complete */
+	if (*http_code != MHD_HTTP_OK || (reader = malloc(sizeof(struct fill_reader))) == NULL) {
+		fill_release(fill);
+		return NULL;
+	}
+	reader->fill = fill;
+	if ((reader->fd = open(part, O_RDONLY | O_CLOEXEC)) < 0 &&
+			(reader->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		*http_code = MHD_HTTP_NOT_FOUND;
+		fill_close(reader);
+		return NULL;
 	}
-	page = append_string(page, STATUS_INT_FOOT);
-	
-	page = append_string(page, STATUS_HOST_HEAD);
-	if (hosts_ptr->host == NULL)
-		page = append_string(page, STATUS_HOST_NONE);
-	while (hosts_ptr->host != NULL) {
-		time_t badtime = hosts_ptr->badtime + hosts_ptr->badcount * BADTIME;
-		uint8_t bad = hosts_ptr->badcount && badtime > tv.tv_sec ? 1 : 0;
 
-		page = append_string(page, STATUS_HOST_ONE,
-			(hosts_ptr->mdns && !hosts_ptr->online) || bad ? " class=\"grey\"" : "",
-			hosts_ptr->host, hosts_ptr->port,
-			hosts_ptr->mdns ? (hosts_ptr->online ? CIRCLE_GREEN : CIRCLE_RED) : CIRCLE_BLUE,
-			hosts_ptr->mdns ? (hosts_ptr->online ? "online" : "offline") : "static",
-			hosts_ptr->finds ? CIRCLE_GREEN : CIRCLE_BLUE, hosts_ptr->finds,
-			bad ? CIRCLE_RED : CIRCLE_BLUE,
-			hosts_ptr->badcount);
+	if ((response = MHD_create_response_from_callback(size >= 0 ? (uint64_t) size : MHD_SIZE_UNKNOWN,
+			65536, fill_read, reader, fill_close)) == NULL)
+		fill_close(reader);
 
-		hosts_ptr = hosts_ptr->next;
+	return response;
+}
+
+/*** host_address ***
+ * Check address is one the host name resolves to, so nobody speaks in the
+ * name of another peer. Returns 1 if it is. */
+static uint8_t host_address(const struct hosts * host, const struct sockaddr * address) {
+	const struct sockaddr_in6 * client6 = (const struct sockaddr_in6 *) address;
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, * result, * ai;
+	char name[HOST_NAME_MAX + 1];
+	const void * client, * addr;
+	uint8_t match = 0;
+	int family;
+
+	/* IPv4 clients show up mapped on a dual-stack socket */
+	if (address->sa_family == AF_INET) {
+		family = AF_INET;
+		client = &((const struct sockaddr_in *) address)->sin_addr;
+	} else if (address->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&client6->sin6_addr)) {
+		family = AF_INET;
+		client = &client6->sin6_addr.s6_addr[12];
+	} else if (address->sa_family == AF_INET6) {
+		family = AF_INET6;
+		client = &client6->sin6_addr;
+	} else
+		return 0;
+
+	/* strip brackets and zone from IPv6 address literal */
+	if (*host->host == '[')
+		snprintf(name, sizeof(name), "%.*s", (int) strcspn(host->host + 1, "%]"), host->host + 1);
+	else
+		snprintf(name, sizeof(name), "%s", host->host);
+
+	hints.ai_family = family;
+	if (getaddrinfo(name, NULL, &hints, &result) != 0)
+		return 0;
+
+	for (ai = result; ai != NULL && match == 0; ai = ai->ai_next) {
+		addr = family == AF_INET ?
+			(const void *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr :
+			(const void *) &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr;
+		match = memcmp(addr, client, family == AF_INET ? 4 : 16) == 0;
 	}
-	page = append_string(page, STATUS_HOST_FOOT);
+	freeaddrinfo(result);
 
-	page = append_string(page, STATUS_FOOT);
+	return match;
+}
 
-	return page;
+/*** peer_address ***
+ * Check the connection comes from an address the host name resolves to,
+ * so nobody offers in the name of another peer. Returns 1 if it does. */
+static uint8_t peer_address(struct hosts * host, struct MHD_Connection * connection) {
+	const union MHD_ConnectionInfo * info;
+
+	if ((info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS)) == NULL ||
+			info->client_addr == NULL)
+		return 0;
+
+	return host_address(host, info->client_addr);
 }
 
-/*** ahc_echo ***
- * called whenever a http request is received */
-static enum MHD_Result ahc_echo(void * cls,
+/*** ahc_peer ***
+ * Called whenever a http request from a peer is received. A peer offers
+ * a package file it downloads from mirror, we remember the download and
+ * pull the file if we do not have it. Offers are accepted from known
+ * peers only. Peers ask for downloads in flight and our load, and fetch
+ * files from the pull-through cache. */
+static enum MHD_Result ahc_peer(void * cls,
 		struct MHD_Connection * connection,
 		const char * uri,
 		const char * method,
@@ -638,55 +4685,20 @@ static enum MHD_Result ahc_echo(void * cls,
 		void ** ptr) {
 	static int dummy;
 	struct MHD_Response * response;
-	int ret;
-	struct hosts * hosts_ptr = hosts;
-
-	char * url = NULL, * page = NULL;
-	const char * basename, * host = NULL;
-	struct timeval tv;
-
-	struct tm tm;
-	const char * if_modified_since = NULL;
-	time_t last_modified = 0;
-	uint8_t dbfile = 0;
-	int i, error, req_count = -1;
-	pthread_t * tid = NULL;
-	struct request ** requests = NULL;
-	struct request * request = NULL;
-	long http_code = MHD_HTTP_NOT_FOUND;
-	double time_total = INFINITY;
-	char ctime[26];
-
-	/* initialize struct timeval */
-	gettimeofday(&tv, NULL);
-
-	/* give status page */
-	if (strcmp(uri, "/") == 0) {
-		http_code = MHD_HTTP_OK;
-		page = status_page();
-		goto response;
-	}
-
-	/* give favicon */
-	if (strcmp(uri, "/favicon.png") == 0) {
-		http_code = MHD_HTTP_OK;
-		goto response;
-	}
-
-	/* give a simple ok response for monitoring */
-	if (strcmp(uri, "/check") == 0) {
-		http_code = MHD_HTTP_OK;
-		page = strdup("OK");
-		goto response;
-	}
-
-	/* we want the filename, not the path */
-	basename = uri;
-	while (strstr(basename, "/") != NULL)
-		basename = strstr(basename, "/") + 1;
+	struct hosts * hosts_ptr;
+	struct pull * pull;
+	const char * filename, * from, * message, * repo;
+	unsigned int http_code;
+	char path[PATH_MAX], inflight[HOST_NAME_MAX + 2], report[128], repo_name[NAME_MAX + 1],
+		listed_repo[NAME_MAX + 1];
+	double rate;
+	int transfers;
+	struct stat st;
+	uint8_t enabled, known, listed;
+	int ret, error;
 
 	/* unexpected method */
-	if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+	if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0 && strcmp(method, "POST") != 0)
 		return MHD_NO;
 
 	/* The first time only the headers are valid,
@@ -696,222 +4708,437 @@ static enum MHD_Result ahc_echo(void * cls,
 		return MHD_YES;
 	}
 
-	/* upload data in a GET!? */
+	/* requests have no body */
 	if (*upload_data_size != 0)
 		return MHD_NO;
 
 	/* clear context pointer */
 	*ptr = NULL;
 
-	/* process db file request (*.db and *.files) */
-	if ((strlen(basename) > 3 && strcmp(basename + strlen(basename) - 3, ".db") == 0) ||
-			(strlen(basename) > 6 && strcmp(basename + strlen(basename) - 6, ".files") == 0)) {
+	/* we want the filename, not the path */
+	filename = strrchr(uri, '/') + 1;
+	from = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "from");
+
+	/* give files from pull-through cache, report our load, or accept
+	   package files only (the signature is pulled along) */
+	if (strcmp(method, "POST") != 0 && strncmp(uri, "/upstream/", strlen("/upstream/")) == 0) {
+		repo = uri + strlen("/upstream/");
+		snprintf(repo_name, sizeof(repo_name), "%.*s", (int) (filename - 1 - repo), repo);
+		pthread_rwlock_rdlock(&config_lock);
+		enabled = upstream != NULL;
+		pthread_rwlock_unlock(&config_lock);
+		if (enabled == 0) {
+			http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			message = "Pull-through cache is disabled.\n";
+		} else if (filename <= repo + 1 || *repo_name == '.' || strchr(repo_name, '/') != NULL ||
+				*filename == '.' || strlen(filename) > NAME_MAX - 6 ||
+				file_class(filename) == FILE_CLASS_DB) {
+			http_code = MHD_HTTP_BAD_REQUEST;
+			message = "Bad request.\n";
+		} else if (package_repo(filename, listed_repo, sizeof(listed_repo)) == 0 ||
+				strcmp(listed_repo, repo_name) != 0) {
+			/* fetch packages from sync databases only, no arbitrary
+			   files from upstream */
+			http_code = MHD_HTTP_NOT_FOUND;
+			message = "Package is not in sync databases.\n";
+		} else if ((response = upstream_response(repo_name, filename,
+				strcmp(method, "HEAD") == 0, &http_code)) != NULL) {
+			goto queue;
+		} else if (http_code == MHD_HTTP_NOT_FOUND) {
+			message = "File not found.\n";
+		} else
+			message = "Too many files fetched, try again later.\n";
+	} else if ((strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) &&
+			strcmp(uri, "/check") == 0) {
+		pthread_rwlock_rdlock(&config_lock);
+		enabled = upstream != NULL;
+		pthread_rwlock_unlock(&config_lock);
+		if (enabled == 0) {
+			http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			message = "Pull-through cache is disabled.\n";
+		} else {
+			http_code = MHD_HTTP_OK;
+			message = "Pull-through cache is up.\n";
+		}
+	} else if (strcmp(method, "GET") == 0 && strcmp(uri, "/load") == 0) {
+		if (peer_load == 0) {
+			http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			message = "Load reports are disabled.\n";
+		} else if (load_measure(&transfers, &rate) < 0) {
+			http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			message = "Could not measure load.\n";
+		} else {
+			snprintf(report, sizeof(report), "transfers=%d rate=%.0f capacity=%.0f\n",
+					transfers, rate, load_capacity());
+			http_code = MHD_HTTP_OK;
+			message = report;
+		}
+	} else if (cooperative == 0) {
+		http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+		message = "Cooperative caching is disabled.\n";
+	} else if (strcmp(method, "GET") == 0 && strncmp(uri, "/inflight/", strlen("/inflight/")) == 0 &&
+			filename == uri + strlen("/inflight/")) {
+		if (inflight_lookup(filename, time(NULL), inflight, sizeof(inflight) - 1) > 0) {
+			strcat(inflight, "\n");
+			http_code = MHD_HTTP_OK;
+			message = inflight;
+		} else {
+			http_code = MHD_HTTP_NOT_FOUND;
+			message = "No download in flight.\n";
+		}
+	} else if (strcmp(method, "POST") != 0 || strncmp(uri, "/offer/", strlen("/offer/")) != 0 ||
+			filename != uri + strlen("/offer/") || *filename == '.' ||
+			strstr(filename, ".pkg.tar") == NULL || strlen(filename) > NAME_MAX - 4 ||
+			strcmp(filename + strlen(filename) - 4, ".sig") == 0 || from == NULL) {
+		http_code = MHD_HTTP_BAD_REQUEST;
+		message = "Bad request.\n";
+	} else {
+		for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next)
+			if (hosts_ptr->online > 0 && strcmp(hosts_ptr->host, from) == 0)
+				break;
+
+		/* the offer has to come from the peer it claims */
+		known = hosts_ptr->host != NULL && peer_address(hosts_ptr, connection) > 0;
+		if (hosts_ptr->host != NULL && known == 0)
+			write_log(stderr, "Offer of %s from %s does not come from its address, rejecting\n",
+					filename, from);
+
+		/* only packages from sync databases are accepted */
+		listed = known > 0 && package_size(filename) >= 0;
+
+		/* remember the download, lookups may wait for it */
+		if (listed > 0)
+			inflight_store(filename, hosts_ptr->host);
+
+		snprintf(path, sizeof(path), CACHEPATH "%s", filename);
+		if (known == 0) {
+			http_code = MHD_HTTP_FORBIDDEN;
+			message = "Unknown peer.\n";
+		} else if (listed == 0) {
+			http_code = MHD_HTTP_NOT_FOUND;
+			message = "Package is not in sync databases.\n";
+		} else if (stat(path, &st) == 0) {
+			http_code = MHD_HTTP_OK;
+			message = "File is in cache.\n";
+		} else if (atomic_fetch_add(&pulls_active, 1) >= PULLS ||
+				(pull = malloc(sizeof(struct pull))) == NULL) {
+			atomic_fetch_sub(&pulls_active, 1);
+			http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+			message = "Too many files pulled, try again later.\n";
+		} else {
+			if (verbose > 0)
+				write_log(stdout, "Peer %s offered %s, pulling\n", hosts_ptr->host, filename);
 
-		dbfile = 1;
+			snprintf(pull->filename, sizeof(pull->filename), "%s", filename);
+			pull->host = hosts_ptr;
 
-		/* get timestamp from request */
-		if ((if_modified_since = MHD_lookup_connection_value(connection,
-				MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MODIFIED_SINCE))) {
-			if (strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S %Z", &tm) != NULL) {
-				last_modified = timegm(&tm);
+			http_code = MHD_HTTP_ACCEPTED;
+			message = "Pulling file.\n";
+
+			if ((error = thread_start(offer_pull, (void *)pull)) != 0) {
+				write_log(stderr, "Could not run thread for pull, errno %d\n", error);
+				atomic_fetch_sub(&pulls_active, 1);
+				free(pull);
+				http_code = MHD_HTTP_SERVICE_UNAVAILABLE;
+				message = "Could not pull file.\n";
 			}
 		}
 	}
 
-	/* try to find a peer with most recent file */
-	while (hosts_ptr->host != NULL) {
-		time_t badtime = hosts_ptr->badtime + hosts_ptr->badcount * BADTIME;
+	response = MHD_create_response_from_buffer(strlen(message), (void *) message, MHD_RESPMEM_MUST_COPY);
+	ret = MHD_add_response_header(response, "Content-Type", "text/plain");
 
-		/* skip host if offline or had a bad request within last BADTIME seconds */
-		if (hosts_ptr->online == 0) {
-			if (verbose > 0)
-				write_log(stdout, "Host %s is offline, skipping\n",
-						hosts_ptr->host);
-			hosts_ptr = hosts_ptr->next;
-			continue;
-		} else if (badtime > tv.tv_sec) {
-			if (verbose > 0) {
-				/* write the time to buffer ctime, then strip the line break */
-				ctime_r(&badtime, ctime);
-				ctime[strlen(ctime) - 1] = '\0';
+queue:
+	ret = MHD_add_response_header(response, "Server", PROGNAME " v" VERSION " " ID "/" ARCH);
+	ret = MHD_queue_response(connection, http_code, response);
+	MHD_destroy_response(response);
 
-				write_log(stdout, "Host %s is marked bad until %s, skipping\n",
-						hosts_ptr->host, ctime);
-			}
-			hosts_ptr = hosts_ptr->next;
-			continue;
-		}
+	return ret;
+}
 
-		/* Check for limit on threads */
-		if (max_threads > 0 && req_count + 1 >= max_threads) {
-			if (verbose > 0)
-				write_log(stdout, "Hit hard limit for max threads (%d), not doing more requests\n",
-						max_threads);
+/*** peer_start ***
+ * Start the daemon for peers if cooperative caching, load reports or
+ * pull-through cache are enabled - on reload as well. It is not stopped
+ * when disabled, the handler answers 503 then. Runs in main thread, like
+ * load_config(). */
+static void peer_start(void) {
+	if (mhd_peer != NULL || (cooperative == 0 && peer_load == 0 && upstream == NULL))
+		return;
+
+	if ((mhd_peer = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_DUAL_STACK,
+			PORT_PEER, NULL, NULL, &ahc_peer, NULL,
+			MHD_OPTION_CONNECTION_LIMIT, (unsigned int) 64,
+			MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 10,
+			MHD_OPTION_END)) == NULL)
+		write_log(stderr, "Could not start daemon for peers on port %d.\n", PORT_PEER);
+	else if (verbose > 0)
+		write_log(stdout, "Listening for peers on port %d\n", PORT_PEER);
+}
+
+/*** in_list ***
+ * check whether host is in list of hosts (with optional port) */
+static uint8_t in_list(const char * list, const char * host) {
+	char * values, * value, * saveptr;
+	uint8_t found = 0;
+
+	values = strdup(list);
+	for (value = strtok_r(values, DELIMITER, &saveptr); value != NULL;
+			value = strtok_r(NULL, DELIMITER, &saveptr)) {
+		if (strchr(value, ':') != NULL)
+			*strchr(value, ':') = 0;
+		if (strcmp(value, host) == 0) {
+			found++;
 			break;
 		}
+	}
+	free(values);
 
-		/* throttle requests - do not send all request at the same time
-		 * but wait for a short moment (10.000 us = 0.01 s) */
-		usleep(10000);
-
-		/* This is multi-threading code!
-		 * Pointer to struct request does not work as realloc can relocate the data.
-		 * We need a pointer to pointer to struct request, store the addresses in
-		 * an array and give get_http_code() a struct the does not change! */
-		req_count++;
-		tid = realloc(tid, sizeof(pthread_t) * (req_count + 1));
-		requests = realloc(requests, sizeof(size_t) * (req_count + 1));
-		requests[req_count] = malloc(sizeof(struct request));
-		request = requests[req_count];
+	return found;
+}
 
-		/* prepare request struct */
-		request->host = hosts_ptr;
-		request->url = get_url(request->host->host, request->host->port, dbfile, basename);
-		request->http_code = 0;
-		request->last_modified = 0;
+/*** free_ignore_interfaces ***/
+static void free_ignore_interfaces(struct ignore_interfaces * list) {
+	struct ignore_interfaces * next;
 
-		if (verbose > 0)
-			write_log(stdout, "Trying %s: %s\n", request->host->host, request->url);
+	while (list != NULL) {
+		free(list->interface);
+		next = list->next;
+		free(list);
+		list = next;
+	}
+}
 
-		if ((error = pthread_create(&tid[req_count], NULL, get_http_code, (void *)request)) != 0)
-			write_log(stderr, "Could not run thread number %d, errno %d\n", req_count, error);
+/*** load_config ***
+ * Parse the config file. On reload the changes are applied to the running
+ * state: Hosts are never removed (requests may reference them), a static
+ * host no longer in config is handed over to mDNS and marked offline, so
+ * its stats are kept. The list of ignored interfaces and the strings for
+ * pull-through cache are replaced under config_lock, readers in other
+ * threads hold it for reading. */
+static int load_config(const uint8_t reload) {
+	dictionary * ini;
+	const char * inistring;
+	char * values, * value;
+	uint16_t port;
+	struct ignore_interfaces * ignore_new, * ignore_interfaces_ptr;
+	struct hosts * hosts_ptr;
+	int ini_verbose;
 
-		hosts_ptr = hosts_ptr->next;
+	if ((ini = iniparser_load(CONFIGFILE)) == NULL) {
+		write_log(stderr, "cannot parse file " CONFIGFILE ", %s\n",
+				reload ? "keeping current configuration" : "continue anyway");
+		/* continue anyway, there is nothing essential in the config file */
+		return EXIT_FAILURE;
 	}
 
-	/* try to find a suitable response */
-	for (i = 0; i <= req_count; i++) {
-		if ((error = pthread_join(tid[i], NULL)) != 0)
-			write_log(stderr, "Could not join thread number %d, errno %d\n", i, error);
+	/* extra verbosity from config */
+	ini_verbose = iniparser_getint(ini, "general:verbose", 0);
+	verbose = verbose_args + ini_verbose;
 
-		request = requests[i];
+	/* log timing of requests */
+	log_timing = iniparser_getboolean(ini, "general:log timing", 0);
 
-		if (request->http_code == MHD_HTTP_OK) {
-			if (verbose > 0) {
-				/* write the time to buffer ctime, then strip the line break */
-				ctime_r(&request->last_modified, ctime);
-				ctime[strlen(ctime) - 1] = '\0';
+	/* trace lookups to file, reopen if changed */
+	inistring = iniparser_getstring(ini, "general:trace file", NULL);
+	if (trace_file == NULL || inistring == NULL || strcmp(trace_file, inistring) != 0) {
+		if (trace_fd >= 0)
+			close(trace_fd);
+		trace_fd = -1;
+		free(trace_file);
+		trace_file = NULL;
 
-				write_log(stdout, "Found: %s (%f sec, modified: %s)\n",
-						request->url, request->time_total, ctime);
-			}
-		} else if (verbose > 0 && request->http_code > 0) {
+		if (inistring != NULL) {
 			if (verbose > 0)
-				write_log(stderr, "Received HTTP status code %d for %s\n",
-						request->http_code, request->url);
+				write_log(stdout, "Tracing lookups to: %s\n", inistring);
+			trace_file = strdup(inistring);
+			trace_fd = trace_open(trace_file);
 		}
-
-		if (request->http_code == MHD_HTTP_OK &&
-				/* for db files choose the most recent peer when not too old */
-				((dbfile == 1 && ((request->last_modified > last_modified &&
-						   request->last_modified + 86400 > time(NULL)) ||
-				/* but use a faster peer if available */
-						  (url != NULL &&
-						   request->last_modified >= last_modified &&
-						   request->time_total < time_total))) ||
-				 /* for packages try to guess the fastest peer */
-				 (dbfile == 0 && request->time_total < time_total))) {
-			request->host->finds++;
-			if (url != NULL)
-				free(url);
-			url = request->url;
-			host = request->host->host;
-			http_code = MHD_HTTP_TEMPORARY_REDIRECT;
-			last_modified = request->last_modified;
-			time_total = request->time_total;
-		} else
-			free(request->url);
-		free(request);
 	}
 
-	/* increase counters before reponse label,
-	   do not count redirects to project page */
-	if (http_code == MHD_HTTP_TEMPORARY_REDIRECT)
-		count_redirect++;
-	else
-		count_not_found++;
-
-response:
-	/* give response */
-	if (http_code == MHD_HTTP_TEMPORARY_REDIRECT) {
-		write_log(stdout, "Redirecting to %s: %s\n", host, url);
-		page = malloc(strlen(PAGE307) + strlen(url) + strlen(basename) + 1);
-		sprintf(page, PAGE307, url, basename);
-		response = MHD_create_response_from_buffer(strlen(page), (void*) page, MHD_RESPMEM_MUST_FREE);
-		ret = MHD_add_response_header(response, "Location", url);
-		free(url);
-	} else if (http_code == MHD_HTTP_OK) {
-		if (page != NULL) {
-			write_log(stdout, "Sending status page.\n");
-			response = MHD_create_response_from_buffer(strlen(page), (void*) page, MHD_RESPMEM_MUST_FREE);
-			ret = MHD_add_response_header(response, "Content-Type", "text/html");
-		} else {
-			write_log(stdout, "Sending favicon.\n");
-			response = MHD_create_response_from_buffer(sizeof(favicon), favicon, MHD_RESPMEM_PERSISTENT);
-			ret = MHD_add_response_header(response, "ETag", FAVICON_SHA1);
-			ret = MHD_add_response_header(response, "Last-Modified", FAVICON_DATE);
-			ret = MHD_add_response_header(response, "Cache-Control", "max-age=86400");
-			ret = MHD_add_response_header(response, "Content-Type", "image/png");
+	/* get size in MiB for measuring throughput */
+	throughput_size = iniparser_getint(ini, "general:throughput size", 64);
+
+	/* get process wide probe budget */
+	probe_budget = iniparser_getint(ini, "general:probe budget", 32);
+	if (verbose > 0 && probe_budget > 0)
+		write_log(stdout, "Limiting number of concurrent probes to %d\n", probe_budget);
+
+	/* get deadline for lookups in milliseconds */
+	lookup_deadline = iniparser_getint(ini, "general:lookup deadline", 1000);
+	if (verbose > 0 && lookup_deadline > 0)
+		write_log(stdout, "Answering lookups within %d ms\n", lookup_deadline);
+
+	/* cooperative caching and number of owners per file */
+	cooperative = iniparser_getboolean(ini, "general:cooperative", 0);
+	owners = iniparser_getint(ini, "general:owners", 2);
+	if (owners < 1 || owners > OWNERS_MAX) {
+		write_log(stderr, "Number of owners has to be between 1 and %d, using 2\n", OWNERS_MAX);
+		owners = 2;
+	}
+	if (verbose > 0 && cooperative > 0)
+		write_log(stdout, "Cooperative caching with %d owners per file\n", owners);
+
+	/* Pull-through cache: the upstream mirror on the node, the node on
+	 * clients - the node uses itself by default. */
+	pthread_rwlock_wrlock(&config_lock);
+	free(upstream);
+	upstream = (inistring = iniparser_getstring(ini, "general:upstream", NULL)) != NULL ?
+		strdup(inistring) : NULL;
+	free(pull_through);
+	pull_through = (inistring = iniparser_getstring(ini, "general:pull through",
+				upstream != NULL ? "localhost" : NULL)) != NULL ? strdup(inistring) : NULL;
+	pthread_rwlock_unlock(&config_lock);
+	pthread_mutex_lock(&pull_through_lock);
+	pull_through_checked = 0;
+	pthread_mutex_unlock(&pull_through_lock);
+	cache_size = iniparser_getint(ini, "general:cache size", 10240);
+	if (verbose > 0 && upstream != NULL)
+		write_log(stdout, "Pull-through cache for %s, up to %d MiB\n", upstream, cache_size);
+	if (verbose > 0 && pull_through != NULL)
+		write_log(stdout, "Fetching files not found from pull-through cache on %s\n", pull_through);
+
+	/* report load to peers, and use their reports */
+	peer_load = iniparser_getboolean(ini, "general:peer load", 0);
+
+	/* redirect to addresses instead of host names */
+	redirect_address = iniparser_getboolean(ini, "general:redirect address", 0);
+
+	/* answer queries from peers, and query instead of probing */
+	query = iniparser_getboolean(ini, "general:query", 0);
+
+	/* get time in milliseconds to wait for a download in flight */
+	inflight_wait = iniparser_getint(ini, "general:inflight wait", 0);
+
+	/* get max threads */
+	max_threads = iniparser_getint(ini, "general:max threads", 0);
+	if (verbose > 0 && max_threads > 0)
+		write_log(stdout, "Limiting number of threads to a maximum of %d\n", max_threads);
+
+	/* store interfaces to ignore */
+	ignore_new = malloc(sizeof(struct ignore_interfaces));
+	ignore_interfaces_ptr = ignore_new;
+	if ((inistring = iniparser_getstring(ini, "general:ignore interfaces", NULL)) != NULL) {
+		values = strdup(inistring);
+
+		value = strtok(values, DELIMITER);
+		while (value != NULL) {
+			if (verbose > 0)
+				write_log(stdout, "Ignoring interface: %s\n", value);
+			ignore_interfaces_ptr->interface = strdup(value);
+			ignore_interfaces_ptr->ifindex = if_nametoindex(value);
+			ignore_interfaces_ptr->next = malloc(sizeof(struct ignore_interfaces));
+			ignore_interfaces_ptr = ignore_interfaces_ptr->next;
+			value = strtok(NULL, DELIMITER);
 		}
-	} else { /* MHD_HTTP_NOT_FOUND */
-		if (req_count < 0)
-			write_log(stdout, "Currently no peers are available to check for %s.\n",
-					basename);
-		else if (dbfile > 0)
-			write_log(stdout, "No more recent version of %s found on %d peers.\n",
-					basename, req_count + 1);
-		else
-			write_log(stdout, "File %s not found on %d peers, giving up.\n",
-					basename, req_count + 1);
-
-		page = malloc(strlen(PAGE404) + strlen(basename) + 1);
-		sprintf(page, PAGE404, basename);
-		response = MHD_create_response_from_buffer(strlen(page), (void*) page, MHD_RESPMEM_MUST_FREE);
+		free(values);
 	}
+	ignore_interfaces_ptr->interface = NULL;
+	ignore_interfaces_ptr->ifindex = 0;
+	ignore_interfaces_ptr->next = NULL;
+
+	/* replace the list, wait for readers of the old one */
+	pthread_rwlock_wrlock(&config_lock);
+	free_ignore_interfaces(ignore_interfaces);
+	ignore_interfaces = ignore_new;
+	pthread_rwlock_unlock(&config_lock);
+
+	/* static pacserve hosts */
+	inistring = iniparser_getstring(ini, "general:pacserve hosts", NULL);
+
+	/* hand over static hosts no longer in config to mDNS */
+	for (hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next) {
+		if (hosts_ptr->mdns == 1 || (inistring != NULL && in_list(inistring, hosts_ptr->host)))
+			continue;
 
-	ret = MHD_add_response_header(response, "Server", PROGNAME " v" VERSION " " ID "/" ARCH);
-	ret = MHD_queue_response(connection, http_code, response);
-	MHD_destroy_response(response);
-
-	/* report counts to systemd */
-	sd_notifyf(0, "STATUS=%d redirects, %d not found, waiting...",
-			count_redirect, count_not_found);
+		if (verbose > 0)
+			write_log(stdout, "Removing static host: %s\n", hosts_ptr->host);
+		hosts_ptr->mdns = 1;
+		hosts_ptr->online = 0;
+	}
 
-	if (req_count > -1) {
-		free(tid);
-		free(requests);
+	/* add static pacserve hosts */
+	if (inistring != NULL) {
+		values = strdup(inistring);
+		value = strtok(values, DELIMITER);
+		while (value != NULL) {
+			if (verbose > 0)
+				write_log(stdout, "Adding static host: %s\n", value);
+
+			if (strchr(value, ':') != NULL) {
+				port = atoi(strchr(value, ':') + 1);
+				*strchr(value, ':') = 0;
+			} else
+				port = PORT_PACSERVE;
+			add_host(value, port, 0, 0, NULL);
+			value = strtok(NULL, DELIMITER);
+		}
+		free(values);
 	}
 
-	return ret;
+	/* done reading config file, free */
+	iniparser_freedict(ini);
+
+	return EXIT_SUCCESS;
 }
 
-/*** sig_callback ***/
+/*** sig_callback ***
+ * Signal handlers just set flags, work (and logging) is done in main loop. */
 static void sig_callback(int signal) {
-	write_log(stdout, "Received signal '%s', quitting.\n", strsignal(signal));
-
-	quit++;
+	quit = signal;
 }
 
 /*** sighup_callback ***/
 static void sighup_callback(int signal) {
-	struct hosts * hosts_ptr = hosts;
+	update = signal;
+}
+
+/*** sigusr_callback ***/
+static void sigusr_callback(int signal) {
+	dump = signal;
+}
 
-	write_log(stdout, "Received signal '%s', resetting bad counts, updating interfaces and hosts.\n",
-		strsignal(signal));
+/*** discover_passes ***
+ * Run discovery passes back to back, report duration, change in heap
+ * usage and new hosts with time they were found. This is used for
+ * benchmarking, see bench/discovery.sh. */
+static void discover_passes(const unsigned int passes) {
+	struct hosts * hosts_ptr;
+	struct mallinfo2 before;
+	struct timeval tv, tv_found;
+	unsigned int pass, known, online, count;
+	double duration;
 
-	while (hosts_ptr->host != NULL) {
-		hosts_ptr->badtime = 0;
-		hosts_ptr->badcount = 0;
-		hosts_ptr = hosts_ptr->next;
-	}
+	for (pass = 1; pass <= passes && quit == 0; pass++) {
+		for (known = 0, hosts_ptr = hosts; hosts_ptr->host != NULL; hosts_ptr = hosts_ptr->next)
+			known++;
+
+		before = mallinfo2();
+		gettimeofday(&tv, NULL);
+		update_interfaces();
+		update_hosts();
+		duration = time_since(&tv);
+		gettimeofday(&tv_found, NULL);
+
+		for (count = 0, online = 0, hosts_ptr = hosts; hosts_ptr->host != NULL;
+				hosts_ptr = hosts_ptr->next, count++) {
+			if (hosts_ptr->online > 0)
+				online++;
+			/* new hosts are appended */
+			if (count >= known)
+				write_log(stdout, "New host %s found at %ld.%06ld\n", hosts_ptr->host,
+						(long) tv_found.tv_sec, (long) tv_found.tv_usec);
+		}
 
-	update++;
+		write_log(stdout, "Discovery pass %u took %.6f sec, %u hosts online, heap %+zd bytes\n",
+				pass, duration, online, (ssize_t) (mallinfo2().uordblks - before.uordblks));
+	}
 }
 
-/*** sigusr_callback ***/
-static void sigusr_callback(int signal) {
+/*** dump_state ***/
+static void dump_state(int signal) {
 	struct ignore_interfaces * ignore_interfaces_ptr = ignore_interfaces;
 	struct hosts * hosts_ptr = hosts;
+	struct history total;
 	struct timeval tv;
 
 	/* initialize struct timeval */
@@ -939,35 +5166,51 @@ static void sigusr_callback(int signal) {
 		uint8_t not_avail = (hosts_ptr->mdns && !hosts_ptr->online) || (hosts_ptr->badcount &&
 			(hosts_ptr->badtime + hosts_ptr->badcount * BADTIME) > tv.tv_sec) ? 1 : 0;
 
-		write_log(stdout, " -> %s%s%s (%s, %s, port: %d, finds: %d, bad: %d)\n",
+		write_log(stdout, " -> %s%s%s (%s, %s, port: %d, finds: %d, bad: %d, throughput: %.0f bytes/sec, load: %.2f)\n",
 			not_avail ? "[" : "", hosts_ptr->host, not_avail ? "]" : "",
 			hosts_ptr->mdns ? "mdns" : "static", hosts_ptr->online ? "online" : "offline",
-			hosts_ptr->port, hosts_ptr->finds, hosts_ptr->badcount);
+			hosts_ptr->port, hosts_ptr->finds, hosts_ptr->badcount, host_throughput(hosts_ptr),
+			host_load(hosts_ptr, tv.tv_sec + tv.tv_usec / 1000000.0));
 
 		hosts_ptr = hosts_ptr->next;
 	}
 
-	write_log(stdout, "%d redirects, %d not found.\n",
-		count_redirect, count_not_found);
+	write_log(stdout, "%d redirects, %d not found (%u rejected by probe budget, %u probes skipped for busy peer).\n",
+		count_redirect, count_not_found, atomic_load(&count_rejected), atomic_load(&count_busy));
+	write_log(stdout, "Probes running: %d of %d, lookups: %d, session: %s\n",
+		probes_active, probe_budget, lookups_active,
+		atomic_load(&session_until) > tv.tv_sec ? "active" : "none");
+	pthread_mutex_lock(&history_lock);
+	history_advance(tv.tv_sec);
+	history_aggregate(&total, history_minute - 59, 60);
+	pthread_mutex_unlock(&history_lock);
+	write_log(stdout, "Last hour: %u lookups, %u redirects, latency max p50 %.1f ms, p95 %.1f ms, p99 %.1f ms\n",
+		total.lookups, total.redirects, total.latency[0] / 1000.0,
+		total.latency[1] / 1000.0, total.latency[2] / 1000.0);
+	if (cooperative > 0)
+		write_log(stdout, "Cooperative caching as %s, files pulled: %d of %d\n",
+			self_name, atomic_load(&pulls_active), PULLS);
 }
 
 /*** main ***/
 int main(int argc, char ** argv) {
-	dictionary * ini;
-	const char * inistring;
-	char * values, * value;
-	uint16_t port;
-	struct ignore_interfaces * ignore_interfaces_ptr;
-	int i, ret = 1, sleepsec = 0;
+	int i, ret = 1, sleepsec = 0, listen_fds, error;
+	unsigned int running;
 	struct MHD_Daemon * mhd;
 	struct hosts * hosts_ptr;
 	struct sockaddr_in address;
 
-	unsigned int version = 0, help = 0;
+	unsigned int version = 0, help = 0, discover = 0;
+
+	/* start the log writer, messages are written in background */
+	log_start();
 
 	/* get the verbose status */
 	while ((i = getopt_long(argc, argv, optstring, options_long, NULL)) != -1) {
 		switch (i) {
+			case 'd':
+				discover = atoi(optarg);
+				break;
 			case 'h':
 				help++;
 				break;
@@ -980,16 +5223,19 @@ int main(int argc, char ** argv) {
 				break;
 		}
 	}
+	verbose_args = verbose;
 
 	if (verbose > 0)
 		write_log(stdout, "%s: " PROGNAME " v" VERSION " " ID "/" ARCH
 				" (built: " __DATE__ ", " __TIME__ ")\n", argv[0]);
 
 	if (help > 0)
-		write_log(stdout, "usage: %s [-h] [-v] [-V]\n", argv[0]);
+		write_log(stdout, "usage: %s [-d PASSES] [-h] [-v] [-V]\n", argv[0]);
 
-	if (version > 0 || help > 0)
+	if (version > 0 || help > 0) {
+		log_stop();
 		return EXIT_SUCCESS;
+	}
 
 	if (getuid() == 0) {
 		/* process is running as root, drop privileges */
@@ -999,6 +5245,11 @@ int main(int argc, char ** argv) {
 			write_log(stderr, "Unable to drop user privileges!\n");
 	}
 
+	/* our name as peers know it from mDNS */
+	gethostname(self_name, HOST_NAME_MAX);
+	self_name[HOST_NAME_MAX - 1] = 0;
+	strcat(self_name, "." MDNS_DOMAIN);
+
 	/* allocate first struct element as dummy */
 	hosts = malloc(sizeof(struct hosts));
 	hosts->host = NULL;
@@ -1019,61 +5270,19 @@ int main(int argc, char ** argv) {
 	sigaction(SIGHUP, &act_hup, NULL);
 
 	/* parse config file */
-	if ((ini = iniparser_load(CONFIGFILE)) == NULL) {
-		write_log(stderr, "cannot parse file " CONFIGFILE ", continue anyway\n");
-		/* continue anyway, there is nothing essential in the config file */
-	} else {
-		int ini_verbose;
-
-		/* extra verbosity from config */
-		ini_verbose = iniparser_getint(ini, "general:verbose", 0);
-		verbose += ini_verbose;
-
-		/* get max threads */
-		max_threads = iniparser_getint(ini, "general:max threads", max_threads);
-		if (verbose > 0 && max_threads > 0)
-			write_log(stdout, "Limiting number of threads to a maximum of %d\n", max_threads);
-
-		/* store interfaces to ignore */
-		if ((inistring = iniparser_getstring(ini, "general:ignore interfaces", NULL)) != NULL) {
-			values = strdup(inistring);
-			ignore_interfaces_ptr = ignore_interfaces;
-
-			value = strtok(values, DELIMITER);
-			while (value != NULL) {
-				if (verbose > 0)
-					write_log(stdout, "Ignoring interface: %s\n", value);
-				ignore_interfaces_ptr->interface = strdup(value);
-				ignore_interfaces_ptr->next = malloc(sizeof(struct ignore_interfaces));
-				ignore_interfaces_ptr = ignore_interfaces_ptr->next;
-				value = strtok(NULL, DELIMITER);
-			}
-			ignore_interfaces_ptr->interface = NULL;
-			ignore_interfaces_ptr->next = NULL;
-			free(values);
-		}
-
-		/* add static pacserve hosts */
-		if ((inistring = iniparser_getstring(ini, "general:pacserve hosts", NULL)) != NULL) {
-			values = strdup(inistring);
-			value = strtok(values, DELIMITER);
-			while (value != NULL) {
-				if (verbose > 0)
-					write_log(stdout, "Adding static host: %s\n", value);
-
-				if (strchr(value, ':') != NULL) {
-					port = atoi(strchr(value, ':') + 1);
-					*strchr(value, ':') = 0;
-				} else
-					port = PORT_PACSERVE;
-				add_host(value, port, 0);
-				value = strtok(NULL, DELIMITER);
-			}
-			free(values);
-		}
+	load_config(0);
 
-		/* done reading config file, free */
-		iniparser_freedict(ini);
+	/* initialize curl, and share for sessions */
+	curl_global_init(CURL_GLOBAL_ALL);
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&session_locks[i], NULL);
+	session_share = session_new();
+
+	/* just run discovery for benchmarking, then quit */
+	if (discover > 0) {
+		discover_passes(discover);
+		ret = EXIT_SUCCESS;
+		goto fail;
 	}
 
 	/* prepare struct to make microhttpd listen on localhost only */
@@ -1081,18 +5290,45 @@ int main(int argc, char ** argv) {
 	address.sin_port = htons(PORT_PACREDIR);
 	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	/* start http server */
-	if ((mhd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_TCP_FASTOPEN, PORT_PACREDIR,
-			NULL, NULL, &ahc_echo, NULL, MHD_OPTION_SOCK_ADDR, &address, MHD_OPTION_END)) == NULL) {
+	/* start http server - use the listening socket passed by systemd
+	   (socket activation), connections are queued there before we are up */
+	if ((listen_fds = sd_listen_fds(1)) > 1) {
+		write_log(stderr, "Received %d sockets from systemd, expected one.\n", listen_fds);
+		goto fail;
+	} else if (listen_fds == 1) {
+		if (sd_is_socket_inet(SD_LISTEN_FDS_START, AF_UNSPEC, SOCK_STREAM, 1, 0) <= 0) {
+			write_log(stderr, "Socket received from systemd is not a listening TCP socket.\n");
+			goto fail;
+		}
+
+		mhd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION, 0,
+			NULL, NULL, &ahc_echo, NULL, MHD_OPTION_LISTEN_SOCKET, SD_LISTEN_FDS_START,
+			MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL, MHD_OPTION_END);
+	} else
+		mhd = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_TCP_FASTOPEN, PORT_PACREDIR,
+			NULL, NULL, &ahc_echo, NULL, MHD_OPTION_SOCK_ADDR, &address,
+			MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL, MHD_OPTION_END);
+
+	if (mhd == NULL) {
 		write_log(stderr, "Could not start daemon on port %d.\n", PORT_PACREDIR);
 		goto fail;
 	}
 
 	if (verbose > 0)
-		write_log(stdout, "Listening on port %d\n", PORT_PACREDIR);
+		write_log(stdout, "Listening on port %d%s\n", PORT_PACREDIR,
+				listen_fds == 1 ? " (socket from systemd)" : "");
 
-	/* initialize curl */
-	curl_global_init(CURL_GLOBAL_ALL);
+	/* with cooperative caching, load reports or pull-through cache
+	   listen for peers */
+	peer_start();
+
+	/* answer queries from peers */
+	if (query > 0) {
+		if ((error = pthread_create(&query_tid, NULL, query_responder, NULL)) != 0)
+			write_log(stderr, "Could not run thread for queries, errno %d\n", error);
+		else
+			query_running = 1;
+	}
 
 	/* register SIG{INT,KILL,TERM} signal callbacks */
 	struct sigaction act = { 0 };
@@ -1114,46 +5350,95 @@ int main(int argc, char ** argv) {
 	while (quit == 0) {
 		sleepsec = sleep(sleepsec);
 
-		if (sleepsec > 0 && update == 0)
+		if (dump > 0) {
+			dump_state(dump);
+			dump = 0;
+		}
+
+		if (quit > 0 || (sleepsec > 0 && update == 0))
 			continue;
 
+		if (update > 0) {
+			write_log(stdout, "Received signal '%s', reloading config, resetting bad counts, "
+				"updating interfaces and hosts.\n", strsignal(update));
+
+			load_config(1);
+			peer_start();
+
+			hosts_ptr = hosts;
+			while (hosts_ptr->host != NULL) {
+				hosts_ptr->badtime = 0;
+				hosts_ptr->badcount = 0;
+				hosts_ptr = hosts_ptr->next;
+			}
+		}
+
 		update_interfaces();
 		update_hosts();
+		if (query > 0)
+			query_ping(time(NULL));
+		update_packages();
+		session_release(time(NULL));
+		history_sample(time(NULL));
 		update = 0;
 		sleepsec = 60;
 	}
 
+	write_log(stdout, "Received signal '%s', quitting.\n", strsignal(quit));
+
 	/* report stopping to systemd */
 	sd_notify(0, "STOPPING=1\nSTATUS=Stopping...");
 
-	/* stop http server */
+	/* stop http servers */
+	if (mhd_peer != NULL)
+		MHD_stop_daemon(mhd_peer);
 	MHD_stop_daemon(mhd);
 
-	/* we're done with libcurl, so clean it up */
-	curl_global_cleanup();
+	/* the responder checks for quit every second */
+	if (query_running > 0)
+		pthread_join(query_tid, NULL);
 
 	ret = EXIT_SUCCESS;
 
 fail:
+	/* probes, offers and downloads run detached and use hosts and libcurl,
+	   leave these to exit if any is stuck */
+	if ((running = thread_wait(THREADS_WAIT)) > 0) {
+		write_log(stderr, "%u threads still running, skipping cleanup\n", running);
+		goto out;
+	}
+
+	/* we're done with libcurl, so clean it up */
+	if (session_share != NULL && pthread_rwlock_trywrlock(&session_lock) == 0)
+		curl_share_cleanup(session_share);
+	curl_global_cleanup();
+
 
 	/* Cleanup things */
 	while (hosts->host != NULL) {
 		free(hosts->host);
+		free(hosts->history);
 		hosts_ptr = hosts->next;
 		free(hosts);
 		hosts = hosts_ptr;
 	}
 	free(hosts);
 
-	while (ignore_interfaces->interface != NULL) {
-		free(ignore_interfaces->interface);
-		ignore_interfaces_ptr = ignore_interfaces->next;
-		free(ignore_interfaces);
-		ignore_interfaces = ignore_interfaces_ptr;
-	}
-	free(ignore_interfaces);
+	free_ignore_interfaces(ignore_interfaces);
+
+	free_packages(packages);
 
+	if (trace_fd >= 0)
+		close(trace_fd);
+	free(trace_file);
+	free(upstream);
+	free(pull_through);
+
+out:
 	sd_notify(0, "STATUS=Stopped. Bye!");
 
+	/* write what is left in log rings */
+	log_stop();
+
 	return ret;
 }
@@ -24,32 +24,68 @@
 /* glibc headers */
 #include <arpa/inet.h>
 #include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <malloc.h>
 #include <math.h>
 #include <net/if.h>
+#include <net/if_arp.h>
+#include <netdb.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
 #include <time.h>
 
 /* systemd headers */
 #include <systemd/sd-bus.h>
 #include <systemd/sd-daemon.h>
+#include <systemd/sd-journal.h>
 
 /* various headers needing linker options */
+#include <alpm.h>
 #include <curl/curl.h>
 #include <iniparser/iniparser.h>
 #include <microhttpd.h>
+#include <openssl/evp.h>
 #include <pthread.h>
 
+/* kernel headers, for measuring load */
+#include <linux/inet_diag.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/tcp.h>
+
+/* Static tracepoints (USDT) for bpftrace and perf, a single nop each
+ * when not attached. Left out if systemtap's sys/sdt.h is missing. */
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT(name, ...)	STAP_PROBEV(pacredir, name, ## __VA_ARGS__)
+#else
+#define USDT(name, ...)	do { } while (0)
+#endif
+
 /* compile time configuration */
 #include "config.h"
 #include "version.h"
 #include "html.h"
 #include "favicon.h"
 
+/* lookup core and trace format */
+#include "select.h"
+#include "trace.h"
+
 #define DNS_CLASS_IN 1U
 #define DNS_TYPE_PTR 12U
 
@@ -62,6 +98,74 @@
 
 #define PROGNAME	"pacredir"
 
+/* query protocol, version and maximum size of datagram */
+#define QUERY_MAGIC	"pacredir1"
+#define QUERY_SIZE	512
+
+/* availability of a host in history */
+#define HISTORY_UNKNOWN		0
+#define HISTORY_AVAILABLE	1
+#define HISTORY_BAD		2
+#define HISTORY_OFFLINE		3
+
+/* log entry */
+struct log_entry {
+	/* global sequence number, keeps order across rings */
+	unsigned long seq;
+	/* stream the message belongs to, stdout or stderr */
+	FILE * stream;
+	/* structured fields for the journal, empty or NULL if unset */
+	char peer[HOST_NAME_MAX];
+	char file[NAME_MAX + 1];
+	const char * decision;
+	/* latency in microseconds, negative if unset */
+	long latency;
+	/* the formatted message */
+	char message[LOG_MESSAGE];
+};
+
+/* log ring, owned by one thread (producer) and drained by the log writer */
+struct log_ring {
+	/* true while a thread owns this ring */
+	atomic_uchar in_use;
+	/* position of next entry to write, changed by owner only */
+	atomic_uint tail;
+	/* position of next entry to read, changed by log writer only */
+	atomic_uint head;
+	/* the entries */
+	struct log_entry entries[LOG_RING_SIZE];
+	/* pointer to next struct element */
+	struct log_ring * next;
+};
+
+/* arena, memory for a request that is released in one step */
+struct arena {
+	/* references held, the last one frees (first block only) */
+	atomic_uint refs;
+	/* size of data and bytes used */
+	size_t size;
+	size_t used;
+	/* pointer to next block, if the first one is exhausted */
+	struct arena * next;
+	/* the data, aligned as malloc() does */
+	_Alignas(max_align_t) char data[];
+};
+
+/* interface a host was found on */
+struct host_interface {
+	/* interface index, 0 for unused */
+	unsigned int ifindex;
+	/* interface name */
+	char name[IF_NAMESIZE];
+	/* weight from link type and speed, higher is better */
+	unsigned int weight;
+	/* intermediate state while querying mDNS, and whether the host was
+	   found on it in the last complete query - the slot is reused only if
+	   neither is set */
+	uint8_t present;
+	uint8_t active;
+};
+
 /* hosts */
 struct hosts {
 	/* host name */
@@ -79,16 +183,73 @@ struct hosts {
 	uint8_t online;
 	/* intermediate state while querying mDNS */
 	uint8_t present;
+	/* interfaces the host was found on, and index of best one (-1 if none) -
+	   protected by interface_lock */
+	struct host_interface interfaces[HOST_INTERFACES];
+	int interface;
 	/* unix timestamp of last bad request */
 	__time_t badtime;
 	/* count the number of bad requests */
 	unsigned int badcount;
 	/* count finds */
 	unsigned int finds;
+	/* estimated throughput in bytes per second, 0 if unknown */
+	double throughput;
+	/* redirects recently sent to host (decaying) and time of last update */
+	double load;
+	double load_time;
+	/* probes currently running */
+	unsigned int probes;
+	/* load reported by peer: transfers and spare upload capacity in bytes
+	   per second, time of report (or last try) and whether it is valid */
+	int transfers;
+	double spare;
+	time_t load_report;
+	uint8_t load_reported;
+	/* unix timestamp of last answer to ping, if running a responder, its
+	   round trip time in milliseconds and the address it came from -
+	   protected by query_lock */
+	time_t query_seen;
+	long query_rtt;
+	struct in_addr query_address;
+	/* with 'redirect address' the address last probed successfully, in
+	   url syntax, and unix timestamp of the probe - protected by
+	   address_lock */
+	char address[INET6_ADDRSTRLEN + IF_NAMESIZE + 5];
+	time_t address_time;
+	/* availability per minute, see struct history */
+	uint8_t * history;
 	/* pointer to next struct element */
 	struct hosts * next;
 };
 
+/* package, with expected size from sync database */
+struct package {
+	/* file name and repository */
+	char * filename;
+	const char * repo;
+	/* compressed size */
+	off_t size;
+	/* SHA-256 digest (hex) and signature (base64), NULL if not in database */
+	char * sha256;
+	char * sig;
+	/* pointer to next struct element in bucket */
+	struct package * next;
+};
+
+/* package index, hash table of packages */
+struct package_index {
+	/* modification time of newest sync database */
+	time_t mtime;
+	/* number of packages */
+	size_t count;
+	/* repository names */
+	char ** repos;
+	size_t repo_count;
+	/* the buckets */
+	struct package * buckets[PACKAGE_BUCKETS];
+};
+
 /* ignore interfaces */
 struct ignore_interfaces {
 	/* interface name */
@@ -105,18 +266,262 @@ struct request {
 	struct hosts * host;
 	/* url */
 	char * url;
+	/* interface to bind to (curl syntax), empty for any */
+	char interface[IF_NAMESIZE + 3];
 	/* HTTP status code */
 	long http_code;
-	/* total connection time */
+	/* name lookup, connect and total connection time */
+	double time_namelookup;
+	double time_connect;
 	double time_total;
 	/* last modified timestamp */
 	long last_modified;
+	/* content length, -1 if unknown */
+	curl_off_t content_length;
+	/* bytes to fetch for measuring throughput (0 for HEAD request),
+	   bytes received and measured throughput in bytes per second */
+	curl_off_t range;
+	curl_off_t bytes;
+	double throughput;
+	/* bytes received during slow start, and the time measuring began */
+	curl_off_t skipped;
+	struct timeval tv_measure;
+	/* url for signature, NULL if not checked - the probe checks it after
+	   the result is published, HTTP status code is from query reply */
+	char * sig_url;
+	long sig_http_code;
+	/* candidate for selection */
+	struct candidate candidate;
+	/* arena the request lives in, the probe holds a reference */
+	struct arena * arena;
+	/* true when the probe finished, protected by probe_lock */
+	uint8_t done;
+};
+
+/* sibling, a peer known to have a signature file */
+struct sibling {
+	/* file name of signature */
+	char filename[NAME_MAX + 1];
+	/* host infos */
+	struct hosts * host;
+	/* unix timestamp when stored */
+	time_t time;
+};
+
+/* offer of a file to its owners, for cooperative caching */
+struct offer {
+	/* file name */
+	char filename[NAME_MAX + 1];
+	/* the owners to offer to */
+	struct hosts * owners[OWNERS_MAX];
+	int count;
 };
 
+/* answer to ping, checked when the window closed */
+struct query_pong {
+	struct hosts * host;
+	struct in_addr address;
+	long rtt;
+};
+
+/* file to pull from a peer that offered it */
+struct pull {
+	/* file name */
+	char filename[NAME_MAX + 1];
+	/* host infos */
+	struct hosts * host;
+};
+
+/* download from mirror in flight, announced by an offer */
+struct inflight {
+	/* file name */
+	char filename[NAME_MAX + 1];
+	/* name of the peer downloading */
+	char host[HOST_NAME_MAX + 1];
+	/* unix timestamp when stored */
+	time_t time;
+};
+
+/* statistics for a minute, or aggregated for a number of minutes */
+struct history {
+	/* minutes since epoch, 0 if unused - number of minutes if aggregated */
+	time_t minute;
+	/* lookups and redirects */
+	unsigned int lookups;
+	unsigned int redirects;
+	/* decision latency in microseconds, 50th, 95th and 99th percentile -
+	   maximum if aggregated */
+	long latency[3];
+};
+
+/* timing of a request, all values in seconds */
+struct timing {
+	/* time spent throttling between probes */
+	double throttle;
+	/* time spent creating probe threads */
+	double spawn;
+	/* slowest peer's name lookup, connect and total time */
+	double namelookup;
+	double connect;
+	double head;
+	/* time spent waiting for probe threads */
+	double join;
+	/* chosen peer's total time */
+	double chosen;
+	/* time spent waiting for a download in flight */
+	double inflight;
+	/* time spent waiting for replies to query */
+	double query;
+	/* number of peers probed */
+	int peers;
+};
+
+/* file fetched from upstream mirror, served while it downloads */
+struct fill {
+	/* file name */
+	char filename[NAME_MAX + 1];
+	/* references held by the download and readers, protected by fills_lock */
+	unsigned int refs;
+	/* status code from upstream, 0 while waiting - content length, -1 if
+	   unknown - bytes written to the partial file - 1 when finished, -1
+	   on error, all protected by fills_lock */
+	long http_code;
+	off_t size;
+	off_t bytes;
+	int8_t done;
+	/* upstream url */
+	char url[PATH_MAX];
+	/* partial file and transfer, used by the download only */
+	int fd;
+	CURL * curl;
+	/* pointer to next struct element */
+	struct fill * next;
+};
+
+/* file in pull-through cache */
+struct cached {
+	char name[NAME_MAX + 1];
+	time_t mtime;
+	off_t size;
+};
+
+/* reader of a file while it downloads */
+struct fill_reader {
+	struct fill * fill;
+	int fd;
+};
+
+/* lookup of a file on peers */
+struct lookup {
+	/* file name, class of file and time of request */
+	const char * basename;
+	uint8_t dbfile;
+	uint8_t sigfile;
+	struct timeval tv;
+	/* If-Modified-Since timestamp and expected size, -1 if unknown */
+	time_t last_modified;
+	off_t size;
+	/* arena for requests, results and urls */
+	struct arena * arena;
+	/* hosts counted, requests sent and their results */
+	int host_count;
+	int req_count;
+	struct request * requests;
+	struct request * results;
+	/* hosts in the order probed */
+	struct hosts ** order;
+	/* owners with cooperative caching */
+	struct hosts * owner[OWNERS_MAX];
+	int owner_count;
+	/* the selection and timing */
+	struct selection selection;
+	struct timing timing;
+	/* decision: status code, url and host redirected to */
+	long http_code;
+	char * url;
+	struct hosts * host;
+	/* the peer downloading from mirror, if waited for */
+	struct hosts * inflight;
+};
+
+/* result of a lookup done in advance */
+struct prepared {
+	/* file name */
+	char filename[NAME_MAX + 1];
+	/* host infos, NULL if not found */
+	struct hosts * host;
+	/* unix timestamp when stored */
+	time_t time;
+};
+
+/* batch of files to look up in advance */
+struct prefetch {
+	/* references held by connection, response and lookup threads */
+	atomic_uint refs;
+	/* request body received */
+	char * body;
+	size_t body_size;
+	/* file names (pointing into body) and their hosts, NULL if not found */
+	char ** files;
+	struct hosts ** hosts;
+	int count;
+	/* next file to look up, files done in order of completion, files
+	   found and files reported to the client */
+	int next;
+	int * done;
+	int done_count;
+	int found;
+	int reported;
+	/* true when the summary was sent */
+	uint8_t summary;
+	/* protects the above, signaled when a lookup finished */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* log_release_ring */
+static void log_release_ring(void * data);
+/* log_get_ring */
+static struct log_ring * log_get_ring(void);
+/* log_enqueue */
+static int log_enqueue(FILE *stream, const char * peer, const char * file,
+		const char * decision, const long latency, const char *format, va_list args);
+/* log_wake */
+static void log_wake(void);
+/* log_pending */
+static uint8_t log_pending(void);
 /* write_log */
 static int write_log(FILE *stream, const char *format, ...);
+/* write_log_decision */
+static int write_log_decision(const char * peer, const char * file,
+		const char * decision, const long latency, const char *format, ...);
+/* log_output */
+static void log_output(const struct log_entry * entry);
+/* log_writer */
+static void * log_writer(void * data);
+/* log_start */
+static void log_start(void);
+/* log_stop */
+static void log_stop(void);
+/* time_since */
+static double time_since(const struct timeval * start);
+/* arena_new */
+static struct arena * arena_new(const size_t size);
+/* arena_alloc */
+static void * arena_alloc(struct arena * arena, const size_t size);
+/* arena_printf */
+static char * arena_printf(struct arena * arena, const char *format, ...);
+/* arena_free */
+static void arena_free(void * data);
+/* thread_start */
+static int thread_start(void * (*start_routine)(void *), void * data);
+/* thread_finish */
+static void thread_finish(void);
+/* thread_wait */
+static unsigned int thread_wait(const time_t timeout);
 /* get_url */
-static char * get_url(const char * hostname, const uint16_t port, const uint8_t dbfile, const char * uri);
+static char * get_url(struct arena * arena, const char * hostname, const uint16_t port,
+		const uint8_t dbfile, const char * uri);
 /* update_interfaces */
 static void update_interfaces(void);
 
@@ -129,15 +534,180 @@ static void update_hosts(void);
 /* update_hosts_on_interface */
 static void update_hosts_on_interface(sd_bus *bus, const unsigned int if_index, const char *if_name);
 
+/* interface_weight */
+static unsigned int interface_weight(const char * if_name);
+/* best_interface */
+static void best_interface(struct hosts * host);
+/* interface_copy */
+static int interface_copy(const struct hosts * host, struct host_interface * copy);
+/* bind_interface */
+static void bind_interface(const struct hosts * host, char * buffer, const size_t size);
+/* address_store */
+static void address_store(struct hosts * host, CURL * curl, const char * interface, const time_t now);
+/* redirect_url */
+static char * redirect_url(struct arena * arena, struct hosts * host,
+		const uint8_t dbfile, const char * uri, const time_t now);
 /* add_host */
-static int add_host(const char * host, const uint16_t port, const uint8_t mdns);
+static int add_host(const char * host, const uint16_t port, const uint8_t mdns,
+		const unsigned int if_index, const char * if_name);
+
+/* hash_string */
+static uint32_t hash_string(const char * string);
+/* free_packages */
+static void free_packages(struct package_index * index);
+/* update_packages */
+static void update_packages(void);
+/* package_size */
+static off_t package_size(const char * filename);
+/* package_checksum */
+static uint8_t package_checksum(const char * filename, off_t * size, char * sha256,
+		const size_t sha256_size, char ** sig);
+/* package_repo */
+static uint8_t package_repo(const char * filename, char * repo, const size_t size);
+
+/* sibling_store */
+static void sibling_store(const char * filename, struct hosts * host, const uint8_t prefer);
+/* sibling_lookup */
+static struct hosts * sibling_lookup(const char * filename, const time_t now);
+
+/* probe_acquire */
+static int probe_acquire(struct hosts * host, const int own, const struct timespec * deadline);
+/* probe_release */
+static void probe_release(struct request * request);
+/* session_lock_callback */
+static void session_lock_callback(CURL * handle, curl_lock_data data,
+		curl_lock_access access, void * userptr);
+/* session_unlock_callback */
+static void session_unlock_callback(CURL * handle, curl_lock_data data, void * userptr);
+/* session_new */
+static CURLSH * session_new(void);
+/* session_touch */
+static void session_touch(const uint8_t dbfile, const time_t now);
+/* session_release */
+static void session_release(const time_t now);
+/* probe_header */
+static size_t probe_header(char * buffer, size_t size, size_t nitems, void * data);
+/* probe_write */
+static size_t probe_write(char * buffer, size_t size, size_t nmemb, void * data);
+/* host_load */
+static double host_load(struct hosts * host, const double now);
+/* host_assign */
+static void host_assign(struct hosts * host, const double now);
+/* host_throughput */
+static double host_throughput(struct hosts * host);
+/* host_measured */
+static void host_measured(struct hosts * host, const double throughput);
+/* load_measure */
+static int load_measure(int * transfers, double * rate);
+/* load_capacity */
+static double load_capacity(void);
+/* load_fetch */
+static void load_fetch(struct hosts * host, const time_t now);
+/* load_reported */
+static void load_reported(struct hosts * host, const time_t now, struct candidate * candidate);
 
 /* get_http_code */
 static void * get_http_code(void * data);
+/* find_owners */
+static int find_owners(const char * filename, const size_t length, struct hosts ** owner);
+/* offer_send */
+static void * offer_send(void * data);
+/* offer_start */
+static void offer_start(const char * filename, struct hosts ** owner, const int count);
+/* inflight_store */
+static void inflight_store(const char * filename, const char * host);
+/* inflight_lookup */
+static uint8_t inflight_lookup(const char * filename, const time_t now, char * host, const size_t size);
+/* inflight_query */
+static uint8_t inflight_query(struct hosts * owner, const char * filename, char * host, const size_t size);
+/* inflight_find */
+static struct hosts * inflight_find(const char * filename, struct hosts ** owner, const int count);
+/* inflight_wait_for */
+static uint8_t inflight_wait_for(struct hosts * host, const char * filename, const off_t size,
+		const long timeout);
+/* file_verify */
+static uint8_t file_verify(const char * path, const off_t size, const char * sha256, const char * sig);
+/* pull_file */
+static int pull_file(struct hosts * host, const char * filename, const off_t size,
+		const char * sha256, const char * sig);
+/* offer_pull */
+static void * offer_pull(void * data);
 /* append_string */
 static char * append_string(char * string, const char *format, ...);
+/* history_state */
+static uint8_t history_state(const struct hosts * host, const time_t now);
+/* history_percentiles */
+static void history_percentiles(const unsigned int * histogram, long * latency);
+/* history_advance */
+static void history_advance(const time_t now);
+/* history_record */
+static void history_record(const time_t now, const uint8_t redirect, const long latency);
+/* history_sample */
+static void history_sample(const time_t now);
+/* history_aggregate */
+static void history_aggregate(struct history * group, const time_t first, const int size);
+/* history_available */
+static int history_available(const struct hosts * host, const time_t first, const int size, int * known);
+/* sparkline */
+static char * sparkline(char * page, const double * values, const int count, const double max);
+/* status_history */
+static char * status_history(char * page);
+/* json_string */
+static void json_string(FILE * stream, const char * string);
+/* history_json */
+static char * history_json(void);
+/* query_nonce */
+static unsigned int query_nonce(void);
+/* query_socket */
+static int query_socket(void);
+/* query_responding */
+static uint8_t query_responding(struct hosts * host, const time_t now, long * rtt,
+		struct in_addr * address);
+/* query_send */
+static int query_send(const int fd, const char * message, const uint8_t responding, const time_t now);
+/* query_host */
+static struct hosts * query_host(const char * name);
+/* query_ping */
+static void query_ping(const time_t now);
+/* query_peers */
+static int query_peers(struct lookup * lookup, const int order_count);
+/* query_join */
+static void query_join(const int fd);
+/* query_answer */
+static int query_answer(const char * message, char * reply, const size_t size);
+/* query_responder */
+static void * query_responder(void * data);
+/* lookup_init */
+static int lookup_init(struct lookup * lookup, const char * basename,
+		const struct timeval * tv, const size_t extra);
+/* lookup_file */
+static void lookup_file(struct lookup * lookup);
+/* prepared_store */
+static void prepared_store(const char * filename, struct hosts * host);
+/* prepared_lookup */
+static uint8_t prepared_lookup(const char * filename, const time_t now, struct hosts ** host);
+/* prefetch_release */
+static void prefetch_release(void * data);
+/* prefetch_lookup */
+static void * prefetch_lookup(void * data);
+/* prefetch_reader */
+static ssize_t prefetch_reader(void * cls, uint64_t pos, char * buf, size_t max);
+/* prefetch_start */
+static struct MHD_Response * prefetch_start(struct prefetch * prefetch, unsigned int * http_code);
+/* request_completed */
+static void request_completed(void * cls, struct MHD_Connection * connection,
+		void ** ptr, enum MHD_RequestTerminationCode toe);
 /* status_page */
 static char * status_page(void);
+/* trace_open */
+static int trace_open(const char * path);
+/* trace_lookup */
+static void trace_lookup(struct arena * arena, const char * basename, const uint8_t class,
+		const uint8_t decision, const struct request * requests, const int count,
+		const int chosen, const struct timeval * tv, const long latency,
+		const time_t if_modified_since, const off_t size);
+/* server_timing */
+static int server_timing(char * buffer, const size_t size, const struct timing * timing);
 /* ahc_echo */
 static enum MHD_Result ahc_echo(void * cls,
 		struct MHD_Connection * connection,
@@ -147,6 +717,49 @@ static enum MHD_Result ahc_echo(void * cls,
 		const char * upload_data,
 		size_t * upload_data_size,
 		void ** ptr);
+/* upstream_url */
+static int upstream_url(char * buffer, const size_t size, const char * repo, const char * filename);
+/* cache_compare */
+static int cache_compare(const void * a, const void * b);
+/* pull_through_check */
+static uint8_t pull_through_check(const char * host, const time_t now);
+/* cache_evict */
+static void cache_evict(void);
+/* fill_release */
+static void fill_release(struct fill * fill);
+/* fill_write */
+static size_t fill_write(char * buffer, size_t size, size_t nmemb, void * data);
+/* fill_download */
+static void * fill_download(void * data);
+/* fill_read */
+static ssize_t fill_read(void * cls, uint64_t pos, char * buf, size_t max);
+/* fill_close */
+static void fill_close(void * cls);
+/* upstream_response */
+static struct MHD_Response * upstream_response(const char * repo, const char * filename,
+		const uint8_t head, unsigned int * http_code);
+/* host_address */
+static uint8_t host_address(const struct hosts * host, const struct sockaddr * address);
+/* peer_address */
+static uint8_t peer_address(struct hosts * host, struct MHD_Connection * connection);
+/* ahc_peer */
+static enum MHD_Result ahc_peer(void * cls,
+		struct MHD_Connection * connection,
+		const char * uri,
+		const char * method,
+		const char * version,
+		const char * upload_data,
+		size_t * upload_data_size,
+		void ** ptr);
+
+/* peer_start */
+static void peer_start(void);
+/* in_list */
+static uint8_t in_list(const char * list, const char * host);
+/* free_ignore_interfaces */
+static void free_ignore_interfaces(struct ignore_interfaces * list);
+/* load_config */
+static int load_config(const uint8_t reload);
 
 /* sig_callback */
 static void sig_callback(int signal);
@@ -154,5 +767,9 @@ static void sig_callback(int signal);
 static void sighup_callback(int signal);
 /* sigusr_callback */
 static void sigusr_callback(int signal);
+/* discover_passes */
+static void discover_passes(const unsigned int passes);
+/* dump_state */
+static void dump_state(int signal);
 
 #endif /* _PACREDIR_H */
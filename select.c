@@ -0,0 +1,180 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* define structs and functions */
+#include "select.h"
+
+/*** file_basename ***
+ * we want the filename, not the path */
+const char * file_basename(const char * uri) {
+	const char * basename;
+
+	if ((basename = strrchr(uri, '/')) != NULL)
+		return basename + 1;
+
+	return uri;
+}
+
+/*** file_class ***
+ * database (*.db and *.files), signature or package file */
+uint8_t file_class(const char * basename) {
+	size_t len = strlen(basename);
+
+	if ((len > 3 && strcmp(basename + len - 3, ".db") == 0) ||
+			(len > 6 && strcmp(basename + len - 6, ".files") == 0))
+		return FILE_CLASS_DB;
+	else if (len > 4 && strcmp(basename + len - 4, ".sig") == 0)
+		return FILE_CLASS_SIG;
+
+	return FILE_CLASS_PKG;
+}
+
+/*** file_url ***
+ * Write the url of file on peer to buffer, works like snprintf(). */
+int file_url(char * buffer, const size_t size, const char * hostname, const uint16_t port,
+		const uint8_t dbfile, const char * basename) {
+	return snprintf(buffer, size, "http://%s:%d/%s/%s", hostname, port, dbfile ? "db" : "pkg", basename);
+}
+
+/*** rendezvous_score ***
+ * Score of host for the first length characters of filename, the hosts
+ * with highest score own the file. This is FNV-1a with a final mix, as
+ * host names often differ in the last characters only. */
+uint64_t rendezvous_score(const char * filename, const size_t length, const char * host) {
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (uint8_t) filename[i];
+		hash *= 1099511628211ULL;
+	}
+	hash ^= '/';
+	hash *= 1099511628211ULL;
+	while (*host != 0) {
+		hash ^= (uint8_t) *host++;
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/*** rendezvous_init ***
+ * start finding the owners of a file, at most RENDEZVOUS_MAX */
+void rendezvous_init(struct rendezvous * rendezvous, const char * filename,
+		const size_t length, const int max) {
+	rendezvous->filename = filename;
+	rendezvous->length = length;
+	rendezvous->max = max < RENDEZVOUS_MAX ? max : RENDEZVOUS_MAX;
+	rendezvous->count = 0;
+}
+
+/*** rendezvous_add ***
+ * Score host, and insert owner sorted if it is among the highest
+ * scores. The lowest score is dropped if full. */
+void rendezvous_add(struct rendezvous * rendezvous, const char * host, void * owner) {
+	uint64_t score = rendezvous_score(rendezvous->filename, rendezvous->length, host);
+	int i;
+
+	for (i = rendezvous->count; i > 0 && rendezvous->score[i - 1] < score; i--) {
+		if (i < rendezvous->max) {
+			rendezvous->score[i] = rendezvous->score[i - 1];
+			rendezvous->owner[i] = rendezvous->owner[i - 1];
+		}
+	}
+	if (i < rendezvous->max) {
+		rendezvous->score[i] = score;
+		rendezvous->owner[i] = owner;
+		if (rendezvous->count < rendezvous->max)
+			rendezvous->count++;
+	}
+}
+
+/*** selection_init ***/
+void selection_init(struct selection * selection, const uint8_t dbfile,
+		const time_t last_modified, const off_t size, const off_t throughput_size,
+		const time_t now) {
+	selection->dbfile = dbfile;
+	selection->now = now;
+	selection->size = size;
+	selection->throughput_size = throughput_size;
+	selection->chosen = -1;
+	selection->last_modified = last_modified;
+	selection->time_total = INFINITY;
+	selection->cost = INFINITY;
+}
+
+/*** selection_add ***
+ * This is the decision rule: Check candidate and make it the chosen one
+ * if it is better than what we have. */
+int selection_add(struct selection * selection, const int index, struct candidate * candidate) {
+	off_t expected;
+	double throughput, busy;
+
+	if (candidate->http_code != 200)
+		return SELECT_NONE;
+
+	/* skip peer if the file does not match the size from sync database,
+	   it may be truncated or still downloading */
+	if (selection->dbfile == 0 && selection->size >= 0 &&
+			candidate->content_length >= 0 && candidate->content_length != selection->size)
+		return SELECT_SIZE_MISMATCH;
+
+	/* a new transfer gets no more than the spare capacity reported */
+	throughput = candidate->throughput;
+	if (candidate->spare > 0 && (throughput <= 0 || candidate->spare < throughput))
+		throughput = candidate->spare;
+
+	/* for large files add the estimated transfer time */
+	candidate->cost = candidate->time_total;
+	expected = selection->size >= 0 ? selection->size : candidate->content_length;
+	if (selection->dbfile == 0 && selection->throughput_size > 0 &&
+			throughput > 0 && expected >= selection->throughput_size)
+		candidate->cost += expected / throughput;
+
+	/* Spread load over peers holding the file: Every redirect recently
+	   sent to a host shares its bandwidth, so scale the cost. We know
+	   about our own redirects only, transfers reported by the peer
+	   include those of other clients. */
+	busy = candidate->transfers > candidate->load ? candidate->transfers : candidate->load;
+	if (selection->dbfile == 0 && busy > 0.01)
+		candidate->cost *= 1 + busy;
+
+	if (/* for db files choose the most recent peer when not too old */
+			(selection->dbfile == 1 && ((candidate->last_modified > selection->last_modified &&
+					candidate->last_modified + SELECT_DB_MAX_AGE > selection->now) ||
+			/* but use a faster peer if available */
+					(selection->chosen >= 0 &&
+					 candidate->last_modified >= selection->last_modified &&
+					 candidate->time_total < selection->time_total))) ||
+			/* for packages try to guess the fastest peer */
+			(selection->dbfile == 0 && candidate->cost < selection->cost)) {
+		selection->chosen = index;
+		selection->last_modified = candidate->last_modified;
+		selection->time_total = candidate->time_total;
+		selection->cost = candidate->cost;
+		return SELECT_CHOSEN;
+	}
+
+	return SELECT_NONE;
+}
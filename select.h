@@ -0,0 +1,120 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _SELECT_H
+#define _SELECT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* database files are used only if not older than this (seconds) */
+#define SELECT_DB_MAX_AGE	86400
+
+/* class of file, from its name */
+#define FILE_CLASS_PKG	0
+#define FILE_CLASS_DB	1
+#define FILE_CLASS_SIG	2
+
+/* maximum number of owners kept by rendezvous_add() */
+#define RENDEZVOUS_MAX	8
+
+/* return values of selection_add() */
+#define SELECT_SIZE_MISMATCH	-1
+#define SELECT_NONE		0
+#define SELECT_CHOSEN		1
+
+/* candidate, result of a probe */
+struct candidate {
+	/* HTTP status code */
+	long http_code;
+	/* total connection time */
+	double time_total;
+	/* last modified timestamp */
+	time_t last_modified;
+	/* content length, -1 if unknown */
+	off_t content_length;
+	/* throughput in bytes per second (measured or estimated), 0 if unknown */
+	double throughput;
+	/* redirects recently sent to the peer by us (local redirects only) */
+	double load;
+	/* transfers and spare upload capacity in bytes per second reported by
+	   the peer, 0 if unknown */
+	int transfers;
+	double spare;
+	/* cost, calculated by selection_add() */
+	double cost;
+};
+
+/* rendezvous, the hosts with highest score own a file */
+struct rendezvous {
+	/* file name, the first length characters are hashed */
+	const char * filename;
+	size_t length;
+	/* number of owners wanted and found */
+	int max;
+	int count;
+	/* owners with highest score first, and their scores */
+	void * owner[RENDEZVOUS_MAX];
+	uint64_t score[RENDEZVOUS_MAX];
+};
+
+/* selection, state while walking the candidates */
+struct selection {
+	/* true for database files */
+	uint8_t dbfile;
+	/* current unix timestamp */
+	time_t now;
+	/* expected size from sync database, -1 if unknown */
+	off_t size;
+	/* size in bytes from which files are selected by transfer time, 0 disables */
+	off_t throughput_size;
+	/* index of chosen candidate, -1 if none */
+	int chosen;
+	/* last modified timestamp of chosen candidate, If-Modified-Since initially */
+	time_t last_modified;
+	/* total connection time and cost of chosen candidate */
+	double time_total;
+	double cost;
+};
+
+/* file_basename */
+const char * file_basename(const char * uri);
+/* file_class */
+uint8_t file_class(const char * basename);
+/* file_url */
+int file_url(char * buffer, const size_t size, const char * hostname, const uint16_t port,
+		const uint8_t dbfile, const char * basename);
+/* rendezvous_score */
+uint64_t rendezvous_score(const char * filename, const size_t length, const char * host);
+/* rendezvous_init */
+void rendezvous_init(struct rendezvous * rendezvous, const char * filename,
+		const size_t length, const int max);
+/* rendezvous_add */
+void rendezvous_add(struct rendezvous * rendezvous, const char * host, void * owner);
+/* selection_init */
+void selection_init(struct selection * selection, const uint8_t dbfile,
+		const time_t last_modified, const off_t size, const off_t throughput_size,
+		const time_t now);
+/* selection_add */
+int selection_add(struct selection * selection, const int index, struct candidate * candidate);
+
+#endif /* _SELECT_H */
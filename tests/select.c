@@ -0,0 +1,243 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Tests for the decision made per request: file name, class and url,
+ * owners by rendezvous hashing and the selection rules. */
+
+#define _GNU_SOURCE
+#undef NDEBUG
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../select.h"
+
+#define NOW	1700000000
+#define MIB	(1024 * 1024)
+
+/*** candidate ***
+ * a peer having the file */
+static struct candidate candidate(const double time_total, const time_t last_modified,
+		const off_t content_length) {
+	struct candidate candidate = {
+		.http_code = 200,
+		.time_total = time_total,
+		.last_modified = last_modified,
+		.content_length = content_length,
+	};
+
+	return candidate;
+}
+
+/*** test_file ***/
+static void test_file(void) {
+	char url[64];
+
+	assert(strcmp(file_basename("/pkg/foo-1-1-x86_64.pkg.tar.zst"), "foo-1-1-x86_64.pkg.tar.zst") == 0);
+	assert(strcmp(file_basename("/core/os/x86_64/core.db"), "core.db") == 0);
+	assert(strcmp(file_basename("core.db"), "core.db") == 0);
+	assert(strcmp(file_basename("/"), "") == 0);
+
+	assert(file_class("core.db") == FILE_CLASS_DB);
+	assert(file_class("core.files") == FILE_CLASS_DB);
+	assert(file_class("foo-1-1-x86_64.pkg.tar.zst.sig") == FILE_CLASS_SIG);
+	assert(file_class("foo-1-1-x86_64.pkg.tar.zst") == FILE_CLASS_PKG);
+	assert(file_class("foo-1-1-x86_64.pkg.tar.zst.db.tar.gz") == FILE_CLASS_PKG);
+	/* an extension alone is no name */
+	assert(file_class(".db") == FILE_CLASS_PKG);
+	assert(file_class(".sig") == FILE_CLASS_PKG);
+
+	assert(file_url(url, sizeof(url), "peer.local", 7078, 1, "core.db") ==
+			(int) strlen("http://peer.local:7078/db/core.db"));
+	assert(strcmp(url, "http://peer.local:7078/db/core.db") == 0);
+	assert(file_url(url, sizeof(url), "peer.local", 7078, 0, "foo.pkg.tar.zst") > 0);
+	assert(strcmp(url, "http://peer.local:7078/pkg/foo.pkg.tar.zst") == 0);
+	/* truncated, like snprintf() */
+	assert(file_url(url, 16, "peer.local", 7078, 0, "foo.pkg.tar.zst") >= 16);
+	assert(strlen(url) == 15);
+}
+
+/*** test_rendezvous ***/
+static void test_rendezvous(void) {
+	const char * filename = "foo-1-1-x86_64.pkg.tar.zst";
+	struct rendezvous rendezvous, again;
+	char hosts[32][16];
+	uint64_t score;
+	int i, j, higher;
+
+	for (i = 0; i < 32; i++)
+		snprintf(hosts[i], sizeof(hosts[i]), "peer%d.local", i);
+
+	rendezvous_init(&rendezvous, filename, strlen(filename), 3);
+	for (i = 0; i < 32; i++)
+		rendezvous_add(&rendezvous, hosts[i], hosts[i]);
+	assert(rendezvous.count == 3);
+
+	/* owners are the hosts with highest score, in order */
+	for (i = 0; i < rendezvous.count; i++) {
+		score = rendezvous_score(filename, strlen(filename), rendezvous.owner[i]);
+		assert(score == rendezvous.score[i]);
+		for (j = 0, higher = 0; j < 32; j++)
+			higher += rendezvous_score(filename, strlen(filename), hosts[j]) > score;
+		assert(higher == i);
+	}
+
+	/* the order hosts are added in does not matter */
+	rendezvous_init(&again, filename, strlen(filename), 3);
+	for (i = 31; i >= 0; i--)
+		rendezvous_add(&again, hosts[i], hosts[i]);
+	for (i = 0; i < rendezvous.count; i++)
+		assert(again.owner[i] == rendezvous.owner[i]);
+
+	/* a signature has the owners of its package */
+	rendezvous_init(&again, "foo-1-1-x86_64.pkg.tar.zst.sig", strlen(filename), 3);
+	for (i = 0; i < 32; i++)
+		rendezvous_add(&again, hosts[i], hosts[i]);
+	for (i = 0; i < rendezvous.count; i++)
+		assert(again.owner[i] == rendezvous.owner[i]);
+
+	/* fewer hosts than owners wanted, and the limit */
+	rendezvous_init(&again, filename, strlen(filename), 3);
+	rendezvous_add(&again, hosts[0], hosts[0]);
+	assert(again.count == 1 && again.owner[0] == hosts[0]);
+	rendezvous_init(&again, filename, strlen(filename), RENDEZVOUS_MAX + 10);
+	for (i = 0; i < 32; i++)
+		rendezvous_add(&again, hosts[i], hosts[i]);
+	assert(again.count == RENDEZVOUS_MAX);
+}
+
+/*** test_selection_db ***/
+static void test_selection_db(void) {
+	struct selection selection;
+	struct candidate c;
+
+	/* not found is never chosen */
+	selection_init(&selection, 1, 0, -1, 0, NOW);
+	c = candidate(0.01, NOW - 60, -1);
+	c.http_code = 404;
+	assert(selection_add(&selection, 0, &c) == SELECT_NONE);
+	assert(selection.chosen == -1);
+
+	/* newer than If-Modified-Since and not too old */
+	selection_init(&selection, 1, NOW - 3600, -1, 0, NOW);
+	c = candidate(0.05, NOW - 60, -1);
+	assert(selection_add(&selection, 0, &c) == SELECT_CHOSEN);
+	/* more recent wins, even if slower */
+	c = candidate(0.10, NOW - 30, -1);
+	assert(selection_add(&selection, 1, &c) == SELECT_CHOSEN);
+	/* older loses, even if faster */
+	c = candidate(0.01, NOW - 60, -1);
+	assert(selection_add(&selection, 2, &c) == SELECT_NONE);
+	/* same age and faster wins */
+	c = candidate(0.02, NOW - 30, -1);
+	assert(selection_add(&selection, 3, &c) == SELECT_CHOSEN);
+	assert(selection.chosen == 3);
+
+	/* not newer than If-Modified-Since */
+	selection_init(&selection, 1, NOW - 60, -1, 0, NOW);
+	c = candidate(0.01, NOW - 60, -1);
+	assert(selection_add(&selection, 0, &c) == SELECT_NONE);
+	c = candidate(0.01, NOW - 120, -1);
+	assert(selection_add(&selection, 1, &c) == SELECT_NONE);
+
+	/* older than SELECT_DB_MAX_AGE is not used */
+	selection_init(&selection, 1, 0, -1, 0, NOW);
+	c = candidate(0.01, NOW - SELECT_DB_MAX_AGE - 1, -1);
+	assert(selection_add(&selection, 0, &c) == SELECT_NONE);
+	c = candidate(0.01, NOW - SELECT_DB_MAX_AGE + 1, -1);
+	assert(selection_add(&selection, 1, &c) == SELECT_CHOSEN);
+
+	/* the size is not checked for databases */
+	selection_init(&selection, 1, 0, 100, 0, NOW);
+	c = candidate(0.01, NOW - 60, 99);
+	assert(selection_add(&selection, 0, &c) == SELECT_CHOSEN);
+}
+
+/*** test_selection_pkg ***/
+static void test_selection_pkg(void) {
+	struct selection selection;
+	struct candidate c;
+
+	/* size mismatch, unknown size is fine */
+	selection_init(&selection, 0, 0, 100, 0, NOW);
+	c = candidate(0.01, NOW - 60, 99);
+	assert(selection_add(&selection, 0, &c) == SELECT_SIZE_MISMATCH);
+	c = candidate(0.02, NOW - 60, -1);
+	assert(selection_add(&selection, 1, &c) == SELECT_CHOSEN);
+	c = candidate(0.01, NOW - 60, 100);
+	assert(selection_add(&selection, 2, &c) == SELECT_CHOSEN);
+	assert(selection.chosen == 2);
+
+	/* the fastest answer wins for small files */
+	selection_init(&selection, 0, 0, MIB, 64 * MIB, NOW);
+	c = candidate(0.02, NOW - 60, MIB);
+	c.throughput = 100 * MIB;
+	assert(selection_add(&selection, 0, &c) == SELECT_CHOSEN);
+	c = candidate(0.01, NOW - 60, MIB);
+	c.throughput = MIB;
+	assert(selection_add(&selection, 1, &c) == SELECT_CHOSEN);
+	assert(c.cost == c.time_total);
+
+	/* the shortest transfer wins for large files */
+	selection_init(&selection, 0, 0, 128 * MIB, 64 * MIB, NOW);
+	c = candidate(0.01, NOW - 60, 128 * MIB);
+	c.throughput = 2 * MIB;
+	assert(selection_add(&selection, 0, &c) == SELECT_CHOSEN);
+	assert(c.cost == 0.01 + 64);
+	c = candidate(0.05, NOW - 60, 128 * MIB);
+	c.throughput = 64 * MIB;
+	assert(selection_add(&selection, 1, &c) == SELECT_CHOSEN);
+	assert(c.cost == 0.05 + 2);
+
+	/* no more than the spare capacity is expected */
+	c = candidate(0.01, NOW - 60, 128 * MIB);
+	c.throughput = 128 * MIB;
+	c.spare = 16 * MIB;
+	assert(selection_add(&selection, 2, &c) == SELECT_NONE);
+	assert(c.cost == 0.01 + 8);
+	assert(selection.chosen == 1);
+
+	/* the cost scales with load */
+	selection_init(&selection, 0, 0, MIB, 64 * MIB, NOW);
+	c = candidate(0.01, NOW - 60, MIB);
+	c.load = 1;
+	assert(selection_add(&selection, 0, &c) == SELECT_CHOSEN);
+	assert(c.cost == 0.02);
+	c = candidate(0.015, NOW - 60, MIB);
+	assert(selection_add(&selection, 1, &c) == SELECT_CHOSEN);
+	/* transfers reported by the peer include our redirects */
+	c = candidate(0.005, NOW - 60, MIB);
+	c.load = 1;
+	c.transfers = 3;
+	assert(selection_add(&selection, 2, &c) == SELECT_NONE);
+	assert(c.cost == 0.005 * 4);
+	assert(selection.chosen == 1);
+}
+
+int main(int argc, char ** argv) {
+	test_file();
+	test_rendezvous();
+	test_selection_db();
+	test_selection_pkg();
+
+	printf("All tests passed.\n");
+
+	return EXIT_SUCCESS;
+}
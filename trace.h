@@ -0,0 +1,83 @@
+/*
+ * (C) 2013-2026 by Christian Hesse <mail@eworm.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+/* A trace file starts with TRACE_MAGIC, followed by records. Every record
+ * is a struct trace_record, followed by the file name and the peers probed,
+ * each a struct trace_peer followed by the host name. Strings are not null
+ * terminated, values are in host byte order. */
+#define TRACE_MAGIC	"pacredir-trace1"
+#define TRACE_MAGIC_LEN	16
+
+/* class of file */
+#define TRACE_CLASS_PKG	0
+#define TRACE_CLASS_DB	1
+#define TRACE_CLASS_SIG	2
+
+/* decision made */
+#define TRACE_DECISION_NOT_FOUND	0
+#define TRACE_DECISION_REDIRECT		1
+#define TRACE_DECISION_SIBLING		2
+#define TRACE_DECISION_INFLIGHT		3
+#define TRACE_DECISION_UPSTREAM		4
+#define TRACE_DECISION_PREFETCH		5
+
+/* trace record */
+struct trace_record {
+	/* size of the record, including file name and peers */
+	uint32_t size;
+	/* class of file and decision */
+	uint8_t class;
+	uint8_t decision;
+	/* number of peers probed */
+	uint16_t peers;
+	/* index of chosen peer, -1 if none */
+	int16_t chosen;
+	/* length of file name */
+	uint16_t name_len;
+	/* unix timestamp of request and latency until decision, microseconds */
+	int64_t time;
+	int64_t latency;
+	/* If-Modified-Since timestamp, 0 if not given */
+	int64_t if_modified_since;
+	/* expected size from sync database, -1 if unknown */
+	int64_t size_expected;
+};
+
+/* trace peer, outcome of a probe */
+struct trace_peer {
+	/* HTTP status code, 0 on failure */
+	int32_t http_code;
+	/* length of host name */
+	uint16_t host_len;
+	uint16_t reserved;
+	/* total connection time, microseconds */
+	int64_t time_total;
+	/* last modified timestamp */
+	int64_t last_modified;
+	/* content length, -1 if unknown */
+	int64_t content_length;
+	/* throughput in bytes per second used for selection, 0 if unknown */
+	int64_t throughput;
+};
+
+#endif /* _TRACE_H */